@@ -468,7 +468,7 @@ static void process_submission(DrawGrid *grid, NeuralNet *net)
     mvprintw(GRID_SIZE + 1, 2, "Predicted: %d (Confidence: %.0f%%)    ", prediction, output[prediction] * 100.0f);
     mvprintw(GRID_SIZE + 2, 2, "Top 3: ");
     int top[3] = {0, 1, 2};
-    for (int i = 3; i < 10; i++)
+    for (int i = 3; i < MODEL_CLASSES; i++)
     {
         for (int j = 0; j < 3; j++)
         {
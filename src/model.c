@@ -0,0 +1,950 @@
+#include <stdlib.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "model.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const char *activation_names[] = {"linear", "relu", "tanh", "sigmoid", "softmax"};
+
+static int model_check(const Model *model)
+{
+    if (model->input_size != MODEL_INPUT_SIZE || model->num_layers < 1 || model->num_layers > MODEL_MAX_LAYERS)
+        return -1;
+    for (int l = 0; l < model->num_layers; l++)
+    {
+        if ((model->layers[l].activation == ACT_SOFTMAX) != (l == model->num_layers - 1))
+            return -1;
+    }
+    if (model->gather && model->layers[0].type != LAYER_DENSE)
+        return -1;
+    const ModelLayer *last = &model->layers[model->num_layers - 1];
+    return last->type == LAYER_DENSE && last->outputs == MODEL_CLASSES ? 0 : -1;
+}
+
+/* Makes the first layer read only the given pixels, in increasing order; call it before adding layers. */
+int model_set_gather(Model *model, const uint16_t *pixels, int count)
+{
+    if (model->num_layers > 0 || count < 1 || count > model->input_size)
+        return -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (pixels[i] >= model->input_size || (i > 0 && pixels[i] <= pixels[i - 1]))
+            return -1;
+    }
+    model->gather = (uint16_t *)malloc(count * sizeof(uint16_t));
+    if (!model->gather)
+        return -1;
+    memcpy(model->gather, pixels, count * sizeof(uint16_t));
+    model->gather_size = count;
+    return 0;
+}
+
+/* Appends a layer whose input is the previous layer's output (the image, or the gathered pixels, for the first
+ * one). units is the width of a dense layer or the filter count of a convolution; kernel is the window of a
+ * convolution or pooling. */
+int model_add_layer(Model *model, int type, int units, int kernel, int activation)
+{
+    if (model->num_layers == MODEL_MAX_LAYERS || activation < ACT_LINEAR || activation > ACT_SOFTMAX)
+        return -1;
+    ModelLayer *layer = &model->layers[model->num_layers];
+    memset(layer, 0, sizeof(*layer));
+    if (model->num_layers == 0 && model->gather)
+    {
+        layer->in_h = layer->in_w = 1;
+        layer->in_c = model->gather_size;
+    }
+    else if (model->num_layers == 0)
+    {
+        layer->in_h = layer->in_w = MODEL_IMAGE_DIM;
+        layer->in_c = 1;
+    }
+    else
+    {
+        const ModelLayer *prev = &model->layers[model->num_layers - 1];
+        layer->in_h = prev->out_h;
+        layer->in_w = prev->out_w;
+        layer->in_c = prev->out_c;
+    }
+    layer->type = type;
+    layer->inputs = layer->in_h * layer->in_w * layer->in_c;
+    layer->kernel = kernel;
+    layer->activation = activation;
+    switch (type)
+    {
+    case LAYER_DENSE:
+        layer->out_h = layer->out_w = 1;
+        layer->out_c = units;
+        layer->fan_in = layer->inputs;
+        break;
+    case LAYER_CONV:
+        if (kernel < 1 || kernel > layer->in_h || kernel > layer->in_w)
+            return -1;
+        layer->out_h = layer->in_h - kernel + 1;
+        layer->out_w = layer->in_w - kernel + 1;
+        layer->out_c = units;
+        layer->fan_in = kernel * kernel * layer->in_c;
+        break;
+    case LAYER_POOL:
+        if (kernel < 2 || kernel > layer->in_h || kernel > layer->in_w || activation != ACT_LINEAR)
+            return -1;
+        layer->out_h = layer->in_h / kernel;
+        layer->out_w = layer->in_w / kernel;
+        layer->out_c = layer->in_c;
+        break;
+    default:
+        return -1;
+    }
+    if (layer->out_c < 1 || (long)layer->out_h * layer->out_w * layer->out_c > MODEL_MAX_WIDTH)
+        return -1;
+    layer->outputs = layer->out_h * layer->out_w * layer->out_c;
+    model->num_layers++;
+    return 0;
+}
+
+/* Parses a comma-separated layer list such as "conv8x5:relu,pool2,64:relu,10:softmax": convCxK is C filters of
+ * K x K, poolK a K x K max-pool, and a bare number a dense layer. Dense and conv layers default to relu and the
+ * last layer to softmax. Only the shape is filled in; model_alloc allocates the parameters. */
+int model_parse(const char *spec, Model *model)
+{
+    int type[MODEL_MAX_LAYERS], units[MODEL_MAX_LAYERS], kernel[MODEL_MAX_LAYERS], act[MODEL_MAX_LAYERS];
+    int n = 0;
+    const char *p = spec;
+    while (*p)
+    {
+        if (n == MODEL_MAX_LAYERS)
+            return -1;
+        char *end;
+        type[n] = LAYER_DENSE;
+        units[n] = kernel[n] = 0;
+        act[n] = -1;
+        if (strncmp(p, "conv", 4) == 0)
+        {
+            type[n] = LAYER_CONV;
+            units[n] = (int)strtol(p + 4, &end, 10);
+            if (*end != 'x')
+                return -1;
+            kernel[n] = (int)strtol(end + 1, &end, 10);
+        }
+        else if (strncmp(p, "pool", 4) == 0)
+        {
+            type[n] = LAYER_POOL;
+            kernel[n] = (int)strtol(p + 4, &end, 10);
+            act[n] = ACT_LINEAR;
+        }
+        else
+        {
+            units[n] = (int)strtol(p, &end, 10);
+        }
+        if (end == p || (type[n] != LAYER_POOL && units[n] < 1))
+            return -1;
+        p = end;
+        if (*p == ':')
+        {
+            size_t len = strcspn(++p, ",");
+            if (type[n] == LAYER_POOL)
+                return -1;
+            for (int a = ACT_LINEAR; a <= ACT_SOFTMAX; a++)
+            {
+                if (strlen(activation_names[a]) == len && strncmp(p, activation_names[a], len) == 0)
+                    act[n] = a;
+            }
+            if (act[n] < 0)
+                return -1;
+            p += len;
+        }
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+        n++;
+    }
+    memset(model, 0, sizeof(*model));
+    model->input_size = MODEL_INPUT_SIZE;
+    for (int l = 0; l < n; l++)
+    {
+        if (act[l] < 0)
+            act[l] = l == n - 1 ? ACT_SOFTMAX : ACT_RELU;
+        if (model_add_layer(model, type[l], units[l], kernel[l], act[l]) != 0)
+            return -1;
+    }
+    return model_check(model);
+}
+
+int model_alloc(Model *model)
+{
+    for (int l = 0; l < model->num_layers; l++)
+    {
+        ModelLayer *layer = &model->layers[l];
+        if (layer->type == LAYER_POOL)
+            continue;
+        layer->weights = (float *)calloc((size_t)layer->fan_in * layer->out_c, sizeof(float));
+        layer->bias = (float *)calloc(layer->out_c, sizeof(float));
+        if (!layer->weights || !layer->bias)
+        {
+            model_free(model);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* A dense layer can run in int8 if its input is non-negative, which its uint8 quantization assumes. */
+int model_quantizable(const Model *model, int l)
+{
+    if (model->layers[l].type != LAYER_DENSE)
+        return 0;
+    while (l > 0 && model->layers[l - 1].type == LAYER_POOL)
+        l--;
+    return l == 0 || model->layers[l - 1].activation == ACT_RELU || model->layers[l - 1].activation == ACT_SIGMOID;
+}
+
+int model_alloc_quantized(ModelLayer *layer)
+{
+    layer->qweights = (int8_t *)malloc((size_t)layer->fan_in * layer->out_c);
+    layer->scales = (float *)malloc(layer->out_c * sizeof(float));
+    return layer->qweights && layer->scales ? 0 : -1;
+}
+
+/* Lays the int8 weights out for gemm_q8, widened to int16 and with each pair of input rows interleaved (an odd
+ * last row is paired with zeros); model_forward runs a layer in int8 once it is packed. */
+int model_pack_quantized(ModelLayer *layer)
+{
+    int pairs = (layer->fan_in + 1) / 2, outputs = layer->out_c;
+    layer->qpairs = (int16_t *)calloc((size_t)pairs * outputs * 2, sizeof(int16_t));
+    if (!layer->qpairs)
+        return -1;
+    for (int k = 0; k < layer->fan_in; k++)
+    {
+        const int8_t *w = &layer->qweights[(size_t)k * outputs];
+        int16_t *dst = &layer->qpairs[(size_t)(k / 2) * outputs * 2 + (k & 1)];
+        for (int j = 0; j < outputs; j++)
+            dst[2 * j] = w[j];
+    }
+    return 0;
+}
+
+/* Fraction of a layer's weights that are exactly zero. */
+double model_sparsity(const ModelLayer *layer)
+{
+    size_t n = (size_t)layer->fan_in * layer->out_c, zeros = 0;
+    for (size_t i = 0; i < n; i++)
+        zeros += layer->weights[i] == 0.0f;
+    return n ? (double)zeros / n : 0.0;
+}
+
+/* Builds the CSR copy of a dense layer's nonzero weights; model_forward runs the layer sparse once it is built. */
+int model_sparsify(ModelLayer *layer)
+{
+    size_t n = (size_t)layer->fan_in * layer->out_c, nnz = 0;
+    for (size_t i = 0; i < n; i++)
+        nnz += layer->weights[i] != 0.0f;
+    layer->csr_rows = (uint32_t *)malloc((layer->fan_in + 1) * sizeof(uint32_t));
+    layer->csr_cols = (uint16_t *)malloc((nnz ? nnz : 1) * sizeof(uint16_t));
+    layer->csr_values = (float *)malloc((nnz ? nnz : 1) * sizeof(float));
+    if (!layer->csr_rows || !layer->csr_cols || !layer->csr_values)
+        return -1;
+    uint32_t p = 0;
+    for (int k = 0; k < layer->fan_in; k++)
+    {
+        const float *w = &layer->weights[(size_t)k * layer->out_c];
+        layer->csr_rows[k] = p;
+        for (int j = 0; j < layer->out_c; j++)
+        {
+            if (w[j] != 0.0f)
+            {
+                layer->csr_cols[p] = (uint16_t)j;
+                layer->csr_values[p++] = w[j];
+            }
+        }
+    }
+    layer->csr_rows[layer->fan_in] = p;
+    return 0;
+}
+
+/* Replaces a dense first layer's weights by their signs times a per-output scale, the mean |w| over the
+ * output's weights, and packs the signs for gemm_binary; model_forward runs the layer binary once it is packed.
+ * Calling it again rebinarizes from the current weights. */
+int model_binarize(ModelLayer *layer)
+{
+    int outputs = layer->out_c;
+    if (layer->type != LAYER_DENSE || layer->fan_in > MODEL_BINARY_WORDS * 64)
+        return -1;
+    if (!layer->bits)
+    {
+        layer->bits = (uint64_t *)malloc((size_t)outputs * MODEL_BINARY_WORDS * sizeof(uint64_t));
+        layer->scales = (float *)malloc(outputs * sizeof(float));
+        if (!layer->bits || !layer->scales)
+            return -1;
+    }
+    memset(layer->bits, 0, (size_t)outputs * MODEL_BINARY_WORDS * sizeof(uint64_t));
+    memset(layer->scales, 0, outputs * sizeof(float));
+    for (int k = 0; k < layer->fan_in; k++)
+    {
+        for (int j = 0; j < outputs; j++)
+            layer->scales[j] += fabsf(layer->weights[(size_t)k * outputs + j]);
+    }
+    for (int j = 0; j < outputs; j++)
+        layer->scales[j] /= layer->fan_in;
+    for (int k = 0; k < layer->fan_in; k++)
+    {
+        float *w = &layer->weights[(size_t)k * outputs];
+        for (int j = 0; j < outputs; j++)
+        {
+            int positive = w[j] >= 0.0f;
+            w[j] = positive ? layer->scales[j] : -layer->scales[j];
+            layer->bits[(size_t)j * MODEL_BINARY_WORDS + k / 64] |= (uint64_t)positive << (k % 64);
+        }
+    }
+    return 0;
+}
+
+void model_free(Model *model)
+{
+    for (int l = 0; l < model->num_layers; l++)
+    {
+        free(model->layers[l].weights);
+        free(model->layers[l].bias);
+        free(model->layers[l].qweights);
+        free(model->layers[l].scales);
+        free(model->layers[l].qpairs);
+        free(model->layers[l].csr_rows);
+        free(model->layers[l].csr_cols);
+        free(model->layers[l].csr_values);
+        free(model->layers[l].bits);
+        model->layers[l].weights = NULL;
+        model->layers[l].bias = NULL;
+        model->layers[l].qweights = NULL;
+        model->layers[l].scales = NULL;
+        model->layers[l].qpairs = NULL;
+        model->layers[l].csr_rows = NULL;
+        model->layers[l].csr_cols = NULL;
+        model->layers[l].csr_values = NULL;
+        model->layers[l].bits = NULL;
+    }
+    free(model->gather);
+    model->gather = NULL;
+    model->gather_size = 0;
+}
+
+/* Reads a CSR layer's weights, checking the offsets and columns before filling in the dense weights from them. */
+static int read_csr(ModelLayer *layer, FILE *f)
+{
+    uint32_t nnz;
+    if (fread(&nnz, sizeof(nnz), 1, f) != 1 || nnz > (size_t)layer->fan_in * layer->out_c)
+        return 0;
+    layer->csr_rows = (uint32_t *)malloc((layer->fan_in + 1) * sizeof(uint32_t));
+    layer->csr_cols = (uint16_t *)malloc((nnz ? nnz : 1) * sizeof(uint16_t));
+    layer->csr_values = (float *)malloc((nnz ? nnz : 1) * sizeof(float));
+    if (!layer->csr_rows || !layer->csr_cols || !layer->csr_values ||
+        fread(layer->csr_rows, sizeof(uint32_t), layer->fan_in + 1, f) != (size_t)layer->fan_in + 1 ||
+        fread(layer->csr_cols, sizeof(uint16_t), nnz, f) != nnz ||
+        fread(layer->csr_values, sizeof(float), nnz, f) != nnz)
+        return 0;
+    if (layer->csr_rows[0] != 0 || layer->csr_rows[layer->fan_in] != nnz)
+        return 0;
+    for (int k = 0; k < layer->fan_in; k++)
+    {
+        if (layer->csr_rows[k + 1] < layer->csr_rows[k] || layer->csr_rows[k + 1] > nnz)
+            return 0;
+        for (uint32_t p = layer->csr_rows[k]; p < layer->csr_rows[k + 1]; p++)
+        {
+            if (layer->csr_cols[p] >= layer->out_c)
+                return 0;
+            layer->weights[(size_t)k * layer->out_c + layer->csr_cols[p]] = layer->csr_values[p];
+        }
+    }
+    return 1;
+}
+
+int model_load(const char *path, Model *model)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+    uint32_t hdr[4];
+    memset(model, 0, sizeof(*model));
+    int ok = fread(hdr, sizeof(hdr), 1, f) == 1 && hdr[0] == MODEL_MAGIC && hdr[1] >= 1 && hdr[1] <= MODEL_VERSION &&
+             hdr[3] >= 1 && hdr[3] <= MODEL_MAX_LAYERS;
+    uint32_t format[MODEL_MAX_LAYERS] = {0};
+    if (ok)
+    {
+        int layers = (int)hdr[3];
+        model->input_size = (int)hdr[2];
+        uint32_t gather = 0;
+        if (hdr[1] >= 4)
+            ok = fread(&gather, sizeof(gather), 1, f) == 1 && gather <= hdr[2];
+        if (ok && gather > 0)
+        {
+            uint16_t pixels[MODEL_INPUT_SIZE];
+            ok = model->input_size == MODEL_INPUT_SIZE && fread(pixels, sizeof(uint16_t), gather, f) == gather &&
+                 model_set_gather(model, pixels, (int)gather) == 0;
+        }
+        for (int l = 0; ok && l < layers; l++)
+        {
+            uint32_t shape[5] = {LAYER_DENSE, 0, 0, 0, 0};
+            if (hdr[1] == 1)
+                ok = fread(&shape[1], sizeof(uint32_t), 1, f) == 1 && fread(&shape[3], sizeof(uint32_t), 1, f) == 1;
+            else
+                ok = fread(shape, sizeof(uint32_t), hdr[1] == 2 ? 4 : 5, f) == (hdr[1] == 2 ? 4u : 5u);
+            ok = ok && shape[1] <= MODEL_MAX_WIDTH && shape[2] <= MODEL_IMAGE_DIM &&
+                 model_add_layer(model, (int)shape[0], (int)shape[1], (int)shape[2], (int)shape[3]) == 0 &&
+                 (shape[4] == FORMAT_FP32 || (shape[4] == FORMAT_INT8 && model_quantizable(model, l)) ||
+                  (shape[4] == FORMAT_CSR && shape[0] == LAYER_DENSE) ||
+                  (shape[4] == FORMAT_BINARY && shape[0] == LAYER_DENSE && l == 0));
+            format[l] = shape[4];
+        }
+        ok = ok && model_check(model) == 0 && model_alloc(model) == 0;
+    }
+    for (int l = 0; ok && l < model->num_layers; l++)
+    {
+        ModelLayer *layer = &model->layers[l];
+        size_t n = (size_t)layer->fan_in * layer->out_c;
+        if (layer->type == LAYER_POOL)
+            continue;
+        if (format[l] == FORMAT_INT8)
+        {
+            ok = model_alloc_quantized(layer) == 0 && fread(layer->qweights, 1, n, f) == n &&
+                 fread(layer->scales, sizeof(float), layer->out_c, f) == (size_t)layer->out_c;
+            for (size_t i = 0; ok && i < n; i++)
+                layer->weights[i] = layer->qweights[i] * layer->scales[i % layer->out_c];
+            ok = ok && model_pack_quantized(layer) == 0;
+        }
+        else if (format[l] == FORMAT_CSR)
+        {
+            ok = read_csr(layer, f);
+        }
+        else if (format[l] == FORMAT_BINARY)
+        {
+            size_t words = (size_t)layer->out_c * MODEL_BINARY_WORDS;
+            layer->bits = (uint64_t *)malloc(words * sizeof(uint64_t));
+            layer->scales = (float *)malloc(layer->out_c * sizeof(float));
+            ok = layer->bits && layer->scales &&
+                 fread(layer->scales, sizeof(float), layer->out_c, f) == (size_t)layer->out_c &&
+                 fread(layer->bits, sizeof(uint64_t), words, f) == words;
+            for (int k = 0; ok && k < layer->fan_in; k++)
+            {
+                for (int j = 0; j < layer->out_c; j++)
+                    layer->weights[(size_t)k * layer->out_c + j] =
+                        layer->bits[(size_t)j * MODEL_BINARY_WORDS + k / 64] >> (k % 64) & 1 ? layer->scales[j]
+                                                                                            : -layer->scales[j];
+            }
+        }
+        else
+        {
+            ok = fread(layer->weights, sizeof(float), n, f) == n;
+        }
+        ok = ok && fread(layer->bias, sizeof(float), layer->out_c, f) == (size_t)layer->out_c;
+    }
+    fclose(f);
+    if (!ok)
+    {
+        model_free(model);
+        return -1;
+    }
+    return 0;
+}
+
+/* Written to a temporary file and renamed over path, so a reader never sees a partial model. */
+int model_save(const char *path, const Model *model)
+{
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f)
+        return -1;
+    uint32_t hdr[5] = {MODEL_MAGIC, MODEL_VERSION, (uint32_t)model->input_size, (uint32_t)model->num_layers,
+                       (uint32_t)model->gather_size};
+    int ok = fwrite(hdr, sizeof(hdr), 1, f) == 1 &&
+             fwrite(model->gather, sizeof(uint16_t), model->gather_size, f) == (size_t)model->gather_size;
+    for (int l = 0; l < model->num_layers; l++)
+    {
+        const ModelLayer *layer = &model->layers[l];
+        uint32_t units = layer->type == LAYER_POOL ? 0 : (uint32_t)layer->out_c;
+        uint32_t format = layer->qweights ? FORMAT_INT8 : layer->csr_rows ? FORMAT_CSR : FORMAT_FP32;
+        format = layer->bits ? FORMAT_BINARY : format;
+        uint32_t shape[5] = {(uint32_t)layer->type, units, (uint32_t)layer->kernel, (uint32_t)layer->activation,
+                             format};
+        ok = ok && fwrite(shape, sizeof(shape), 1, f) == 1;
+    }
+    for (int l = 0; l < model->num_layers; l++)
+    {
+        const ModelLayer *layer = &model->layers[l];
+        size_t n = (size_t)layer->fan_in * layer->out_c;
+        if (layer->type == LAYER_POOL)
+            continue;
+        if (layer->qweights)
+            ok = ok && fwrite(layer->qweights, 1, n, f) == n &&
+                 fwrite(layer->scales, sizeof(float), layer->out_c, f) == (size_t)layer->out_c;
+        else if (layer->csr_rows)
+        {
+            uint32_t nnz = layer->csr_rows[layer->fan_in];
+            ok = ok && fwrite(&nnz, sizeof(nnz), 1, f) == 1 &&
+                 fwrite(layer->csr_rows, sizeof(uint32_t), layer->fan_in + 1, f) == (size_t)layer->fan_in + 1 &&
+                 fwrite(layer->csr_cols, sizeof(uint16_t), nnz, f) == nnz &&
+                 fwrite(layer->csr_values, sizeof(float), nnz, f) == nnz;
+        }
+        else if (layer->bits)
+            ok = ok && fwrite(layer->scales, sizeof(float), layer->out_c, f) == (size_t)layer->out_c &&
+                 fwrite(layer->bits, sizeof(uint64_t), (size_t)layer->out_c * MODEL_BINARY_WORDS, f) ==
+                     (size_t)layer->out_c * MODEL_BINARY_WORDS;
+        else
+            ok = ok && fwrite(layer->weights, sizeof(float), n, f) == n;
+        ok = ok && fwrite(layer->bias, sizeof(float), layer->out_c, f) == (size_t)layer->out_c;
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp_path, path) != 0)
+    {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static size_t max_cols(const Model *model)
+{
+    size_t cols = 0;
+    for (int l = 0; l < model->num_layers; l++)
+    {
+        const ModelLayer *layer = &model->layers[l];
+        if (layer->type == LAYER_CONV && (size_t)layer->out_h * layer->out_w * layer->fan_in > cols)
+            cols = (size_t)layer->out_h * layer->out_w * layer->fan_in;
+    }
+    return cols;
+}
+
+static size_t max_width(const Model *model)
+{
+    size_t width = model->input_size;
+    for (int l = 0; l < model->num_layers; l++)
+    {
+        if ((size_t)model->layers[l].outputs > width)
+            width = model->layers[l].outputs;
+    }
+    return width;
+}
+
+/* Floats of scratch model_forward needs: the largest im2col matrix, two activation buffers, and for int8 layers
+ * the quantized input pairs and their indices. */
+size_t model_scratch_size(const Model *model)
+{
+    return max_cols(model) + 4 * max_width(model);
+}
+
+size_t model_param_count(const Model *model)
+{
+    size_t count = 0;
+    for (int l = 0; l < model->num_layers; l++)
+    {
+        if (model->layers[l].type != LAYER_POOL)
+            count += (size_t)(model->layers[l].fan_in + 1) * model->layers[l].out_c;
+    }
+    return count;
+}
+
+/* Multiply-adds for one sample. */
+size_t model_macs(const Model *model)
+{
+    size_t macs = 0;
+    for (int l = 0; l < model->num_layers; l++)
+    {
+        const ModelLayer *layer = &model->layers[l];
+        if (layer->type != LAYER_POOL)
+            macs += (size_t)layer->out_h * layer->out_w * layer->fan_in * layer->out_c;
+    }
+    return macs;
+}
+
+/* Writes the architecture as "784-conv8x5:relu-pool2-10:softmax", with an int8, csr or bin suffix on layers stored
+ * that way; a compacted model shows its gathered input as "784>600". */
+void model_describe(const Model *model, char *buf, size_t size)
+{
+    int len = model->gather ? snprintf(buf, size, "%d>%d", model->input_size, model->gather_size)
+                            : snprintf(buf, size, "%d", model->input_size);
+    for (int l = 0; l < model->num_layers && len >= 0 && (size_t)len < size; l++)
+    {
+        const ModelLayer *layer = &model->layers[l];
+        const char *act = model_activation_name(layer->activation);
+        if (layer->type == LAYER_CONV)
+            len += snprintf(buf + len, size - len, "-conv%dx%d:%s", layer->out_c, layer->kernel, act);
+        else if (layer->type == LAYER_POOL)
+            len += snprintf(buf + len, size - len, "-pool%d", layer->kernel);
+        else
+            len += snprintf(buf + len, size - len, "-%d:%s%s", layer->outputs, act,
+                            layer->qweights ? ":int8" : layer->csr_rows ? ":csr" : layer->bits ? ":bin" : "");
+    }
+}
+
+const char *model_activation_name(int activation)
+{
+    return activation >= ACT_LINEAR && activation <= ACT_SOFTMAX ? activation_names[activation] : "unknown";
+}
+
+void model_activate(int activation, float *x, int n)
+{
+    switch (activation)
+    {
+    case ACT_RELU:
+        for (int i = 0; i < n; i++)
+            x[i] = x[i] > 0.0f ? x[i] : 0.0f;
+        break;
+    case ACT_TANH:
+        for (int i = 0; i < n; i++)
+            x[i] = tanhf(x[i]);
+        break;
+    case ACT_SIGMOID:
+        for (int i = 0; i < n; i++)
+            x[i] = 1.0f / (1.0f + expf(-x[i]));
+        break;
+    case ACT_SOFTMAX:
+    {
+        float max_val = x[0];
+        for (int i = 1; i < n; i++)
+            max_val = x[i] > max_val ? x[i] : max_val;
+        float sum = 0.0f;
+        for (int i = 0; i < n; i++)
+        {
+            x[i] = expf(x[i] - max_val);
+            sum += x[i];
+        }
+        for (int i = 0; i < n; i++)
+            x[i] /= sum;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* Multiplies the error dx by the derivative of a hidden activation, given in terms of its output y. */
+void model_activation_backward(int activation, const float *y, float *dx, int n)
+{
+    switch (activation)
+    {
+    case ACT_RELU:
+        for (int i = 0; i < n; i++)
+            dx[i] = y[i] > 0.0f ? dx[i] : 0.0f;
+        break;
+    case ACT_TANH:
+        for (int i = 0; i < n; i++)
+            dx[i] *= 1.0f - y[i] * y[i];
+        break;
+    case ACT_SIGMOID:
+        for (int i = 0; i < n; i++)
+            dx[i] *= y[i] * (1.0f - y[i]);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Unrolls a convolution's input into one row of fan_in values per output position, in weight order. */
+void model_im2col(const ModelLayer *layer, const float *input, float *cols)
+{
+    int k = layer->kernel, c = layer->in_c;
+    for (int oy = 0; oy < layer->out_h; oy++)
+    {
+        for (int ox = 0; ox < layer->out_w; ox++)
+        {
+            float *row = &cols[(size_t)(oy * layer->out_w + ox) * layer->fan_in];
+            for (int ky = 0; ky < k; ky++)
+            {
+                const float *src = &input[((oy + ky) * layer->in_w + ox) * c];
+                for (int q = 0; q < k * c; q++)
+                    row[ky * k * c + q] = src[q];
+            }
+        }
+    }
+}
+
+/* Symmetric int8 quantization: each output's scale maps its largest weight magnitude to MODEL_QUANT_MAX. */
+void model_weight_scales(const float *restrict weights, int fan_in, int outputs, float *restrict scales)
+{
+    for (int j = 0; j < outputs; j++)
+        scales[j] = 0.0f;
+    for (int k = 0; k < fan_in; k++)
+    {
+        const float *w = &weights[(size_t)k * outputs];
+        for (int j = 0; j < outputs; j++)
+            scales[j] = fabsf(w[j]) > scales[j] ? fabsf(w[j]) : scales[j];
+    }
+    for (int j = 0; j < outputs; j++)
+        scales[j] = scales[j] > 0.0f ? scales[j] / MODEL_QUANT_MAX : 1.0f;
+}
+
+/* Rounds weight rows k0..k1 to the nearest multiple of their output's scale. */
+void model_quantize_rows(const float *restrict weights, int k0, int k1, int outputs, const float *restrict scales,
+                         int8_t *restrict q)
+{
+    for (int k = k0; k < k1; k++)
+    {
+        const float *w = &weights[(size_t)k * outputs];
+        for (int j = 0; j < outputs; j++)
+            q[(size_t)k * outputs + j] = (int8_t)rintf(w[j] / scales[j]);
+    }
+}
+
+/* Eight floats as one GCC/Clang vector; without AVX the compiler splits it into SSE halves. */
+typedef float vec8 __attribute__((vector_size(MODEL_GEMM_TILE * sizeof(float))));
+
+/* n rows (at most MODEL_GEMM_ROWS, a constant after inlining) times MODEL_GEMM_TILE outputs, all kept in
+ * registers across the whole reduction. */
+static inline void gemm_tile(const float *x, int n, int fan_in, const float *weights, const float *bias, int outputs,
+                             float *y)
+{
+    vec8 acc[MODEL_GEMM_ROWS];
+    for (int b = 0; b < n; b++)
+        memcpy(&acc[b], bias, sizeof(vec8));
+    for (int k = 0; k < fan_in; k++)
+    {
+        vec8 w;
+        memcpy(&w, &weights[(size_t)k * outputs], sizeof(w));
+        for (int b = 0; b < n; b++)
+            acc[b] += x[(size_t)b * fan_in + k] * w;
+    }
+    for (int b = 0; b < n; b++)
+        memcpy(&y[(size_t)b * outputs], &acc[b], sizeof(vec8));
+}
+
+/* output[r] = bias + input[r] x weights for rows r. Wide layers accumulate each input's weight row into the
+ * output and skip zero inputs (ReLU outputs and blank pixels). Narrow ones with several rows, such as an 8-filter
+ * convolution over im2col rows, are computed in register tiles of MODEL_GEMM_ROWS rows, which hides the
+ * multiply-add latency; there a zero test per input costs more in mispredicted branches than it saves. A single
+ * row (one sample through a narrow dense layer) has no latency to hide and keeps the zero skipping. */
+void model_gemm_rows(const float *input, int rows, int fan_in, const float *weights, const float *bias, int outputs,
+                     float *output)
+{
+    if (rows < MODEL_GEMM_ROWS || outputs > 4 * MODEL_GEMM_TILE || outputs % MODEL_GEMM_TILE != 0)
+    {
+        for (int r = 0; r < rows; r++)
+        {
+            const float *x = &input[(size_t)r * fan_in];
+            float *restrict y = &output[(size_t)r * outputs];
+            memcpy(y, bias, outputs * sizeof(float));
+            for (int k = 0; k < fan_in; k++)
+            {
+                if (x[k] == 0.0f)
+                    continue;
+                const float *restrict w = &weights[(size_t)k * outputs];
+                for (int j = 0; j < outputs; j++)
+                    y[j] += x[k] * w[j];
+            }
+        }
+        return;
+    }
+    for (int j0 = 0; j0 < outputs; j0 += MODEL_GEMM_TILE)
+    {
+        int r = 0;
+        for (; r + MODEL_GEMM_ROWS <= rows; r += MODEL_GEMM_ROWS)
+        {
+            gemm_tile(&input[(size_t)r * fan_in], MODEL_GEMM_ROWS, fan_in, &weights[j0], &bias[j0], outputs,
+                      &output[(size_t)r * outputs + j0]);
+        }
+        for (; r < rows; r++)
+            gemm_tile(&input[(size_t)r * fan_in], 1, fan_in, &weights[j0], &bias[j0], outputs,
+                      &output[(size_t)r * outputs + j0]);
+    }
+}
+
+/* One sample through a quantized dense layer. The input is scaled so its maximum is 255 and rounded to uint8,
+ * and the input pairs (k, k + 1) that are not both zero are listed in xp, packed as two int16, with their pair
+ * index in nz. Each pair then takes one int16 multiply-add into int32 per output (PMADDWD) against the
+ * interleaved weights, 2 * MODEL_GEMM_TILE outputs at a time in registers with AVX2 and MODEL_GEMM_TILE with
+ * SSE2, and the sums are rescaled per output. */
+static void gemm_q8(const ModelLayer *layer, const float *input, uint32_t *xp, int32_t *nz, float *output)
+{
+    float max_val = 0.0f;
+    for (int k = 0; k < layer->fan_in; k++)
+        max_val = input[k] > max_val ? input[k] : max_val;
+    float scale = max_val / 255.0f;
+    float inv = max_val > 0.0f ? 255.0f / max_val : 0.0f;
+    int n = 0;
+    for (int k = 0; k < layer->fan_in; k += 2)
+    {
+        uint32_t a = input[k] > 0.0f ? (uint32_t)rintf(input[k] * inv) : 0;
+        uint32_t b = k + 1 < layer->fan_in && input[k + 1] > 0.0f ? (uint32_t)rintf(input[k + 1] * inv) : 0;
+        if (a | b)
+        {
+            xp[n] = a | b << 16;
+            nz[n++] = k / 2;
+        }
+    }
+    int outputs = layer->out_c, j = 0;
+    int32_t acc[2 * MODEL_GEMM_TILE];
+#ifdef __AVX2__
+    for (; j + 2 * MODEL_GEMM_TILE <= outputs; j += 2 * MODEL_GEMM_TILE)
+    {
+        __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+        for (int i = 0; i < n; i++)
+        {
+            const int16_t *w = &layer->qpairs[((size_t)nz[i] * outputs + j) * 2];
+            __m256i x = _mm256_set1_epi32((int)xp[i]);
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)w), x));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(w + 16)), x));
+        }
+        _mm256_storeu_si256((__m256i *)acc, acc0);
+        _mm256_storeu_si256((__m256i *)(acc + 8), acc1);
+        for (int t = 0; t < 2 * MODEL_GEMM_TILE; t++)
+            output[j + t] = layer->bias[j + t] + acc[t] * scale * layer->scales[j + t];
+    }
+#endif
+#ifdef __SSE2__
+    for (; j + MODEL_GEMM_TILE <= outputs; j += MODEL_GEMM_TILE)
+    {
+        __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+        for (int i = 0; i < n; i++)
+        {
+            const int16_t *w = &layer->qpairs[((size_t)nz[i] * outputs + j) * 2];
+            __m128i x = _mm_set1_epi32((int)xp[i]);
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)w), x));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(w + 8)), x));
+        }
+        _mm_storeu_si128((__m128i *)acc, acc0);
+        _mm_storeu_si128((__m128i *)(acc + 4), acc1);
+        for (int t = 0; t < MODEL_GEMM_TILE; t++)
+            output[j + t] = layer->bias[j + t] + acc[t] * scale * layer->scales[j + t];
+    }
+#endif
+    for (; j < outputs; j++)
+    {
+        int32_t sum = 0;
+        for (int i = 0; i < n; i++)
+        {
+            const int16_t *w = &layer->qpairs[((size_t)nz[i] * outputs + j) * 2];
+            sum += (int32_t)(xp[i] & 0xffff) * w[0] + (int32_t)(xp[i] >> 16) * w[1];
+        }
+        output[j] = layer->bias[j] + sum * scale * layer->scales[j];
+    }
+}
+
+/* One sample through a sparse dense layer: each nonzero input scatters into the outputs its CSR row reaches. */
+static void gemm_csr(const ModelLayer *layer, const float *input, float *output)
+{
+    memcpy(output, layer->bias, layer->out_c * sizeof(float));
+    for (int k = 0; k < layer->fan_in; k++)
+    {
+        float x = input[k];
+        if (x == 0.0f)
+            continue;
+        for (uint32_t p = layer->csr_rows[k]; p < layer->csr_rows[k + 1]; p++)
+            output[layer->csr_cols[p]] += x * layer->csr_values[p];
+    }
+}
+
+static int popcount_and(const uint64_t *x, const uint64_t *w)
+{
+#ifdef __POPCNT__
+    int count = 0;
+    for (int i = 0; i < MODEL_BINARY_WORDS; i++)
+        count += __builtin_popcountll(x[i] & w[i]);
+    return count;
+#else
+    uint64_t bytes = 0;
+    for (int i = 0; i < MODEL_BINARY_WORDS; i++)
+    {
+        uint64_t v = x[i] & w[i];
+        v -= (v >> 1) & 0x5555555555555555ull;
+        v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+        bytes += (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    }
+    uint64_t halves = (bytes & 0x00ff00ff00ff00ffull) + ((bytes >> 8) & 0x00ff00ff00ff00ffull);
+    return (int)((halves * 0x0001000100010001ull) >> 48);
+#endif
+}
+
+/* One sample through a binary layer: the inputs at least half the largest one are packed into bits, and with
+ * weights of +-scale each output is scale * (inputs on under positive weights - those under negative ones), that
+ * is scale * (2 * popcount(x & w) - popcount(x)): one AND and POPCNT per 64 inputs. Without the POPCNT
+ * instruction the counts are summed bytewise across the words (SWAR) and reduced once per output. */
+static void gemm_binary(const ModelLayer *layer, const float *input, float *output)
+{
+    uint64_t x[MODEL_BINARY_WORDS] = {0};
+    float max_val = 0.0f;
+    for (int k = 0; k < layer->fan_in; k++)
+        max_val = input[k] > max_val ? input[k] : max_val;
+    for (int k = 0; max_val > 0.0f && k < layer->fan_in; k++)
+        x[k / 64] |= (uint64_t)(2.0f * input[k] >= max_val) << (k % 64);
+    int on = popcount_and(x, x);
+    for (int j = 0; j < layer->out_c; j++)
+    {
+        int count = popcount_and(x, &layer->bits[(size_t)j * MODEL_BINARY_WORDS]);
+        output[j] = layer->bias[j] + layer->scales[j] * (float)(2 * count - on);
+    }
+}
+
+void model_pool(const ModelLayer *layer, const float *input, float *output)
+{
+    int k = layer->kernel, c = layer->in_c;
+    for (int oy = 0; oy < layer->out_h; oy++)
+    {
+        for (int ox = 0; ox < layer->out_w; ox++)
+        {
+            float *y = &output[(oy * layer->out_w + ox) * c];
+            memcpy(y, &input[(oy * k * layer->in_w + ox * k) * c], c * sizeof(float));
+            for (int ky = 0; ky < k; ky++)
+            {
+                for (int kx = 0; kx < k; kx++)
+                {
+                    const float *x = &input[((oy * k + ky) * layer->in_w + ox * k + kx) * c];
+                    for (int ch = 0; ch < c; ch++)
+                        y[ch] = x[ch] > y[ch] ? x[ch] : y[ch];
+                }
+            }
+        }
+    }
+}
+
+/* One sample through every layer. scratch holds model_scratch_size(model) floats; output gets MODEL_CLASSES
+ * probabilities. A compacted model's pixels are gathered into the second activation buffer, which the first
+ * layer does not write. */
+void model_forward(const Model *model, const float *input, float *output, float *scratch)
+{
+    float *cols = scratch;
+    float *buf[2] = {scratch + max_cols(model), scratch + max_cols(model) + max_width(model)};
+    uint32_t *xp = (uint32_t *)(buf[1] + max_width(model));
+    int32_t *nz = (int32_t *)(buf[1] + 2 * max_width(model));
+    const float *x = input;
+    if (model->gather)
+    {
+        for (int i = 0; i < model->gather_size; i++)
+            buf[1][i] = input[model->gather[i]];
+        x = buf[1];
+    }
+    for (int l = 0; l < model->num_layers; l++)
+    {
+        const ModelLayer *layer = &model->layers[l];
+        float *y = l == model->num_layers - 1 ? output : buf[l & 1];
+        if (layer->type == LAYER_CONV)
+        {
+            model_im2col(layer, x, cols);
+            model_gemm_rows(cols, layer->out_h * layer->out_w, layer->fan_in, layer->weights, layer->bias,
+                            layer->out_c, y);
+        }
+        else if (layer->type == LAYER_POOL)
+        {
+            model_pool(layer, x, y);
+        }
+        else if (layer->bits)
+        {
+            gemm_binary(layer, x, y);
+        }
+        else if (layer->qpairs)
+        {
+            gemm_q8(layer, x, xp, nz, y);
+        }
+        else if (layer->csr_rows)
+        {
+            gemm_csr(layer, x, y);
+        }
+        else
+        {
+            model_gemm_rows(x, 1, layer->fan_in, layer->weights, layer->bias, layer->out_c, y);
+        }
+        model_activate(layer->activation, y, layer->outputs);
+        x = y;
+    }
+}
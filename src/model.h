@@ -0,0 +1,112 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MODEL_IMAGE_DIM 28
+#define MODEL_INPUT_SIZE (MODEL_IMAGE_DIM * MODEL_IMAGE_DIM)
+#define MODEL_CLASSES 10
+#define MODEL_MAX_LAYERS 8
+#define MODEL_MAX_WIDTH 65536
+#define MODEL_GEMM_TILE 8
+#define MODEL_GEMM_ROWS 4
+#define MODEL_MAGIC 0x4c444d44u
+#define MODEL_VERSION 4
+#define MODEL_QUANT_MAX 127
+#define MODEL_CSR_MIN_SPARSITY 0.5
+#define MODEL_BINARY_WORDS ((MODEL_INPUT_SIZE + 63) / 64)
+#define MODEL_PATH "model.bin"
+
+#define LAYER_DENSE 0
+#define LAYER_CONV 1
+#define LAYER_POOL 2
+
+#define ACT_LINEAR 0
+#define ACT_RELU 1
+#define ACT_TANH 2
+#define ACT_SIGMOID 3
+#define ACT_SOFTMAX 4
+
+#define FORMAT_FP32 0
+#define FORMAT_INT8 1
+#define FORMAT_CSR 2
+#define FORMAT_BINARY 3
+
+/* One layer. Activations are stored position-major with channels innermost (HWC), so a dense layer after a
+ * convolution sees the feature maps flattened in that order. Dense: weights is [inputs][outputs]. Conv: stride 1,
+ * no padding, weights is [kernel][kernel][in_c][out_c] so that over im2col rows it is the same GEMM as a dense
+ * layer with fan_in inputs. Pool: max over kernel x kernel windows with stride kernel, no parameters.
+ * A quantized dense layer also has int8 weights with one scale per output, weights = qweights * scales; its input
+ * must be non-negative (the image, or a ReLU or sigmoid output) and is quantized to uint8 per sample. A sparse
+ * dense layer also keeps its nonzero weights in CSR form by input row, so that inference skips both the zero
+ * inputs and the pruned weights. A binary first layer has weights of +-scale per output, with the signs packed
+ * in bits, and sees each input as 1 if it is at least half the sample's largest input and 0 otherwise. */
+typedef struct
+{
+    int type;
+    int inputs; /* values per sample, in_h * in_w * in_c */
+    int outputs;
+    int in_h, in_w, in_c;
+    int out_h, out_w, out_c;
+    int kernel;
+    int fan_in; /* weight rows: inputs for dense, kernel * kernel * in_c for conv, 0 for pool */
+    int activation;
+    float *weights;
+    float *bias;
+    int8_t *qweights; /* int8 weights in the same layout, or NULL for fp32 */
+    float *scales;
+    int16_t *qpairs; /* qweights for inference, [fan_in / 2][outputs][2]: input pairs (k, k + 1) side by side */
+    uint32_t *csr_rows; /* fan_in + 1 offsets into csr_cols and csr_values, or NULL for a dense layout */
+    uint16_t *csr_cols;
+    float *csr_values;
+    uint64_t *bits; /* binary layer: [outputs][MODEL_BINARY_WORDS], set where the weight is positive, or NULL */
+} ModelLayer;
+
+/* A layer list from a MODEL_IMAGE_DIM x MODEL_IMAGE_DIM image to MODEL_CLASSES softmax outputs. The model file
+ * is a header of (magic, version, input size, layer count, gather count), the gathered pixel indices as uint16,
+ * then (type, units, kernel, activation, format) per layer, then each layer's weights and bias in order, all
+ * native-endian. In place of the fp32 weights an int8 layer stores its int8 weights and scales, and a CSR layer
+ * its nonzero count, row offsets, column indices and values, and a binary layer its scales and sign bits. A
+ * compacted model gathers the image pixels it reads into a vector first, and its first layer must then be dense
+ * over that vector. Version 3 files have no gather, version 2 files no format field either, and version 1 files
+ * hold dense layers only, with (units, activation) per layer. */
+typedef struct
+{
+    int input_size;
+    int num_layers;
+    int gather_size;
+    uint16_t *gather; /* the first layer's inputs as image pixel indices, or NULL for the whole image */
+    ModelLayer layers[MODEL_MAX_LAYERS];
+} Model;
+
+int model_set_gather(Model *model, const uint16_t *pixels, int count);
+int model_add_layer(Model *model, int type, int units, int kernel, int activation);
+int model_parse(const char *spec, Model *model);
+int model_alloc(Model *model);
+int model_quantizable(const Model *model, int l);
+int model_alloc_quantized(ModelLayer *layer);
+int model_pack_quantized(ModelLayer *layer);
+double model_sparsity(const ModelLayer *layer);
+int model_sparsify(ModelLayer *layer);
+int model_binarize(ModelLayer *layer);
+void model_free(Model *model);
+int model_load(const char *path, Model *model);
+int model_save(const char *path, const Model *model);
+size_t model_scratch_size(const Model *model);
+size_t model_param_count(const Model *model);
+size_t model_macs(const Model *model);
+void model_describe(const Model *model, char *buf, size_t size);
+const char *model_activation_name(int activation);
+void model_activate(int activation, float *x, int n);
+void model_activation_backward(int activation, const float *y, float *dx, int n);
+void model_im2col(const ModelLayer *layer, const float *input, float *cols);
+void model_weight_scales(const float *restrict weights, int fan_in, int outputs, float *restrict scales);
+void model_quantize_rows(const float *restrict weights, int k0, int k1, int outputs, const float *restrict scales,
+                         int8_t *restrict q);
+void model_gemm_rows(const float *input, int rows, int fan_in, const float *weights, const float *bias, int outputs,
+                     float *output);
+void model_pool(const ModelLayer *layer, const float *input, float *output);
+void model_forward(const Model *model, const float *input, float *output, float *scratch);
+
+#endif // MODEL_H
@@ -1,5 +1,4 @@
 #include <stdlib.h>
-#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include "neural_net.h"
@@ -7,9 +6,101 @@
 #include "draw_interface.h"
 #include "utils.h"
 
-static float relu(float x)
+/* Falls back to the network compiled in from weights.h when there is no model file; a header exported by
+ * quantization-aware training also carries int8 weights, and the model then runs in int8. Pruned hidden weights
+ * run through the CSR kernel instead. */
+static int builtin_model(Model *model)
 {
-    return x > 0.0f ? x : 0.0f;
+    model->input_size = INPUT_SIZE;
+    model_add_layer(model, LAYER_DENSE, HIDDEN_SIZE, 0, ACT_RELU);
+    model_add_layer(model, LAYER_DENSE, OUTPUT_SIZE, 0, ACT_SOFTMAX);
+    if (model_alloc(model) != 0)
+        return -1;
+    memcpy(model->layers[0].weights, HIDDEN_WEIGHTS, INPUT_SIZE * HIDDEN_SIZE * sizeof(float));
+    memcpy(model->layers[0].bias, HIDDEN_BIAS, HIDDEN_SIZE * sizeof(float));
+    memcpy(model->layers[1].weights, OUTPUT_WEIGHTS, HIDDEN_SIZE * OUTPUT_SIZE * sizeof(float));
+    memcpy(model->layers[1].bias, OUTPUT_BIAS, OUTPUT_SIZE * sizeof(float));
+#ifdef WEIGHTS_INT8
+    if (model_alloc_quantized(&model->layers[0]) != 0 || model_alloc_quantized(&model->layers[1]) != 0)
+    {
+        model_free(model);
+        return -1;
+    }
+    memcpy(model->layers[0].qweights, HIDDEN_WEIGHTS_Q, INPUT_SIZE * HIDDEN_SIZE);
+    memcpy(model->layers[0].scales, HIDDEN_SCALES, HIDDEN_SIZE * sizeof(float));
+    memcpy(model->layers[1].qweights, OUTPUT_WEIGHTS_Q, HIDDEN_SIZE * OUTPUT_SIZE);
+    memcpy(model->layers[1].scales, OUTPUT_SCALES, OUTPUT_SIZE * sizeof(float));
+    if (model_pack_quantized(&model->layers[0]) != 0 || model_pack_quantized(&model->layers[1]) != 0)
+    {
+        model_free(model);
+        return -1;
+    }
+#else
+    if (model_sparsity(&model->layers[0]) >= MODEL_CSR_MIN_SPARSITY && model_sparsify(&model->layers[0]) != 0)
+    {
+        model_free(model);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* Tables for a dense first layer over quantize_input's output: for each group of LUT_GROUP consecutive pixels
+ * and each pattern of lit pixels in it, the sum of the lit pixels' weight rows at NORMALIZED_MAX_VALUE. The layer
+ * is then one row addition per group with any ink, in place of a multiply-add per lit pixel. Each pattern is the
+ * one without its highest pixel plus that pixel's row. Other first layers keep the model's own kernels. */
+static int build_lut(NeuralNet *net)
+{
+    const ModelLayer *layer = &net->model.layers[0];
+    int units = layer->outputs;
+    if (layer->type != LAYER_DENSE || layer->bits || net->model.gather || net->model.num_layers < 2)
+        return 0;
+    net->lut = (float *)malloc((size_t)LUT_GROUPS * LUT_ENTRIES * units * sizeof(float));
+    net->input = (float *)malloc(MODEL_INPUT_SIZE * sizeof(float));
+    net->hidden = (float *)malloc(units * sizeof(float));
+    if (!net->lut || !net->input || !net->hidden)
+        return -1;
+    for (int g = 0; g < LUT_GROUPS; g++)
+    {
+        float *group = &net->lut[(size_t)g * LUT_ENTRIES * units];
+        for (int p = 1; p <= LUT_ENTRIES; p++)
+        {
+            int top = 0;
+            while (p >> (top + 1))
+                top++;
+            int rest = p & ~(1 << top);
+            const float *w = &layer->weights[(size_t)(g * LUT_GROUP + top) * units];
+            float *row = &group[(size_t)(p - 1) * units];
+            for (int j = 0; j < units; j++)
+                row[j] = (rest ? group[(size_t)(rest - 1) * units + j] : 0.0f) + NORMALIZED_MAX_VALUE * w[j];
+        }
+    }
+    net->rest = net->model;
+    net->rest.input_size = units;
+    net->rest.num_layers--;
+    memmove(net->rest.layers, &net->rest.layers[1], net->rest.num_layers * sizeof(ModelLayer));
+    return 0;
+}
+
+/* One quantized sample through the first layer's tables, then the remaining layers. */
+static void lut_forward(NeuralNet *net, const float *input, float *output)
+{
+    const ModelLayer *layer = &net->model.layers[0];
+    int units = layer->outputs;
+    float *h = net->hidden;
+    memcpy(h, layer->bias, units * sizeof(float));
+    for (int g = 0; g < LUT_GROUPS; g++)
+    {
+        const float *x = &input[g * LUT_GROUP];
+        int p = (x[0] != 0.0f) | (x[1] != 0.0f) << 1 | (x[2] != 0.0f) << 2 | (x[3] != 0.0f) << 3;
+        if (p == 0)
+            continue;
+        const float *row = &net->lut[((size_t)g * LUT_ENTRIES + p - 1) * units];
+        for (int j = 0; j < units; j++)
+            h[j] += row[j];
+    }
+    model_activate(layer->activation, h, units);
+    model_forward(&net->rest, h, output, net->scratch);
 }
 
 NeuralNet *init_neural_net(void)
@@ -24,7 +115,7 @@ NeuralNet *init_neural_net(void)
     fprintf(debug_log, "Initializing neural network\n");
     fflush(debug_log);
 
-    NeuralNet *net = (NeuralNet *)malloc(sizeof(NeuralNet));
+    NeuralNet *net = (NeuralNet *)calloc(1, sizeof(NeuralNet));
     if (!net)
     {
         fprintf(debug_log, "Failed to allocate neural network structure\n");
@@ -33,12 +124,15 @@ NeuralNet *init_neural_net(void)
         return NULL;
     }
 
-    net->hidden_weights = (float *)malloc(INPUT_SIZE * HIDDEN_SIZE * sizeof(float));
-    net->hidden_bias = (float *)malloc(HIDDEN_SIZE * sizeof(float));
-    net->output_weights = (float *)malloc(HIDDEN_SIZE * OUTPUT_SIZE * sizeof(float));
-    net->output_bias = (float *)malloc(OUTPUT_SIZE * sizeof(float));
-
-    if (!net->hidden_weights || !net->hidden_bias || !net->output_weights || !net->output_bias)
+    if (model_load(MODEL_PATH, &net->model) == 0)
+    {
+        fprintf(debug_log, "Loaded model from %s\n", MODEL_PATH);
+    }
+    else if (builtin_model(&net->model) == 0)
+    {
+        fprintf(debug_log, "No usable %s, using the built-in weights\n", MODEL_PATH);
+    }
+    else
     {
         fprintf(debug_log, "Failed to allocate weights/biases\n");
         fflush(debug_log);
@@ -47,12 +141,30 @@ NeuralNet *init_neural_net(void)
         return NULL;
     }
 
-    memcpy(net->hidden_weights, HIDDEN_WEIGHTS, INPUT_SIZE * HIDDEN_SIZE * sizeof(float));
-    memcpy(net->hidden_bias, HIDDEN_BIAS, HIDDEN_SIZE * sizeof(float));
-    memcpy(net->output_weights, OUTPUT_WEIGHTS, HIDDEN_SIZE * OUTPUT_SIZE * sizeof(float));
-    memcpy(net->output_bias, OUTPUT_BIAS, OUTPUT_SIZE * sizeof(float));
+    net->scratch = (float *)malloc(model_scratch_size(&net->model) * sizeof(float));
+    if (!net->scratch)
+    {
+        fprintf(debug_log, "Failed to allocate activations\n");
+        fflush(debug_log);
+        free_neural_net(net);
+        fclose(debug_log);
+        return NULL;
+    }
+    if (LUT_FIRST_LAYER && build_lut(net) != 0)
+    {
+        fprintf(debug_log, "Failed to allocate the first-layer tables\n");
+        fflush(debug_log);
+        free_neural_net(net);
+        fclose(debug_log);
+        return NULL;
+    }
+    if (net->lut)
+        fprintf(debug_log, "First layer runs by table lookup (%zu KB of tables)\n",
+                (size_t)LUT_GROUPS * LUT_ENTRIES * net->model.layers[0].outputs * sizeof(float) / 1024);
 
-    fprintf(debug_log, "Neural network initialized successfully\n");
+    char desc[256];
+    model_describe(&net->model, desc, sizeof(desc));
+    fprintf(debug_log, "Neural network initialized successfully: %s\n", desc);
     fflush(debug_log);
     fclose(debug_log);
     return net;
@@ -62,10 +174,11 @@ void free_neural_net(NeuralNet *net)
 {
     if (net)
     {
-        free(net->hidden_weights);
-        free(net->hidden_bias);
-        free(net->output_weights);
-        free(net->output_bias);
+        model_free(&net->model);
+        free(net->scratch);
+        free(net->lut);
+        free(net->input);
+        free(net->hidden);
         free(net);
     }
 }
@@ -78,55 +191,33 @@ float *forward_pass(NeuralNet *net, float *input)
 
     fprintf(debug_log, "\n=== Starting Forward Pass ===\n");
 
-    float *hidden = (float *)malloc(HIDDEN_SIZE * sizeof(float));
-    float *output = (float *)malloc(OUTPUT_SIZE * sizeof(float));
-    if (!hidden || !output)
+    float *output = (float *)malloc(MODEL_CLASSES * sizeof(float));
+    if (!output)
     {
         fprintf(debug_log, "Memory allocation failed\n");
-        free(hidden);
-        free(output);
         fclose(debug_log);
         return NULL;
     }
 
-    fprintf(debug_log, "Computing hidden layer with ReLU activation\n");
-    for (int i = 0; i < HIDDEN_SIZE; i++)
-    {
-        float sum = net->hidden_bias[i];
-        for (int j = 0; j < INPUT_SIZE; j++)
-        {
-            sum += input[j] * net->hidden_weights[j * HIDDEN_SIZE + i];
-        }
-        hidden[i] = relu(sum);
-    }
-
-    fprintf(debug_log, "Computing output layer with softmax activation\n");
-    float max_val = -INFINITY;
-    for (int i = 0; i < OUTPUT_SIZE; i++)
+    for (int l = 0; l < net->model.num_layers; l++)
     {
-        float sum = net->output_bias[i];
-        for (int j = 0; j < HIDDEN_SIZE; j++)
-        {
-            sum += hidden[j] * net->output_weights[j * OUTPUT_SIZE + i];
-        }
-        output[i] = sum;
-        if (sum > max_val)
-            max_val = sum;
+        const ModelLayer *layer = &net->model.layers[l];
+        const char *kind = layer->type == LAYER_CONV ? "conv" : layer->type == LAYER_POOL ? "max-pool" : "dense";
+        fprintf(debug_log, "Computing %s layer %d (%dx%dx%d) with %s activation\n", kind, l + 1, layer->out_h,
+                layer->out_w, layer->out_c, model_activation_name(layer->activation));
     }
-
-    float sum = 0.0f;
-    for (int i = 0; i < OUTPUT_SIZE; i++)
+    if (net->lut)
     {
-        output[i] = expf(output[i] - max_val);
-        sum += output[i];
+        quantize_input(input, net->input);
+        lut_forward(net, net->input, output);
     }
-    for (int i = 0; i < OUTPUT_SIZE; i++)
+    else
     {
-        output[i] /= sum;
+        model_forward(&net->model, input, output, net->scratch);
     }
 
     fprintf(debug_log, "\nPrediction probabilities:\n");
-    for (int i = 0; i < OUTPUT_SIZE; i++)
+    for (int i = 0; i < MODEL_CLASSES; i++)
     {
         fprintf(debug_log, "  %d: %.3f%%\n", i, output[i] * 100.0f);
     }
@@ -134,7 +225,6 @@ float *forward_pass(NeuralNet *net, float *input)
     fprintf(debug_log, "=== Forward Pass Complete ===\n\n");
     fflush(debug_log);
     fclose(debug_log);
-    free(hidden);
     return output;
 }
 
@@ -143,7 +233,7 @@ int get_prediction(float *output)
     int best_idx = 0;
     float best_conf = output[0];
 
-    for (int i = 1; i < OUTPUT_SIZE; i++)
+    for (int i = 1; i < MODEL_CLASSES; i++)
     {
         if (output[i] > best_conf)
         {
@@ -2,13 +2,23 @@
 #define NEURAL_NET_H
 
 #include "draw_interface.h"
+#include "model.h"
+
+#ifndef LUT_FIRST_LAYER
+#define LUT_FIRST_LAYER 0 /* 1: binarize the input and run a dense first layer by table lookup */
+#endif
+#define LUT_GROUP 4
+#define LUT_ENTRIES ((1 << LUT_GROUP) - 1) /* lit-pixel patterns per group; an all-dark group adds nothing */
+#define LUT_GROUPS (MODEL_INPUT_SIZE / LUT_GROUP)
 
 typedef struct
 {
-    float *hidden_weights;
-    float *hidden_bias;
-    float *output_weights;
-    float *output_bias;
+    Model model;
+    float *scratch;
+    float *lut;    /* [LUT_GROUPS][LUT_ENTRIES][first-layer units] partial sums, or NULL */
+    float *input;  /* forward_pass's quantized copy of the input when the first layer runs from lut */
+    float *hidden; /* the first layer's output when it runs from lut */
+    Model rest;    /* the layers after the first, sharing model's parameters; never freed itself */
 } NeuralNet;
 
 NeuralNet *init_neural_net(void);
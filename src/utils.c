@@ -159,4 +159,17 @@ float *preprocess_grid(DrawGrid *grid)
     close_debug_log(debug_log);
 
     return input;
+}
+
+/* Snaps preprocess_grid's output into output as 0 or NORMALIZED_MAX_VALUE, for the table-lookup first layer. A
+ * pixel is lit when it is at least half the brightest one, the rule gemm_binary packs its input bits by, so both
+ * binarized first layers see the same pixels. Drawn strokes saturate at NORMALIZED_MAX_VALUE, which puts the
+ * threshold at 127.5, next to the BINARY_THRESHOLD debug_print_grid shows. */
+void quantize_input(const float *input, float *output)
+{
+    float max_val = 0.0f;
+    for (int i = 0; i < GRID_SIZE * GRID_SIZE; i++)
+        max_val = input[i] > max_val ? input[i] : max_val;
+    for (int i = 0; i < GRID_SIZE * GRID_SIZE; i++)
+        output[i] = max_val > 0.0f && 2.0f * input[i] >= max_val ? NORMALIZED_MAX_VALUE : 0.0f;
 }
\ No newline at end of file
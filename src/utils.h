@@ -15,5 +15,6 @@
 #define DEBUG_LOG_MODE "a"
 
 float *preprocess_grid(DrawGrid *grid);
+void quantize_input(const float *input, float *output);
 
 #endif // UTILS_H
\ No newline at end of file
@@ -25,16 +25,39 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
 #include <zlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
+#ifdef __AVX512BF16__
+#include <immintrin.h>
+#endif
+
+#include "src/model.h"
+
 #ifndef _OPENMP
+#define omp_in_parallel() 0
 #define omp_get_thread_num() 0
 #define omp_get_max_threads() 1
+#define omp_get_num_threads() 1
+#define omp_set_num_threads(n) ((void)(n))
 #endif
 
 #define RAND_SEED 42
@@ -51,15 +74,174 @@
 #define BASE_LR 0.1f
 #define LR_DECAY 0.95f
 #define MOMENTUM 0.9f
+#define ADAM_LR 0.001f
+#define ADAM_BETA1 0.9f
+#define ADAM_BETA2 0.999f
+#define ADAM_EPS 1e-8f
+#define ADAMW_WEIGHT_DECAY 0.01f
+#define SCHEDULE_WARMUP 0.1f       /* cosine and linear: default warmup as a fraction of the run */
+#define ONECYCLE_WARMUP 0.3f       /* one-cycle: fraction of the run spent ramping up */
+#define ONECYCLE_DIV 25.0f         /* one-cycle: starting rate is the peak / ONECYCLE_DIV */
+#define ONECYCLE_FINAL_DIV 1e4f    /* one-cycle: final rate is the starting rate / ONECYCLE_FINAL_DIV */
+#define ONECYCLE_MOMENTUM_MIN 0.85f
+#define ONECYCLE_MOMENTUM_MAX 0.95f
+#define LR_RANGE_MIN 1e-5f
+#define LR_RANGE_MAX 10.0f
+#define LR_RANGE_STEPS 300
+#define LR_RANGE_SMOOTHING 0.98f
+#define DISTILL_TEMPERATURE 4.0f
+#define DISTILL_ALPHA 0.9f /* weight of the soft-target loss; the label cross-entropy gets the rest */
+#define JACOBI_SWEEPS 50
+#define OPT_BLOCK 8
+#define OPT_STATE_SIZE(n) (2 * (((n) + OPT_BLOCK - 1) / OPT_BLOCK) * OPT_BLOCK)
+#define OPT_STATE_OFFSET(first) (2 * (first))
 
-#define INPUT_SIZE 784
+#define INPUT_SIZE MODEL_INPUT_SIZE
 #define HIDDEN_SIZE 256
-#define OUTPUT_SIZE 10
+#define OUTPUT_SIZE MODEL_CLASSES
 #define BATCH_SIZE 64
 #define NUM_EPOCHS 10
 #define SAMPLES_PER_DIGIT 1500
 #define TOTAL_SAMPLES (SAMPLES_PER_DIGIT * OUTPUT_SIZE * 2)
 
+#define DATASET_MAGIC 0x43535344u
+#define DATASET_VERSION 1
+#define DATASET_ALIGN 4096
+#define DATASET_CACHE_PATH "mnist-train.cache"
+#define AUG_CACHE_FORMAT "mnist-aug-%016llx.cache"
+#define AUG_VERSION 1
+#define CHECKPOINT_MAGIC 0x4b435344u
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_PATH "train.ckpt"
+#define CHECKPOINT_BEST_FORMAT "%s.best"
+#define CHECKPOINT_SLOTS 2 /* an epoch can save the best and the regular checkpoint */
+#define T10K_IMAGES "t10k-images-idx3-ubyte.gz"
+#define T10K_LABELS "t10k-labels-idx1-ubyte.gz"
+#define VALIDATION_SPLIT 5000
+#define SHARD_PATH_FORMAT "%s-%05d.shard"
+#define SHARD_SIZE 65536
+#define SHARD_CHUNK_SAMPLES 4096
+#define SHARD_READ_AHEAD 4
+#define SHUFFLE_BUFFER 16384
+#define BINARIZE_THRESHOLD 128
+#define PIXEL_SCALE (1.0f / 255.0f)
+#define GEMM_ROWS 4
+
+#define TASK_ROWS 8
+#define ROW_TILES (BATCH_SIZE / TASK_ROWS)
+#define WEIGHT_TILES 16
+#define WEIGHT_TILE_ROWS ((INPUT_SIZE + WEIGHT_TILES - 1) / WEIGHT_TILES)
+#define BENCH_STEPS 200
+#define QAT_ROWS 16
+#define PRUNE_INTERVAL 100
+#define PRUNE_RAMP 0.75
+#define MODEL_GRAD_CHUNKS 16
+#define GRAD_SIZE (INPUT_SIZE * HIDDEN_SIZE + HIDDEN_SIZE * OUTPUT_SIZE + HIDDEN_SIZE + OUTPUT_SIZE)
+#define STATE_SIZE                                                                                                    \
+    (OPT_STATE_SIZE(INPUT_SIZE * HIDDEN_SIZE) + OPT_STATE_SIZE(HIDDEN_SIZE * OUTPUT_SIZE) +                           \
+     OPT_STATE_SIZE(HIDDEN_SIZE) + OPT_STATE_SIZE(OUTPUT_SIZE))
+#define SNAPSHOT_SIZE (GRAD_SIZE + STATE_SIZE)
+#define REDUCE_CHUNK 4096
+#define LARS_ETA 0.02f
+#define COMM_BUCKETS 4
+#define COMM_BUCKET_ROWS ((INPUT_SIZE + COMM_BUCKETS - 1) / COMM_BUCKETS)
+
+#define EXECUTOR_FORK_JOIN 0
+#define EXECUTOR_TASKS 1
+#define OPT_SGD 0
+#define OPT_NESTEROV 1
+#define OPT_ADAM 2
+#define OPT_ADAMW 3
+#define LR_SCALING_NONE 0
+#define LR_SCALING_LINEAR 1
+#define LR_SCALING_SQRT 2
+#define PRECISION_FP32 0
+#define PRECISION_BF16 1
+#define SCHEDULE_STEP 0
+#define SCHEDULE_ONECYCLE 1
+#define SCHEDULE_COSINE 2
+#define SCHEDULE_LINEAR 3
+#define VAL_AUTO 0
+#define VAL_T10K 1
+#define VAL_SPLIT 2
+#define VAL_NONE 3
+
+#if HIDDEN_SIZE % 16 != 0 || BATCH_SIZE % 2 != 0 || INPUT_SIZE % 2 != 0
+#error "The bf16 kernels need HIDDEN_SIZE a multiple of 16 and even BATCH_SIZE and INPUT_SIZE"
+#endif
+#if INPUT_SIZE % QAT_ROWS != 0
+#error "INPUT_SIZE must be a multiple of QAT_ROWS"
+#endif
+#if BATCH_SIZE % TASK_ROWS != 0 || TASK_ROWS % GEMM_ROWS != 0
+#error "BATCH_SIZE must be a multiple of TASK_ROWS, and TASK_ROWS a multiple of GEMM_ROWS"
+#endif
+#define BENCH_GATHER_EPOCHS 5
+
+#define RNG_STREAM_INIT 0
+#define RNG_STREAM_SELECT 1
+#define RNG_STREAM_AUGMENT 2
+#define RNG_STREAM_SHUFFLE 3
+#define RNG_STREAM_SHARD_ORDER 4
+#define RNG_STREAM_SHUFFLE_BUFFER 5
+
+typedef struct
+{
+    uint32_t v[4];
+} RngBlock;
+
+typedef struct
+{
+    int type;
+    float beta1;
+    float beta2;
+    float eps;
+    float weight_decay;
+    float momentum; /* SGD and Nesterov; cycled by the one-cycle schedule */
+    long long t;    /* updates applied so far, for Adam's bias correction */
+} Optimizer;
+
+/* Sparse first-layer updates. A weight row whose pixel is zero across the batch has a zero gradient, so under
+ * SGD and Nesterov its only change is the momentum decaying and being applied. That is deferred: row_step[j]
+ * is the last update applied to row j, and a row catches up in closed form the next time its pixel is active
+ * (which is before the forward pass reads it) or when the weights are flushed. */
+typedef struct
+{
+    long long *row_step;
+    unsigned char *active; /* per pixel: non-zero in the current batch */
+    long long active_rows;  /* summed over the epoch's steps, for reporting */
+    long long steps;
+} LazyUpdate;
+
+/* Quantization-aware training. The passes read the weights rounded to the int8 grid the recognizer uses
+ * (model_weight_scales: symmetric, one scale per output unit), refreshed from the fp32 master weights before
+ * every step, and see the hidden activations rounded to uint8 with a per-sample scale as the int8 recognizer
+ * computes them. The gradients flow straight through the rounding to the master weights. */
+typedef struct
+{
+    int8_t *hidden_q;
+    int8_t *output_q;
+    float hidden_scales[HIDDEN_SIZE];
+    float output_scales[OUTPUT_SIZE];
+    float *hidden_weights; /* hidden_q * hidden_scales */
+    float *output_weights;
+} QuantAware;
+
+/* Gradual magnitude pruning of the hidden weights. The mask drops the smallest-magnitude weights and is
+ * recomputed every PRUNE_INTERVAL steps, with the pruned fraction growing as target * (1 - (1 - t)^3) over the
+ * first PRUNE_RAMP of the run and held at target after that. Pruned weights and their optimizer state are zeroed
+ * before every step, so the remaining steps retrain the surviving weights around them. */
+typedef struct
+{
+    float target;
+    float sparsity;      /* fraction of the mask that is pruned */
+    long long end_step;  /* the step the target is reached */
+    long long mask_step; /* the step the mask was computed, -1 before the first */
+    unsigned char *mask; /* per hidden weight: 1 kept, 0 pruned */
+    float *magnitudes;   /* scratch for the threshold selection */
+} Pruning;
+
+/* The *_momentum arrays hold the optimizer state for each tensor, OPT_STATE_SIZE(n) floats in the interleaved
+ * block layout used by optimizer_step. */
 typedef struct
 {
     float *hidden_weights;
@@ -70,748 +252,5348 @@ typedef struct
     float *hidden_bias_momentum;
     float *output_weights_momentum;
     float *output_bias_momentum;
+    uint16_t *hidden_weights_bf16; /* bf16 working copy for the first-layer GEMM, NULL when training in fp32 */
+    LazyUpdate *lazy;              /* sparse first-layer updates, NULL for dense */
+    QuantAware *qat;               /* quantization-aware training, NULL otherwise */
+    Pruning *prune;                /* magnitude pruning, NULL otherwise */
+    Optimizer opt;
 } Network;
 
 typedef struct
 {
-    float *batch_X;
-    float *batch_y_onehot;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t image_size;
+    uint32_t num_classes;
+    uint32_t reserved;
+    uint64_t key;
+    uint64_t images_offset;
+    uint64_t labels_offset;
+    uint64_t index_offset;
+    uint64_t file_size;
+} DatasetHeader;
+
+/* Read-only view of a mapped dataset file. class_index lists the sample indices of each class in ascending
+ * order; class c occupies class_index[class_start[c] .. class_start[c + 1]). */
+typedef struct
+{
+    const unsigned char *images;
+    const unsigned char *labels;
+    const uint32_t *class_start;
+    const uint32_t *class_index;
+    int count;
+    void *map;
+    size_t map_size;
+} Dataset;
+
+typedef struct
+{
+    unsigned char *images;
+    unsigned char *labels;
+    int count;
+} ShardChunk;
+
+/* Streams a set of shard files (same layout as the dataset cache) with bounded memory. A reader thread
+ * preads SHARD_CHUNK_SAMPLES-sized runs from each shard in a per-epoch random shard order into a ring of
+ * SHARD_READ_AHEAD chunks; the trainer draws samples at random from a shuffle buffer refilled from the ring. */
+typedef struct
+{
+    const char *prefix;
+    int num_shards;
+    int *shard_counts;
+    long long total;
+    uint64_t seed;
+    int epoch;
+    int *shard_order;
+    ShardChunk chunks[SHARD_READ_AHEAD];
+    int head;
+    int tail;
+    int queued;
+    int reader_done;
+    int reader_error;
+    int stop;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    int cur_pos;
+    int have_cur;
+    unsigned char *buf_images;
+    unsigned char *buf_labels;
+    int buf_capacity;
+    int buf_fill;
+    uint64_t draws;
+    double wait_time;
+} ShardStream;
+
+/* Images quantized to input_bits (1 or 2) per pixel and packed LSB-first, row_bytes (98 or 196) per image. */
+typedef struct
+{
+    unsigned char *bits;
+    unsigned char *labels;
+    int count;
+    int input_bits;
+    int row_bytes;
+} PackedDataset;
+
+typedef struct
+{
+    const Dataset *data;
+    const PackedDataset *packed;
+    ShardStream *stream;
+    int *order;
+    long long count;
+    int input_bits;
+} BatchSource;
+
+typedef struct
+{
+    uint64_t seed;
+    int epochs;
+    int aug_cache;
+    const char *shards;
+    int shuffle_buffer;
+    const char *make_shards[3];
+    int shard_size;
+    int input_bits;
+    int bench_gather;
+    int executor;
+    int bench_steps;
+    int batch;
+    int lr_scaling;
+    int warmup_steps;
+    float lars_eta;
+    int hogwild;
+    float target_acc;
+    int procs;
+    const char *checkpoint;
+    const char *resume;
+    const char *init_from;
+    int export_header;
+    const char *export_from;
+    const char *factorize_from;
+    int factorize_rank;
+    const char *compact_from;
+    int val;
+    int val_threads;
+    int optimizer;
+    float lr;
+    float weight_decay;
+    int schedule;
+    int lr_range_steps;
+    int precision;
+    int sparse_updates;
+    int qat;
+    float prune;
+    const char *distill;
+    float temperature;
+    int binary;
+    const char *model;
+    const char *model_out;
+} TrainConfig;
+
+/* Learning rate (and, for one-cycle, momentum) as a function of the global step. peak is the base rate after
+ * batch-size scaling; total_steps covers the whole run so the schedules anneal to its end. */
+typedef struct
+{
+    int type;
+    float peak;
+    long long steps_per_epoch;
+    long long total_steps;
+    long long warmup_steps;
+} LrSchedule;
+
+typedef struct
+{
+    const unsigned char **batch_rows;
+    unsigned char *batch_images;
+    unsigned char *batch_labels;
     float *hidden_layer;
-    float *output_layer;
+    float *sample_loss;            /* per-sample cross-entropy from the fused output kernel */
+    unsigned char *sample_correct; /* per-sample 1 if the arg-max logit is the label */
     float *hidden_error;
+    uint16_t *hidden_error_bf16; /* hidden_error in bf16 sample pairs for the weight-gradient GEMM, or NULL */
     float *output_error;
+    float *grad; /* GRAD_SIZE floats; dw_hidden, dw_output, db_hidden and db_output point into it */
     float *dw_hidden;
     float *dw_output;
     float *db_hidden;
     float *db_output;
 } TrainingResources;
 
+/* Per-thread workers. Large-batch training runs batch / BATCH_SIZE micro-batches per step spread over the
+ * threads: every thread has its own activations and sums its micro-batch gradients into a private replica in
+ * accum, and the replicas are then tree-reduced into accum[0] before a single update. Hogwild uses only res. */
+typedef struct
+{
+    int threads;
+    int micro_batches;
+    TrainingResources *res;
+    float **accum;
+} DataParallel;
+
+/* Training state saved with every checkpoint. The RNG needs no saved stream position: every draw is keyed by
+ * (seed, stream, epoch, index), so resuming at an epoch boundary with the same seed continues the exact
+ * sequence. The payload that follows is the parameters in gradient order (hidden weights, output weights,
+ * hidden bias, output bias) followed by their optimizer state in the same order. */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t input_size;
+    uint32_t hidden_size;
+    uint32_t output_size;
+    int32_t epoch; /* epochs completed */
+    uint64_t seed;
+    int64_t step;
+    float learning_rate;
+    float best_accuracy;
+    int32_t no_improve;
+    uint32_t optimizer;
+    uint32_t schedule; /* the learning-rate trajectory, which --resume must continue unchanged */
+    int32_t epochs;
+    float peak_lr;
+} CheckpointHeader;
+
+typedef struct
+{
+    CheckpointHeader hdr;
+    float *snapshot;
+    char path[256];
+} CheckpointSlot;
+
+/* Background checkpoint writer: the training thread copies the network into the next free slot and moves on,
+ * and the writer thread writes the queued slots in order, each to a temporary file renamed over its path. */
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    CheckpointSlot slots[CHECKPOINT_SLOTS];
+    int head;   /* the oldest queued slot */
+    int queued; /* slots waiting to be written or being written */
+    int stop;
+} Checkpointer;
+
+/* Held-out evaluation off the training thread: at the end of every epoch the weights are copied into snapshot
+ * and a validation thread with its own OpenMP team runs the batched forward pass over data while the next
+ * epoch trains. The result is collected one epoch later. */
+typedef struct
+{
+    const Dataset *data;
+    int threads;
+    float *snapshot; /* SNAPSHOT_SIZE floats in checkpoint order */
+    CheckpointHeader hdr;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int quantized; /* evaluate the int8-rounded network */
+    int pending;
+    int done;
+    int stop;
+    double submit_time;
+    float loss;
+    float accuracy;
+} Validator;
+
+/* One trainer process of a --procs ring. The gradient is reduced in COMM_BUCKETS + 1 buckets: bucket 0 is the
+ * small output-layer/bias tail, available first, and the rest are row ranges of dw_hidden. The main thread
+ * posts each bucket as soon as the backward pass has written it and a communication thread all-reduces them in
+ * order, so the network overlaps with the rest of the backward pass. */
+typedef struct
+{
+    int rank;
+    int size;
+    int send_fd;
+    int recv_fd;
+    float *scratch;
+    float *grad;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int posted;
+    int done;
+    int stop;
+    double busy_time;
+    double wait_time;
+} Comm;
+
+/* --model: any layer list, trained by a generic engine that keeps the whole batch's activations per layer. acts[0]
+ * is the scaled input and acts[l + 1] the output of layer l; errors[l] is the loss gradient at layer l's
+ * pre-activation. Each layer's grad holds the weight gradient then the bias gradient, and state their optimizer
+ * state. The default 784-256-10 network keeps the specialized kernels. */
+typedef struct
+{
+    Model model;
+    Optimizer opt;
+    float *acts[MODEL_MAX_LAYERS + 1];
+    float *errors[MODEL_MAX_LAYERS];
+    float *cols[MODEL_MAX_LAYERS]; /* convolutions: the batch's im2col rows, NULL for other layers */
+    float *grad[MODEL_MAX_LAYERS];
+    float *state[MODEL_MAX_LAYERS];
+    float *teacher_logits; /* --distill: the teacher's logits for every training sample, NULL otherwise */
+    float *batch_teacher;  /* the current batch's rows of teacher_logits */
+    float temperature;
+    float *latent; /* --binary: the real-valued first-layer weights the optimizer steps, NULL otherwise */
+} ModelTrainer;
+
 // clang-format off
 float *allocate_array(size_t size);
-void initialize_network(Network *net);
+void initialize_network(Network *net, uint64_t seed);
 void free_network(Network *net);
-float random_normal(void);
+RngBlock rng_block(uint64_t seed, uint32_t stream, uint32_t substream, uint64_t index);
+float rng_uniform(uint32_t bits);
+void fill_random_normal(float *out, int n, float scale, uint64_t seed, uint32_t stream, uint32_t substream);
+gzFile open_idx_file(const char *filename, int *count, int *item_size);
 void read_idx_file(const char *filename, unsigned char *data, int expected_size);
-void shuffle_data(unsigned char *images, unsigned char *labels, int n);
+double now_seconds(void);
+uint64_t hash_params(const uint64_t *values, int n);
+int dataset_write(const char *path, const unsigned char *images, const unsigned char *labels, int count,
+                  uint64_t key);
+int dataset_map(const char *path, uint64_t key, Dataset *ds);
+void dataset_unmap(Dataset *ds);
+void make_shards(const char *images_path, const char *labels_path, const char *prefix, int shard_size);
+void shard_stream_open(ShardStream *ss, const char *prefix, uint64_t seed, int buffer_capacity);
+void shard_stream_begin_epoch(ShardStream *ss, int epoch);
+int shard_stream_next_batch(ShardStream *ss, unsigned char *images, unsigned char *labels, int n);
+void shard_stream_end_epoch(ShardStream *ss);
+void shard_stream_close(ShardStream *ss);
+void shuffle_indices(int *order, int n, uint64_t seed, uint32_t stream, int epoch);
+unsigned char quantize_pixel(unsigned char value, int bits);
+void quantize_images(unsigned char *images, int n, int bits);
+void pack_dataset(const Dataset *data, int bits, PackedDataset *pd);
+void free_packed_dataset(PackedDataset *pd);
 float gaussian(float x, float y, float sigma);
 void gaussian_filter(float *input, float *output, int size, float sigma);
 void rotate_image(unsigned char *input, unsigned char *output, float angle);
-void augment_digit(unsigned char *input, unsigned char *output);
-void create_augmented_dataset(const unsigned char *train_images, const unsigned char *train_labels,
-                              unsigned char *augmented_images, unsigned char *augmented_labels);
+void augment_digit(unsigned char *input, unsigned char *output, uint64_t seed, uint64_t sample_idx);
+void create_augmented_dataset(const Dataset *train, int pool, unsigned char *augmented_images,
+                              unsigned char *augmented_labels, uint64_t seed);
 float relu(float x);
 float relu_derivative(float x);
 void softmax(float *input, float *output, int size);
-void forward_pass(const Network *net, const float *batch_X, float *hidden_layer, float *output_layer);
-void compute_loss_accuracy(const float *output_layer, const float *batch_y_onehot, const unsigned char *labels,
-                           int start_idx, float *batch_loss, float *batch_acc);
-void backward_pass(const Network *net, const float *batch_X, const float *hidden_layer, const float *output_layer,
-                   const float *batch_y_onehot, float *hidden_error, float *output_error, float *dw_hidden,
+void hidden_forward_rows(const Network *net, const unsigned char *const *batch_rows, int i0, int i1,
+                         float *hidden_layer);
+void output_forward_rows(const Network *net, const float *hidden_layer, int i0, int i1, float *output_layer);
+void output_loss_rows(const Network *net, const float *hidden_layer, const unsigned char *labels, int i0, int i1,
+                      float *output_error, float *sample_loss, unsigned char *sample_correct);
+void hidden_error_rows(const Network *net, const float *hidden_layer, const float *output_error, int i0, int i1,
+                       float *hidden_error, uint16_t *hidden_error_bf16);
+void hidden_weight_grad_rows(const unsigned char *const *batch_rows, const float *hidden_error,
+                             const uint16_t *hidden_error_bf16, int j0, int j1, float *dw_hidden);
+void enable_bf16(Network *net, TrainingResources *res, DataParallel *dp);
+void enable_lazy_updates(Network *net);
+void lazy_begin_step(Network *net, const unsigned char *const *batch_rows);
+void lazy_flush(Network *net);
+void update_hidden_rows(Network *net, const float *dw_hidden, int j0, int j1, float learning_rate);
+void network_round_bf16(Network *net);
+void enable_qat(Network *net);
+void network_fake_quantize(Network *net);
+void enable_pruning(Network *net, float target);
+void network_prune(Network *net, long long step);
+void output_grads(const float *hidden_layer, const float *output_error, float *dw_output, float *db_output);
+void hidden_bias_grad(const float *hidden_error, float *db_hidden);
+void optimizer_step(const Optimizer *opt, float *weights, float *state, const float *grad, int n,
+                    float learning_rate);
+void forward_pass(const Network *net, const unsigned char *const *batch_rows, const unsigned char *batch_labels,
+                  float *hidden_layer, float *output_error, float *sample_loss, unsigned char *sample_correct);
+void batch_metrics(const TrainingResources *res, float *batch_loss, float *batch_acc);
+void backward_pass(const Network *net, const unsigned char *const *batch_rows, const float *hidden_layer,
+                   const float *output_error, float *hidden_error, uint16_t *hidden_error_bf16, float *dw_hidden,
                    float *dw_output, float *db_hidden, float *db_output);
 void update_network(Network *net, const float *dw_hidden, const float *dw_output, const float *db_hidden,
                     const float *db_output, float learning_rate);
+void train_step_tasks(Network *net, TrainingResources *res, float learning_rate, float *batch_loss, float *batch_acc);
+void micro_batch_grads(const Network *net, TrainingResources *res, float *batch_loss, float *batch_acc);
+void tree_reduce_grads(float **replicas, int n);
+float lars_trust(const float *weights, const float *grad, int n, float eta);
+void train_step_data_parallel(Network *net, BatchSource *src, DataParallel *dp, int step, float learning_rate,
+                              float lars_eta, float *batch_loss, float *batch_acc);
+void hogwild_epoch(Network *net, BatchSource *src, DataParallel *workers, const LrSchedule *sched, int epoch,
+                   int num_batches, float *loss_sum, float *acc_sum);
+void launch_ranks(const TrainConfig *cfg, Comm *comm);
+void ring_allreduce(Comm *comm, float *buf, int len);
+void comm_start(Comm *comm, float *grad);
+void comm_post(Comm *comm, int bucket);
+void comm_wait(Comm *comm);
+void comm_stop(Comm *comm);
+void train_step_distributed(Network *net, TrainingResources *res, Comm *comm, float learning_rate, float *batch_loss,
+                            float *batch_acc);
 void save_weights(Network *net);
+void network_view(Network *view, float *buf);
+void network_copy(const Network *net, float *dst);
+int checkpoint_load(const char *path, Network *net, CheckpointHeader *hdr, int with_state);
+void checkpointer_start(Checkpointer *ck);
+void checkpoint_save(Checkpointer *ck, const Network *net, const CheckpointHeader *hdr, const char *path);
+void checkpointer_stop(Checkpointer *ck);
+int export_header(const char *path, const char *model_path, int quantized);
+int factorize_model(const char *path, int rank, const char *model_path);
+int compact_model(const char *path, const char *model_path);
+void network_model(const Network *net, Model *model);
+void model_trainer_init(ModelTrainer *mt, const char *spec, const Optimizer *opt, uint64_t seed);
+void model_trainer_free(ModelTrainer *mt);
+void model_trainer_distill(ModelTrainer *mt, const char *teacher_path, const Dataset *data, float temperature);
+void model_trainer_load(ModelTrainer *mt, const char *path);
+void model_trainer_binarize(ModelTrainer *mt);
+void model_layer_forward(const ModelLayer *layer, const float *input, float *cols, float *output);
+void model_loss_rows(const float *probs, const unsigned char *labels, float *output_error, float *sample_loss,
+                     unsigned char *sample_correct);
+void model_layer_backward(const ModelLayer *layer, const float *input, float *cols, const float *error,
+                          float *grad, float *input_error, int input_activation);
+void model_train_step(ModelTrainer *mt, TrainingResources *res, float learning_rate, float *batch_loss,
+                      float *batch_acc);
+void model_evaluate(const Model *model, const Dataset *data, float *loss, float *accuracy);
+void train_model(ModelTrainer *mt, BatchSource *src, TrainingResources *res, const Dataset *val_data,
+                 const TrainConfig *cfg);
+void evaluate(const Network *net, const Dataset *data, float *loss, float *accuracy);
+void validator_start(Validator *val, const Dataset *data, int threads, int quantized);
+void validator_submit(Validator *val, const Network *net, const CheckpointHeader *hdr);
+int validator_collect(Validator *val, float *loss, float *accuracy, CheckpointHeader *hdr);
+void validator_stop(Validator *val);
+void parse_args(int argc, char **argv, TrainConfig *cfg);
 // clang-format on
 
+static unsigned char unpack_lut1[256][8];
+static unsigned char unpack_lut2[256][4];
+
 void initialize_training_resources(TrainingResources *res)
 {
-    res->batch_X = allocate_array(BATCH_SIZE * INPUT_SIZE);
-    res->batch_y_onehot = allocate_array(BATCH_SIZE * OUTPUT_SIZE);
+    res->batch_rows = (const unsigned char **)malloc(BATCH_SIZE * sizeof(*res->batch_rows));
+    res->batch_images = (unsigned char *)malloc(BATCH_SIZE * INPUT_SIZE);
+    res->batch_labels = (unsigned char *)malloc(BATCH_SIZE);
+    res->sample_correct = (unsigned char *)malloc(BATCH_SIZE);
+    if (!res->batch_rows || !res->batch_images || !res->batch_labels || !res->sample_correct)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
     res->hidden_layer = allocate_array(BATCH_SIZE * HIDDEN_SIZE);
-    res->output_layer = allocate_array(BATCH_SIZE * OUTPUT_SIZE);
+    res->sample_loss = allocate_array(BATCH_SIZE);
     res->hidden_error = allocate_array(BATCH_SIZE * HIDDEN_SIZE);
+    res->hidden_error_bf16 = NULL;
     res->output_error = allocate_array(BATCH_SIZE * OUTPUT_SIZE);
-    res->dw_hidden = allocate_array(INPUT_SIZE * HIDDEN_SIZE);
-    res->dw_output = allocate_array(HIDDEN_SIZE * OUTPUT_SIZE);
-    res->db_hidden = allocate_array(HIDDEN_SIZE);
-    res->db_output = allocate_array(OUTPUT_SIZE);
+    res->grad = allocate_array(GRAD_SIZE);
+    res->dw_hidden = res->grad;
+    res->dw_output = res->dw_hidden + INPUT_SIZE * HIDDEN_SIZE;
+    res->db_hidden = res->dw_output + HIDDEN_SIZE * OUTPUT_SIZE;
+    res->db_output = res->db_hidden + HIDDEN_SIZE;
 }
 
 void free_training_resources(TrainingResources *res)
 {
-    free(res->batch_X);
-    free(res->batch_y_onehot);
+    free(res->batch_rows);
+    free(res->batch_images);
+    free(res->batch_labels);
     free(res->hidden_layer);
-    free(res->output_layer);
+    free(res->sample_loss);
+    free(res->sample_correct);
     free(res->hidden_error);
+    free(res->hidden_error_bf16);
     free(res->output_error);
-    free(res->dw_hidden);
-    free(res->dw_output);
-    free(res->db_hidden);
-    free(res->db_output);
+    free(res->grad);
 }
 
-void load_mnist_data(unsigned char **train_images, unsigned char **train_labels)
+void data_parallel_init(DataParallel *dp, int micro_batches, int threads)
 {
-    *train_images = (unsigned char *)malloc(MNIST_TRAIN_SIZE * INPUT_SIZE);
-    *train_labels = (unsigned char *)malloc(MNIST_TRAIN_SIZE);
-    if (!*train_images || !*train_labels)
+    dp->micro_batches = micro_batches;
+    dp->threads = threads;
+    dp->res = (TrainingResources *)malloc(dp->threads * sizeof(*dp->res));
+    dp->accum = (float **)malloc(dp->threads * sizeof(*dp->accum));
+    if (!dp->res || !dp->accum)
     {
-        fprintf(stderr, "Memory allocation failed for training data\n");
+        fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
-    printf("Reading MNIST data...\n");
-    read_idx_file("train-images-idx3-ubyte.gz", *train_images, MNIST_TRAIN_SIZE * INPUT_SIZE);
-    read_idx_file("train-labels-idx1-ubyte.gz", *train_labels, MNIST_TRAIN_SIZE);
-}
-
-void prepare_batch(const unsigned char *images, const unsigned char *labels, int start_idx, float *batch_X,
-                   float *batch_y_onehot)
-{
-    for (int i = 0; i < BATCH_SIZE; i++)
+    for (int t = 0; t < dp->threads; t++)
     {
-        for (int j = 0; j < INPUT_SIZE; j++)
-        {
-            batch_X[i * INPUT_SIZE + j] = images[(start_idx + i) * INPUT_SIZE + j] / 255.0f;
-        }
-        memset(&batch_y_onehot[i * OUTPUT_SIZE], 0, OUTPUT_SIZE * sizeof(float));
-        batch_y_onehot[i * OUTPUT_SIZE + labels[start_idx + i]] = 1.0f;
+        initialize_training_resources(&dp->res[t]);
+        dp->accum[t] = micro_batches > 1 ? allocate_array(GRAD_SIZE) : NULL;
     }
 }
 
-void train_network(Network *net, unsigned char *aug_images, unsigned char *aug_labels, int total_samples,
-                   TrainingResources *res)
+void data_parallel_free(DataParallel *dp)
 {
-    int num_batches = total_samples / BATCH_SIZE;
-    float best_accuracy = 0.0f;
-    int no_improve = 0;
-
-    printf("Starting training...\n");
-    for (int epoch = 0; epoch < NUM_EPOCHS; epoch++)
+    for (int t = 0; t < dp->threads; t++)
     {
-        float learning_rate = BASE_LR * powf(LR_DECAY, epoch);
-        float epoch_loss = 0.0f;
-        float epoch_acc = 0.0f;
-        shuffle_data(aug_images, aug_labels, total_samples);
-        for (int batch = 0; batch < num_batches; batch++)
-        {
-            int start_idx = batch * BATCH_SIZE;
-            prepare_batch(aug_images, aug_labels, start_idx, res->batch_X, res->batch_y_onehot);
-            forward_pass(net, res->batch_X, res->hidden_layer, res->output_layer);
-            float batch_loss, batch_acc;
-            compute_loss_accuracy(res->output_layer, res->batch_y_onehot, aug_labels, start_idx, &batch_loss,
-                                  &batch_acc);
-            epoch_loss += batch_loss;
-            epoch_acc += batch_acc;
-            backward_pass(net, res->batch_X, res->hidden_layer, res->output_layer, res->batch_y_onehot,
-                          res->hidden_error, res->output_error, res->dw_hidden, res->dw_output, res->db_hidden,
-                          res->db_output);
-            update_network(net, res->dw_hidden, res->dw_output, res->db_hidden, res->db_output, learning_rate);
-            if (batch % PRINT_INTERVAL == 0)
-            {
-                printf("Batch %d/%d, Loss: %.4f, Accuracy: %.2f%%\n", batch, num_batches, batch_loss,
-                       batch_acc * 100.0f);
-            }
-        }
-        epoch_loss /= num_batches;
-        epoch_acc /= num_batches;
-        printf("Epoch %d/%d, Loss: %.4f, Accuracy: %.2f%%\n", epoch + 1, NUM_EPOCHS, epoch_loss, epoch_acc * 100.0f);
-        if (epoch_acc > best_accuracy)
-        {
-            best_accuracy = epoch_acc;
-            no_improve = 0;
-            printf("Saving best weights...\n");
-            save_weights(net);
-        }
-        else
-        {
-            no_improve++;
-            if (no_improve >= PATIENCE)
-            {
-                printf("Early stopping triggered. Best accuracy: %.2f%%\n", best_accuracy * 100.0f);
-                break;
-            }
-        }
+        free_training_resources(&dp->res[t]);
+        free(dp->accum[t]);
     }
-    printf("Training completed. Best accuracy: %.2f%%\n", best_accuracy * 100.0f);
+    free(dp->res);
+    free(dp->accum);
 }
 
-float *allocate_array(size_t size)
+void load_mnist_data(Dataset *train)
 {
-    float *array = (float *)malloc(size * sizeof(float));
-    if (!array)
+    if (dataset_map(DATASET_CACHE_PATH, 0, train) == 0)
     {
-        fprintf(stderr, "Memory allocation failed\n");
+        printf("Mapped MNIST cache %s\n", DATASET_CACHE_PATH);
+        return;
+    }
+    unsigned char *images = (unsigned char *)malloc((size_t)MNIST_TRAIN_SIZE * INPUT_SIZE);
+    unsigned char *labels = (unsigned char *)malloc(MNIST_TRAIN_SIZE);
+    if (!images || !labels)
+    {
+        fprintf(stderr, "Memory allocation failed for training data\n");
         exit(1);
     }
-    return array;
-}
-
-void free_network(Network *net)
-{
-    free(net->hidden_weights);
-    free(net->hidden_bias);
-    free(net->output_weights);
-    free(net->output_bias);
-    free(net->hidden_weights_momentum);
-    free(net->hidden_bias_momentum);
-    free(net->output_weights_momentum);
-    free(net->output_bias_momentum);
+    printf("Reading MNIST data...\n");
+    read_idx_file("train-images-idx3-ubyte.gz", images, MNIST_TRAIN_SIZE * INPUT_SIZE);
+    read_idx_file("train-labels-idx1-ubyte.gz", labels, MNIST_TRAIN_SIZE);
+    if (dataset_write(DATASET_CACHE_PATH, images, labels, MNIST_TRAIN_SIZE, 0) != 0 ||
+        dataset_map(DATASET_CACHE_PATH, 0, train) != 0)
+    {
+        fprintf(stderr, "Failed to create dataset cache %s\n", DATASET_CACHE_PATH);
+        exit(1);
+    }
+    printf("Wrote MNIST cache %s\n", DATASET_CACHE_PATH);
+    free(images);
+    free(labels);
 }
 
-void initialize_network(Network *net)
+void load_augmented_data(const Dataset *train, int pool, const TrainConfig *cfg, Dataset *aug)
 {
-    net->hidden_weights = allocate_array(INPUT_SIZE * HIDDEN_SIZE);
-    net->hidden_bias = allocate_array(HIDDEN_SIZE);
-    net->output_weights = allocate_array(HIDDEN_SIZE * OUTPUT_SIZE);
-    net->output_bias = allocate_array(OUTPUT_SIZE);
-    net->hidden_weights_momentum = allocate_array(INPUT_SIZE * HIDDEN_SIZE);
-    net->hidden_bias_momentum = allocate_array(HIDDEN_SIZE);
-    net->output_weights_momentum = allocate_array(HIDDEN_SIZE * OUTPUT_SIZE);
-    net->output_bias_momentum = allocate_array(OUTPUT_SIZE);
-    float scale = sqrtf(2.0f / INPUT_SIZE);
-    srand(RAND_SEED);
-    for (int i = 0; i < INPUT_SIZE * HIDDEN_SIZE; i++)
+    uint64_t params[] = {AUG_VERSION, cfg->seed,    SAMPLES_PER_DIGIT, ROTATION_MAX_DEG, SHIFT_RANGE, SHIFT_OFFSET,
+                         (uint64_t)(GAUSSIAN_SIGMA * 1e6f), (uint64_t)pool};
+    uint64_t key = hash_params(params, (int)(sizeof(params) / sizeof(params[0])));
+    char path[64];
+    snprintf(path, sizeof(path), AUG_CACHE_FORMAT, (unsigned long long)key);
+    if (cfg->aug_cache && dataset_map(path, key, aug) == 0)
     {
-        net->hidden_weights[i] = random_normal() * scale;
-        net->hidden_weights_momentum[i] = 0.0f;
+        printf("Mapped augmented cache %s\n", path);
+        return;
     }
-    for (int i = 0; i < HIDDEN_SIZE * OUTPUT_SIZE; i++)
+    unsigned char *images = (unsigned char *)malloc((size_t)TOTAL_SAMPLES * INPUT_SIZE);
+    unsigned char *labels = (unsigned char *)malloc(TOTAL_SAMPLES);
+    if (!images || !labels)
     {
-        net->output_weights[i] = random_normal() * scale;
-        net->output_weights_momentum[i] = 0.0f;
+        fprintf(stderr, "Failed to allocate memory for augmented dataset\n");
+        exit(1);
     }
-    memset(net->hidden_bias, 0, HIDDEN_SIZE * sizeof(float));
-    memset(net->output_bias, 0, OUTPUT_SIZE * sizeof(float));
-    memset(net->hidden_bias_momentum, 0, HIDDEN_SIZE * sizeof(float));
-    memset(net->output_bias_momentum, 0, OUTPUT_SIZE * sizeof(float));
-}
-
-float random_normal(void)
-{
-    float u1 = (float)rand() / RAND_MAX;
-    float u2 = (float)rand() / RAND_MAX;
-    return sqrtf(-2.0f * logf(u1)) * cosf(2.0f * M_PI * u2);
+    create_augmented_dataset(train, pool, images, labels, cfg->seed);
+    if (cfg->aug_cache && dataset_write(path, images, labels, TOTAL_SAMPLES, key) == 0 &&
+        dataset_map(path, key, aug) == 0)
+    {
+        printf("Wrote augmented cache %s\n", path);
+        free(images);
+        free(labels);
+        return;
+    }
+    memset(aug, 0, sizeof(*aug));
+    aug->images = images;
+    aug->labels = labels;
+    aug->count = TOTAL_SAMPLES;
 }
 
-void read_idx_file(const char *filename, unsigned char *data, int expected_size)
+/* Reads an IDX image/label pair into memory, e.g. the t10k test set. */
+void load_idx_dataset(const char *images_path, const char *labels_path, Dataset *ds)
 {
-    gzFile file = gzopen(filename, "rb");
-    if (!file)
+    int count, item_size, label_count, label_size;
+    gzFile images_file = open_idx_file(images_path, &count, &item_size);
+    gzFile labels_file = open_idx_file(labels_path, &label_count, &label_size);
+    if (item_size != INPUT_SIZE || label_size != 1 || label_count != count)
     {
-        fprintf(stderr, "Error opening file: %s\n", filename);
+        fprintf(stderr, "%s and %s do not hold matching %d-pixel images and labels\n", images_path, labels_path,
+                INPUT_SIZE);
         exit(1);
     }
-    unsigned char header[16];
-    if (gzread(file, header, 4) != 4)
+    memset(ds, 0, sizeof(*ds));
+    unsigned char *images = (unsigned char *)malloc((size_t)count * INPUT_SIZE);
+    unsigned char *labels = (unsigned char *)malloc(count);
+    if (!images || !labels)
     {
-        fprintf(stderr, "Error reading magic number\n");
+        fprintf(stderr, "Memory allocation failed for %s\n", images_path);
         exit(1);
     }
-    int magic = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
-    int dim_count = magic & 0xff;
-    int total_size = 1;
-    for (int i = 0; i < dim_count; i++)
-    {
-        if (gzread(file, header + 4 * i, 4) != 4)
-        {
-            fprintf(stderr, "Error reading dimensions\n");
-            exit(1);
-        }
-        int dim = (header[4 * i] << 24) | (header[4 * i + 1] << 16) | (header[4 * i + 2] << 8) | header[4 * i + 3];
-        total_size *= dim;
-    }
-    if (total_size != expected_size)
+    if (gzread(images_file, images, (unsigned)count * INPUT_SIZE) != count * INPUT_SIZE ||
+        gzread(labels_file, labels, (unsigned)count) != count)
     {
-        fprintf(stderr, "Unexpected file size\n");
+        fprintf(stderr, "Error reading %s\n", images_path);
         exit(1);
     }
-    if (gzread(file, data, total_size) != total_size)
+    gzclose(images_file);
+    gzclose(labels_file);
+    ds->images = images;
+    ds->labels = labels;
+    ds->count = count;
+}
+
+/* Copies samples [first, first + count) of src into a standalone dataset. */
+void copy_dataset_range(const Dataset *src, int first, int count, Dataset *ds)
+{
+    memset(ds, 0, sizeof(*ds));
+    unsigned char *images = (unsigned char *)malloc((size_t)count * INPUT_SIZE);
+    unsigned char *labels = (unsigned char *)malloc(count);
+    if (!images || !labels)
     {
-        fprintf(stderr, "Error reading data\n");
+        fprintf(stderr, "Memory allocation failed for validation split\n");
         exit(1);
     }
-    gzclose(file);
+    memcpy(images, &src->images[(size_t)first * INPUT_SIZE], (size_t)count * INPUT_SIZE);
+    memcpy(labels, &src->labels[first], count);
+    ds->images = images;
+    ds->labels = labels;
+    ds->count = count;
 }
 
-void shuffle_data(unsigned char *images, unsigned char *labels, int n)
+void free_dataset(Dataset *ds)
 {
-    for (int i = n - 1; i > 0; i--)
+    if (ds->map)
     {
-        int j = rand() % (i + 1);
-        for (int k = 0; k < INPUT_SIZE; k++)
-        {
-            unsigned char temp = images[i * INPUT_SIZE + k];
-            images[i * INPUT_SIZE + k] = images[j * INPUT_SIZE + k];
-            images[j * INPUT_SIZE + k] = temp;
-        }
-        unsigned char temp = labels[i];
-        labels[i] = labels[j];
-        labels[j] = temp;
+        dataset_unmap(ds);
+        return;
     }
+    free((void *)ds->images);
+    free((void *)ds->labels);
+    memset(ds, 0, sizeof(*ds));
 }
 
-float gaussian(float x, float y, float sigma)
+void prepare_batch(const unsigned char *images, const unsigned char *labels, const int *order, int start_idx,
+                   const unsigned char **batch_rows, unsigned char *batch_labels)
 {
-    float coeff = 1.0f / (2.0f * M_PI * sigma * sigma);
-    float expo = -(x * x + y * y) / (2.0f * sigma * sigma);
-    return coeff * expf(expo);
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        int idx = order ? order[start_idx + i] : start_idx + i;
+        batch_rows[i] = &images[(size_t)idx * INPUT_SIZE];
+        batch_labels[i] = labels[idx];
+    }
 }
 
-void gaussian_filter(float *input, float *output, int size, float sigma)
+void prepare_packed_batch(const PackedDataset *pd, const int *order, int start_idx, unsigned char *staging,
+                          const unsigned char **batch_rows, unsigned char *batch_labels)
 {
-    int kernel_size = (int)(6.0f * sigma);
-    if (kernel_size % 2 == 0)
-        kernel_size++;
-    int half = kernel_size / 2;
-    float *kernel = (float *)malloc(kernel_size * kernel_size * sizeof(float));
-    float sum = 0.0f;
-    for (int y = -half; y <= half; y++)
+    for (int i = 0; i < BATCH_SIZE; i++)
     {
-        for (int x = -half; x <= half; x++)
+        int idx = order[start_idx + i];
+        const unsigned char *row = &pd->bits[(size_t)idx * pd->row_bytes];
+        unsigned char *x = &staging[i * INPUT_SIZE];
+        batch_rows[i] = x;
+        if (pd->input_bits == 1)
         {
-            float g = gaussian((float)x, (float)y, sigma);
-            kernel[(y + half) * kernel_size + (x + half)] = g;
-            sum += g;
+            for (int b = 0; b < pd->row_bytes; b++)
+                memcpy(&x[b * 8], unpack_lut1[row[b]], sizeof(unpack_lut1[0]));
         }
-    }
-    for (int i = 0; i < kernel_size * kernel_size; i++)
-    {
-        kernel[i] /= sum;
-    }
-    for (int y = 0; y < size; y++)
-    {
-        for (int x = 0; x < size; x++)
+        else
         {
-            float val = 0.0f;
-            for (int ky = -half; ky <= half; ky++)
-            {
-                for (int kx = -half; kx <= half; kx++)
-                {
-                    int py = y + ky;
-                    int px = x + kx;
-                    if (px >= 0 && px < size && py >= 0 && py < size)
-                    {
-                        val += input[py * size + px] * kernel[(ky + half) * kernel_size + (kx + half)];
-                    }
-                }
-            }
-            output[y * size + x] = val;
+            for (int b = 0; b < pd->row_bytes; b++)
+                memcpy(&x[b * 4], unpack_lut2[row[b]], sizeof(unpack_lut2[0]));
         }
+        batch_labels[i] = pd->labels[idx];
     }
-    free(kernel);
 }
 
-void rotate_image(unsigned char *input, unsigned char *output, float angle)
+void batch_source_init(BatchSource *src, const Dataset *data, const PackedDataset *packed, ShardStream *stream,
+                       int input_bits)
 {
-    float radian = angle * M_PI / 180.0f;
-    float cos_theta = cosf(radian);
-    float sin_theta = sinf(radian);
-    memset(output, 0, IMAGE_DIM * IMAGE_DIM);
-    for (int y = 0; y < IMAGE_DIM; y++)
+    memset(src, 0, sizeof(*src));
+    src->data = data;
+    src->packed = packed;
+    src->stream = stream;
+    src->input_bits = input_bits;
+    src->count = stream ? stream->total : (packed ? packed->count : data->count);
+    if (!stream)
     {
-        for (int x = 0; x < IMAGE_DIM; x++)
+        src->order = (int *)malloc(src->count * sizeof(int));
+        if (!src->order)
         {
-            float xc = x - IMAGE_CENTER;
-            float yc = y - IMAGE_CENTER;
-            float xr = xc * cos_theta - yc * sin_theta + IMAGE_CENTER;
-            float yr = xc * sin_theta + yc * cos_theta + IMAGE_CENTER;
-            if (xr >= 0 && xr < (IMAGE_DIM - 1) && yr >= 0 && yr < (IMAGE_DIM - 1))
-            {
-                int x0 = (int)xr;
-                int y0 = (int)yr;
-                float dx = xr - x0;
-                float dy = yr - y0;
-                float v00 = input[y0 * IMAGE_DIM + x0];
-                float v01 = input[y0 * IMAGE_DIM + (x0 + 1)];
-                float v10 = input[(y0 + 1) * IMAGE_DIM + x0];
-                float v11 = input[(y0 + 1) * IMAGE_DIM + (x0 + 1)];
-                float val = v00 * (1 - dx) * (1 - dy) + v01 * dx * (1 - dy) + v10 * (1 - dx) * dy + v11 * dx * dy;
-                output[y * IMAGE_DIM + x] = (unsigned char)val;
-            }
+            fprintf(stderr, "Failed to allocate shuffle order\n");
+            exit(1);
         }
     }
 }
 
-void augment_digit(unsigned char *input, unsigned char *output)
+void batch_source_begin_epoch(BatchSource *src, uint64_t seed, int epoch)
 {
-    unsigned char *temp1 = (unsigned char *)malloc(IMAGE_DIM * IMAGE_DIM);
-    unsigned char *temp2 = (unsigned char *)malloc(IMAGE_DIM * IMAGE_DIM);
+    if (src->stream)
+        shard_stream_begin_epoch(src->stream, epoch);
+    else
+        shuffle_indices(src->order, (int)src->count, seed, RNG_STREAM_SHUFFLE, epoch);
+}
+
+void load_batch(BatchSource *src, int batch, TrainingResources *res)
+{
+    if (src->stream)
+    {
+        if (shard_stream_next_batch(src->stream, res->batch_images, res->batch_labels, BATCH_SIZE) < BATCH_SIZE)
+        {
+            fprintf(stderr, "Shard stream ended early\n");
+            exit(1);
+        }
+        quantize_images(res->batch_images, BATCH_SIZE, src->input_bits);
+        prepare_batch(res->batch_images, res->batch_labels, NULL, 0, res->batch_rows, res->batch_labels);
+    }
+    else if (src->packed)
+    {
+        prepare_packed_batch(src->packed, src->order, batch * BATCH_SIZE, res->batch_images, res->batch_rows,
+                             res->batch_labels);
+    }
+    else
+    {
+        prepare_batch(src->data->images, src->data->labels, src->order, batch * BATCH_SIZE, res->batch_rows,
+                      res->batch_labels);
+    }
+}
+
+void batch_source_end_epoch(BatchSource *src)
+{
+    if (src->stream)
+    {
+        shard_stream_end_epoch(src->stream);
+        printf("Shard stream I/O wait: %.1f ms\n", src->stream->wait_time * 1000.0);
+    }
+}
+
+void batch_source_free(BatchSource *src)
+{
+    free(src->order);
+}
+
+void train_step(Network *net, TrainingResources *res, float learning_rate, float *batch_loss, float *batch_acc)
+{
+    forward_pass(net, res->batch_rows, res->batch_labels, res->hidden_layer, res->output_error, res->sample_loss,
+                 res->sample_correct);
+    batch_metrics(res, batch_loss, batch_acc);
+    backward_pass(net, res->batch_rows, res->hidden_layer, res->output_error, res->hidden_error,
+                  res->hidden_error_bf16, res->dw_hidden, res->dw_output, res->db_hidden, res->db_output);
+    update_network(net, res->dw_hidden, res->dw_output, res->db_hidden, res->db_output, learning_rate);
+}
+
+float schedule_peak(const TrainConfig *cfg)
+{
+    if (cfg->lr_scaling == LR_SCALING_LINEAR)
+        return cfg->lr * cfg->batch / BATCH_SIZE;
+    if (cfg->lr_scaling == LR_SCALING_SQRT)
+        return cfg->lr * sqrtf((float)cfg->batch / BATCH_SIZE);
+    return cfg->lr;
+}
+
+void schedule_init(LrSchedule *s, const TrainConfig *cfg, long long steps_per_epoch)
+{
+    s->type = cfg->schedule;
+    s->peak = schedule_peak(cfg);
+    s->steps_per_epoch = steps_per_epoch;
+    s->total_steps = steps_per_epoch * cfg->epochs;
+    if (cfg->warmup_steps >= 0)
+        s->warmup_steps = cfg->warmup_steps;
+    else if (s->type == SCHEDULE_ONECYCLE)
+        s->warmup_steps = (long long)(ONECYCLE_WARMUP * s->total_steps);
+    else if (s->type != SCHEDULE_STEP)
+        s->warmup_steps = (long long)(SCHEDULE_WARMUP * s->total_steps);
+    else
+        s->warmup_steps = cfg->batch > BATCH_SIZE ? steps_per_epoch : 0;
+}
+
+/* The rate for the step-th update of the run. step: decayed per epoch, with a linear warmup so large batches do
+ * not diverge before the weights settle. cosine and linear: linear warmup to the peak, then down to zero by the
+ * end of the run. onecycle: cosine ramp from peak / ONECYCLE_DIV to the peak, then cosine anneal far below the
+ * start. */
+float schedule_rate(const LrSchedule *s, long long step)
+{
+    long long warmup = s->warmup_steps;
+    float rest = s->total_steps > warmup ? (float)(step - warmup) / (float)(s->total_steps - warmup) : 1.0f;
+    rest = rest < 0.0f ? 0.0f : rest > 1.0f ? 1.0f : rest;
+    switch (s->type)
+    {
+    case SCHEDULE_ONECYCLE:
+    {
+        float start = s->peak / ONECYCLE_DIV;
+        if (step < warmup)
+            return start + (s->peak - start) * 0.5f * (1.0f - cosf((float)M_PI * step / warmup));
+        float end = start / ONECYCLE_FINAL_DIV;
+        return end + (s->peak - end) * 0.5f * (1.0f + cosf((float)M_PI * rest));
+    }
+    case SCHEDULE_COSINE:
+        if (step < warmup)
+            return s->peak * (step + 1) / warmup;
+        return s->peak * 0.5f * (1.0f + cosf((float)M_PI * rest));
+    case SCHEDULE_LINEAR:
+        if (step < warmup)
+            return s->peak * (step + 1) / warmup;
+        return s->peak * (1.0f - rest);
+    default:
+    {
+        float learning_rate = s->peak * powf(LR_DECAY, (float)(step / s->steps_per_epoch));
+        if (step < warmup)
+            learning_rate *= (float)(step + 1) / warmup;
+        return learning_rate;
+    }
+    }
+}
+
+/* One-cycle moves momentum opposite to the rate: high while the rate is low, low at the peak. */
+float schedule_momentum(const LrSchedule *s, long long step)
+{
+    if (s->type != SCHEDULE_ONECYCLE)
+        return MOMENTUM;
+    float start = s->peak / ONECYCLE_DIV;
+    float frac = (schedule_rate(s, step) - start) / (s->peak - start);
+    frac = frac < 0.0f ? 0.0f : frac;
+    return ONECYCLE_MOMENTUM_MAX - (ONECYCLE_MOMENTUM_MAX - ONECYCLE_MOMENTUM_MIN) * frac;
+}
+
+/* Trains a fresh network at batch 64 while raising the rate exponentially from LR_RANGE_MIN to LR_RANGE_MAX,
+ * and reports the rate at which the smoothed loss fell fastest (a good --lr for step, cosine and linear) and the
+ * one a decade below the loss minimum (a good one-cycle peak). Stops once the loss diverges. */
+void lr_range_test(Network *net, BatchSource *src, TrainingResources *res, const TrainConfig *cfg)
+{
+    int steps = cfg->lr_range_steps;
+    long long num_batches = src->count / BATCH_SIZE;
+    double log_ratio = log((double)LR_RANGE_MAX / LR_RANGE_MIN);
+    double smoothed = 0.0, best_loss = INFINITY, prev_loss = 0.0, steepest = 0.0;
+    float best_lr = LR_RANGE_MIN, steep_lr = LR_RANGE_MIN;
+    printf("LR range test over %d steps, %g to %g (%s):\n", steps, LR_RANGE_MIN, LR_RANGE_MAX,
+           cfg->optimizer >= OPT_ADAM ? "adam" : "sgd");
+    for (int i = 0; i < steps; i++)
+    {
+        if (i % num_batches == 0)
+        {
+            if (i > 0)
+                batch_source_end_epoch(src);
+            batch_source_begin_epoch(src, cfg->seed, (int)(i / num_batches));
+        }
+        float learning_rate = (float)(LR_RANGE_MIN * exp(log_ratio * i / (steps - 1)));
+        float loss, acc;
+        load_batch(src, (int)(i % num_batches), res);
+        net->opt.t = i + 1;
+        network_round_bf16(net);
+        network_fake_quantize(net);
+        train_step(net, res, learning_rate, &loss, &acc);
+        smoothed = LR_RANGE_SMOOTHING * smoothed + (1.0 - LR_RANGE_SMOOTHING) * loss;
+        double debiased = smoothed / (1.0 - pow(LR_RANGE_SMOOTHING, i + 1));
+        if (!isfinite(debiased) || (i > 0 && debiased > 4.0 * best_loss))
+        {
+            printf("  loss diverged at lr %.3g\n", learning_rate);
+            break;
+        }
+        if (debiased < best_loss)
+        {
+            best_loss = debiased;
+            best_lr = learning_rate;
+        }
+        /* Loss change per step; the step is a constant factor in lr, so this is the slope against log lr. */
+        if (i >= steps / 20 && debiased - prev_loss < steepest)
+        {
+            steepest = debiased - prev_loss;
+            steep_lr = learning_rate;
+        }
+        prev_loss = debiased;
+        if (i % (steps / 15 > 0 ? steps / 15 : 1) == 0)
+            printf("  lr %10.3g  loss %.4f\n", learning_rate, debiased);
+    }
+    batch_source_end_epoch(src);
+    printf("Steepest descent at lr %.3g, minimum loss %.4f at lr %.3g\n", steep_lr, best_loss, best_lr);
+    printf("Suggested: --lr %.3g, or --schedule onecycle --lr %.3g\n", steep_lr, best_lr / 10.0f);
+}
+
+static void check_target(const TrainConfig *cfg, const char *metric, float accuracy, int epoch, double elapsed,
+                         int *reached)
+{
+    if (cfg->target_acc > 0.0f && !*reached && accuracy * 100.0f >= cfg->target_acc)
+    {
+        *reached = 1;
+        printf("Reached %.2f%% %s accuracy after %d epoch(s) in %.2f s\n", cfg->target_acc, metric, epoch, elapsed);
+    }
+}
+
+/* Folds a finished validation into the early-stopping state and keeps the best snapshot as the best checkpoint.
+ * The target time is taken when the snapshot was submitted, not when its result was collected. Snapshots from
+ * before settle_step (while pruning is still ramping up) are reported but not tracked. */
+static void record_validation(Validator *val, Checkpointer *ck, const char *best_path, CheckpointHeader *state,
+                              const TrainConfig *cfg, double start, long long settle_step, int *reached_target)
+{
+    float loss, accuracy;
+    CheckpointHeader hdr;
+    if (!validator_collect(val, &loss, &accuracy, &hdr))
+        return;
+    printf("Validation after epoch %d (%d samples), Loss: %.4f, Accuracy: %.2f%%\n", hdr.epoch, val->data->count,
+           loss, accuracy * 100.0f);
+    if (hdr.step < settle_step)
+        return;
+    check_target(cfg, "validation", accuracy, hdr.epoch, val->submit_time - start, reached_target);
+    if (accuracy <= state->best_accuracy)
+    {
+        state->no_improve++;
+        return;
+    }
+    state->best_accuracy = accuracy;
+    state->no_improve = 0;
+    if (ck)
+    {
+        Network view;
+        network_view(&view, val->snapshot);
+        hdr.best_accuracy = accuracy;
+        hdr.no_improve = 0;
+        printf("Saving best checkpoint to %s\n", best_path);
+        checkpoint_save(ck, &view, &hdr, best_path);
+    }
+}
+
+void train_network(Network *net, BatchSource *src, TrainingResources *res, DataParallel *dp, Comm *comm,
+                   Validator *val, CheckpointHeader *state, const TrainConfig *cfg)
+{
+    DataParallel *workers = dp;
+    if (cfg->hogwild)
+        dp = NULL;
+    int micro_batches = dp ? dp->micro_batches : 1;
+    int ranks = comm ? comm->size : 1;
+    int num_batches = (int)(src->count / ((long long)BATCH_SIZE * micro_batches * ranks));
+    LrSchedule sched;
+    schedule_init(&sched, cfg, num_batches);
+    long long step = state->step;
+    const char *metric = val ? "validation" : "training";
+    long long settle_step = 0;
+    if (net->prune)
+    {
+        settle_step = (long long)(sched.total_steps * PRUNE_RAMP);
+        net->prune->end_step = settle_step = settle_step > 0 ? settle_step : 1;
+    }
+
+    if (num_batches == 0)
+    {
+        fprintf(stderr, "Batch size %d is larger than the dataset (%lld samples)\n", cfg->batch, src->count);
+        exit(1);
+    }
+    int writes_checkpoints = !comm || comm->rank == 0;
+    char best_path[256];
+    snprintf(best_path, sizeof(best_path), CHECKPOINT_BEST_FORMAT, cfg->checkpoint);
+    Checkpointer ck;
+    if (writes_checkpoints)
+        checkpointer_start(&ck);
+    if (val)
+        printf("Validating on %d held-out samples with %d thread(s) alongside training\n", val->data->count,
+               val->threads);
+    if (dp)
+        printf("Data-parallel: %d micro-batches of %d per step on %d threads, warmup %lld steps\n", micro_batches,
+               BATCH_SIZE, dp->threads, sched.warmup_steps);
+    if (cfg->hogwild)
+        printf("Hogwild: %d threads updating shared weights without locks\n", workers->threads);
+    if (net->prune)
+        printf("Pruning: %.0f%% of the hidden weights by step %lld, then retraining at that sparsity\n",
+               net->prune->target * 100.0f, settle_step);
+    if (comm)
+        printf("Distributed: %d processes x %d threads, ring all-reduce of %d gradient buckets, warmup %lld steps\n",
+               comm->size, omp_get_max_threads(), COMM_BUCKETS + 1, sched.warmup_steps);
+
+    if (sched.type != SCHEDULE_STEP)
+        printf("Schedule %s: peak lr %g, %lld warmup steps of %lld\n",
+               sched.type == SCHEDULE_ONECYCLE ? "onecycle" : sched.type == SCHEDULE_COSINE ? "cosine" : "linear",
+               sched.peak, sched.warmup_steps, sched.total_steps);
+    printf("Starting training...\n");
+    double start = now_seconds();
+    int reached_target = 0;
+    if (val && state->epoch > 0)
+        validator_submit(val, net, state);
+    for (int epoch = state->epoch; epoch < cfg->epochs; epoch++)
+    {
+        float epoch_loss = 0.0f;
+        float epoch_acc = 0.0f;
+        double epoch_start = now_seconds();
+        if (comm)
+            comm->busy_time = comm->wait_time = 0.0;
+        batch_source_begin_epoch(src, cfg->seed, epoch);
+        /* With the task executor one team lives for the whole epoch: the single thread gathers batches and
+         * spawns each step's task graph, and the rest of the team executes tasks instead of forking per loop.
+         * Data-parallel steps and Hogwild epochs open their own team. */
+        if (cfg->hogwild)
+        {
+            hogwild_epoch(net, src, workers, &sched, epoch, num_batches, &epoch_loss, &epoch_acc);
+            step += num_batches;
+        }
+        else
+        {
+#pragma omp parallel if (cfg->executor == EXECUTOR_TASKS && !dp && !comm)
+#pragma omp single
+            for (int batch = 0; batch < num_batches; batch++)
+            {
+                float learning_rate = schedule_rate(&sched, step);
+                net->opt.momentum = schedule_momentum(&sched, step++);
+                net->opt.t = step;
+                network_prune(net, step);
+                network_round_bf16(net);
+                network_fake_quantize(net);
+                float batch_loss, batch_acc;
+                if (dp)
+                {
+                    train_step_data_parallel(net, src, dp, batch, learning_rate, cfg->lars_eta, &batch_loss,
+                                             &batch_acc);
+                }
+                else if (comm)
+                {
+                    /* Every rank shuffles with the same seed and takes a rank-strided share of the batches. */
+                    load_batch(src, batch * comm->size + comm->rank, res);
+                    train_step_distributed(net, res, comm, learning_rate, &batch_loss, &batch_acc);
+                }
+                else
+                {
+                    load_batch(src, batch, res);
+                    lazy_begin_step(net, res->batch_rows);
+                    if (cfg->executor == EXECUTOR_TASKS)
+                        train_step_tasks(net, res, learning_rate, &batch_loss, &batch_acc);
+                    else
+                        train_step(net, res, learning_rate, &batch_loss, &batch_acc);
+                }
+                epoch_loss += batch_loss;
+                epoch_acc += batch_acc;
+                if (batch % PRINT_INTERVAL == 0)
+                {
+                    printf("Batch %d/%d, Loss: %.4f, Accuracy: %.2f%%\n", batch, num_batches, batch_loss,
+                           batch_acc * 100.0f);
+                }
+            }
+        }
+        batch_source_end_epoch(src);
+        lazy_flush(net);
+        network_prune(net, step);
+        if (net->prune)
+            printf("Pruning: %.1f%% of hidden weights zero\n", net->prune->sparsity * 100.0f);
+        if (net->lazy)
+        {
+            printf("Sparse updates: %.1f%% of first-layer rows active per step\n",
+                   100.0 * net->lazy->active_rows / ((double)net->lazy->steps * INPUT_SIZE));
+            net->lazy->active_rows = net->lazy->steps = 0;
+        }
+        if (comm)
+        {
+            /* Every rank must take the same early-stopping decision, so the metrics are averaged over ranks. */
+            float stats[2] = {epoch_loss / comm->size, epoch_acc / comm->size};
+            ring_allreduce(comm, stats, 2);
+            epoch_loss = stats[0];
+            epoch_acc = stats[1];
+            double elapsed = now_seconds() - epoch_start;
+            printf("Epoch time %.2f s, %.0f samples/s; all-reduce busy %.2f ms/step, exposed %.2f ms/step, "
+                   "%.1f%% of the epoch not waiting on it\n",
+                   elapsed, (double)num_batches * BATCH_SIZE * comm->size / elapsed,
+                   comm->busy_time * 1000.0 / num_batches, comm->wait_time * 1000.0 / num_batches,
+                   100.0 * (elapsed - comm->wait_time) / elapsed);
+        }
+        epoch_loss /= num_batches;
+        epoch_acc /= num_batches;
+        printf("Epoch %d/%d, Loss: %.4f, Accuracy: %.2f%%\n", epoch + 1, cfg->epochs, epoch_loss, epoch_acc * 100.0f);
+        int settled = step >= settle_step;
+        if (!val && settled)
+            check_target(cfg, metric, epoch_acc, epoch + 1, now_seconds() - start, &reached_target);
+        state->epoch = epoch + 1;
+        state->step = step;
+        state->learning_rate = schedule_rate(&sched, step);
+        if (val)
+        {
+            /* The previous epoch's snapshot was validated while this epoch trained; queue this one. */
+            record_validation(val, writes_checkpoints ? &ck : NULL, best_path, state, cfg, start, settle_step,
+                              &reached_target);
+            validator_submit(val, net, state);
+        }
+        else if (settled && epoch_acc > state->best_accuracy)
+        {
+            state->best_accuracy = epoch_acc;
+            state->no_improve = 0;
+            if (writes_checkpoints)
+            {
+                printf("Saving best checkpoint to %s\n", best_path);
+                checkpoint_save(&ck, net, state, best_path);
+            }
+        }
+        else if (settled)
+        {
+            state->no_improve++;
+        }
+        if (writes_checkpoints)
+            checkpoint_save(&ck, net, state, cfg->checkpoint);
+        int stop = state->no_improve >= PATIENCE;
+        if (comm)
+        {
+            /* Only rank 0 validates, so its decision is broadcast. */
+            float flag = comm->rank == 0 && stop ? 1.0f : 0.0f;
+            ring_allreduce(comm, &flag, 1);
+            stop = flag > 0.0f;
+        }
+        if (stop)
+        {
+            printf("Early stopping triggered. Best %s accuracy: %.2f%%\n", metric, state->best_accuracy * 100.0f);
+            break;
+        }
+    }
+    if (val)
+        record_validation(val, writes_checkpoints ? &ck : NULL, best_path, state, cfg, start, settle_step,
+                              &reached_target);
+    if (writes_checkpoints)
+        checkpointer_stop(&ck);
+    printf("Training completed. Best %s accuracy: %.2f%%\n", metric, state->best_accuracy * 100.0f);
+}
+
+void bench_executors(Network *net, BatchSource *src, TrainingResources *res, const TrainConfig *cfg)
+{
+    batch_source_begin_epoch(src, cfg->seed, 0);
+    load_batch(src, 0, res);
+    network_round_bf16(net);
+    network_fake_quantize(net);
+    printf("Training steps/s over %d steps (fork-join vs task graph):\n", cfg->bench_steps);
+    int max_threads = omp_get_max_threads();
+    for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads)
+    {
+        omp_set_num_threads(threads);
+        double rate[2];
+        for (int executor = EXECUTOR_FORK_JOIN; executor <= EXECUTOR_TASKS; executor++)
+        {
+            double start = now_seconds();
+#pragma omp parallel if (executor == EXECUTOR_TASKS)
+#pragma omp single
+            for (int step = 0; step < cfg->bench_steps; step++)
+            {
+                float loss, acc;
+                if (executor == EXECUTOR_TASKS)
+                    train_step_tasks(net, res, 0.0f, &loss, &acc);
+                else
+                    train_step(net, res, 0.0f, &loss, &acc);
+            }
+            rate[executor] = cfg->bench_steps / (now_seconds() - start);
+        }
+        printf("  %3d threads: fork-join %8.1f, tasks %8.1f (%.2fx)\n", threads, rate[0], rate[1], rate[1] / rate[0]);
+        if (threads == max_threads)
+            break;
+    }
+    omp_set_num_threads(max_threads);
+    batch_source_end_epoch(src);
+}
+
+void bench_gather(const Dataset *data, TrainingResources *res, uint64_t seed)
+{
+    PackedDataset packed[2];
+    pack_dataset(data, 1, &packed[0]);
+    pack_dataset(data, 2, &packed[1]);
+    printf("Gather throughput over %d epochs of %d samples:\n", BENCH_GATHER_EPOCHS, data->count);
+    for (int variant = 0; variant < 3; variant++)
+    {
+        const PackedDataset *pd = variant == 0 ? NULL : &packed[variant - 1];
+        BatchSource src;
+        batch_source_init(&src, data, pd, NULL, pd ? pd->input_bits : 8);
+        int num_batches = (int)(src.count / BATCH_SIZE);
+        double start = now_seconds();
+        for (int epoch = 0; epoch < BENCH_GATHER_EPOCHS; epoch++)
+        {
+            batch_source_begin_epoch(&src, seed, epoch);
+            for (int batch = 0; batch < num_batches; batch++)
+                load_batch(&src, batch, res);
+        }
+        double elapsed = now_seconds() - start;
+        int row_bytes = pd ? pd->row_bytes : INPUT_SIZE;
+        printf("  %d-bit: %3d bytes/image, %7.1f MB resident, %8.0f images/s\n", src.input_bits, row_bytes,
+               (double)row_bytes * data->count / 1e6,
+               (double)num_batches * BATCH_SIZE * BENCH_GATHER_EPOCHS / elapsed);
+        batch_source_free(&src);
+    }
+    free_packed_dataset(&packed[0]);
+    free_packed_dataset(&packed[1]);
+}
+
+float *allocate_array(size_t size)
+{
+    float *array = (float *)malloc(size * sizeof(float));
+    if (!array)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return array;
+}
+
+static void free_qat(Network *net)
+{
+    if (net->qat)
+    {
+        free(net->qat->hidden_q);
+        free(net->qat->output_q);
+        free(net->qat->hidden_weights);
+        free(net->qat->output_weights);
+        free(net->qat);
+        net->qat = NULL;
+    }
+}
+
+static void free_pruning(Network *net)
+{
+    if (net->prune)
+    {
+        free(net->prune->mask);
+        free(net->prune->magnitudes);
+        free(net->prune);
+        net->prune = NULL;
+    }
+}
+
+void free_network(Network *net)
+{
+    free(net->hidden_weights);
+    free(net->hidden_bias);
+    free(net->output_weights);
+    free(net->output_bias);
+    free(net->hidden_weights_momentum);
+    free(net->hidden_bias_momentum);
+    free(net->output_weights_momentum);
+    free(net->output_bias_momentum);
+    free(net->hidden_weights_bf16);
+    if (net->lazy)
+    {
+        free(net->lazy->row_step);
+        free(net->lazy->active);
+        free(net->lazy);
+    }
+    free_qat(net);
+    free_pruning(net);
+}
+
+void initialize_network(Network *net, uint64_t seed)
+{
+    net->hidden_weights = allocate_array(INPUT_SIZE * HIDDEN_SIZE);
+    net->hidden_bias = allocate_array(HIDDEN_SIZE);
+    net->output_weights = allocate_array(HIDDEN_SIZE * OUTPUT_SIZE);
+    net->output_bias = allocate_array(OUTPUT_SIZE);
+    net->hidden_weights_momentum = allocate_array(OPT_STATE_SIZE(INPUT_SIZE * HIDDEN_SIZE));
+    net->hidden_bias_momentum = allocate_array(OPT_STATE_SIZE(HIDDEN_SIZE));
+    net->output_weights_momentum = allocate_array(OPT_STATE_SIZE(HIDDEN_SIZE * OUTPUT_SIZE));
+    net->output_bias_momentum = allocate_array(OPT_STATE_SIZE(OUTPUT_SIZE));
+    net->hidden_weights_bf16 = NULL;
+    net->lazy = NULL;
+    net->qat = NULL;
+    net->prune = NULL;
+    memset(&net->opt, 0, sizeof(net->opt));
+    float scale = sqrtf(2.0f / INPUT_SIZE);
+    fill_random_normal(net->hidden_weights, INPUT_SIZE * HIDDEN_SIZE, scale, seed, RNG_STREAM_INIT, 0);
+    fill_random_normal(net->output_weights, HIDDEN_SIZE * OUTPUT_SIZE, scale, seed, RNG_STREAM_INIT, 1);
+    memset(net->hidden_weights_momentum, 0, OPT_STATE_SIZE(INPUT_SIZE * HIDDEN_SIZE) * sizeof(float));
+    memset(net->output_weights_momentum, 0, OPT_STATE_SIZE(HIDDEN_SIZE * OUTPUT_SIZE) * sizeof(float));
+    memset(net->hidden_bias, 0, HIDDEN_SIZE * sizeof(float));
+    memset(net->output_bias, 0, OUTPUT_SIZE * sizeof(float));
+    memset(net->hidden_bias_momentum, 0, OPT_STATE_SIZE(HIDDEN_SIZE) * sizeof(float));
+    memset(net->output_bias_momentum, 0, OPT_STATE_SIZE(OUTPUT_SIZE) * sizeof(float));
+}
+
+/* Philox4x32-10 (Salmon et al., SC'11). The output depends only on (seed, stream, substream, index), so any
+ * thread can draw any sample's randomness and results are identical for every thread count. */
+RngBlock rng_block(uint64_t seed, uint32_t stream, uint32_t substream, uint64_t index)
+{
+    uint32_t c0 = (uint32_t)index;
+    uint32_t c1 = (uint32_t)(index >> 32);
+    uint32_t c2 = substream;
+    uint32_t c3 = stream;
+    uint32_t k0 = (uint32_t)seed;
+    uint32_t k1 = (uint32_t)(seed >> 32);
+    for (int round = 0; round < 10; round++)
+    {
+        uint64_t p0 = (uint64_t)0xD2511F53u * c0;
+        uint64_t p1 = (uint64_t)0xCD9E8D57u * c2;
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    RngBlock block = {{c0, c1, c2, c3}};
+    return block;
+}
+
+float rng_uniform(uint32_t bits)
+{
+    return ((bits >> 8) + 1) * (1.0f / 16777216.0f);
+}
+
+void fill_random_normal(float *out, int n, float scale, uint64_t seed, uint32_t stream, uint32_t substream)
+{
+    int blocks = (n + 3) / 4;
+#pragma omp parallel for simd schedule(static)
+    for (int b = 0; b < blocks; b++)
+    {
+        RngBlock r = rng_block(seed, stream, substream, (uint64_t)b);
+        float r0 = sqrtf(-2.0f * logf(rng_uniform(r.v[0]))) * scale;
+        float r1 = sqrtf(-2.0f * logf(rng_uniform(r.v[2]))) * scale;
+        float t0 = 2.0f * (float)M_PI * rng_uniform(r.v[1]);
+        float t1 = 2.0f * (float)M_PI * rng_uniform(r.v[3]);
+        float z[4] = {r0 * cosf(t0), r0 * sinf(t0), r1 * cosf(t1), r1 * sinf(t1)};
+        for (int k = 0; k < 4; k++)
+        {
+            if (b * 4 + k < n)
+                out[b * 4 + k] = z[k];
+        }
+    }
+}
+
+gzFile open_idx_file(const char *filename, int *count, int *item_size)
+{
+    gzFile file = gzopen(filename, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Error opening file: %s\n", filename);
+        exit(1);
+    }
+    unsigned char header[16];
+    if (gzread(file, header, 4) != 4)
+    {
+        fprintf(stderr, "Error reading magic number\n");
+        exit(1);
+    }
+    int magic = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+    int dim_count = magic & 0xff;
+    if (dim_count < 1 || dim_count > 4)
+    {
+        fprintf(stderr, "Unsupported IDX dimension count in %s\n", filename);
+        exit(1);
+    }
+    *count = 0;
+    *item_size = 1;
+    for (int i = 0; i < dim_count; i++)
+    {
+        if (gzread(file, header + 4 * i, 4) != 4)
+        {
+            fprintf(stderr, "Error reading dimensions\n");
+            exit(1);
+        }
+        int dim = (header[4 * i] << 24) | (header[4 * i + 1] << 16) | (header[4 * i + 2] << 8) | header[4 * i + 3];
+        if (i == 0)
+            *count = dim;
+        else
+            *item_size *= dim;
+    }
+    return file;
+}
+
+void read_idx_file(const char *filename, unsigned char *data, int expected_size)
+{
+    int count, item_size;
+    gzFile file = open_idx_file(filename, &count, &item_size);
+    int total_size = count * item_size;
+    if (total_size != expected_size)
+    {
+        fprintf(stderr, "Unexpected file size\n");
+        exit(1);
+    }
+    if (gzread(file, data, total_size) != total_size)
+    {
+        fprintf(stderr, "Error reading data\n");
+        exit(1);
+    }
+    gzclose(file);
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+uint64_t hash_params(const uint64_t *values, int n)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < n; i++)
+    {
+        for (int b = 0; b < 8; b++)
+        {
+            h ^= (values[i] >> (8 * b)) & 0xff;
+            h *= 0x100000001b3ull;
+        }
+    }
+    return h;
+}
+
+static uint64_t align_up(uint64_t value, uint64_t align)
+{
+    return (value + align - 1) / align * align;
+}
+
+int dataset_write(const char *path, const unsigned char *images, const unsigned char *labels, int count, uint64_t key)
+{
+    DatasetHeader hdr = {0};
+    hdr.magic = DATASET_MAGIC;
+    hdr.version = DATASET_VERSION;
+    hdr.count = (uint32_t)count;
+    hdr.image_size = INPUT_SIZE;
+    hdr.num_classes = OUTPUT_SIZE;
+    hdr.key = key;
+    hdr.images_offset = DATASET_ALIGN;
+    hdr.labels_offset = align_up(hdr.images_offset + (uint64_t)count * INPUT_SIZE, 64);
+    hdr.index_offset = align_up(hdr.labels_offset + (uint64_t)count, 64);
+    hdr.file_size = hdr.index_offset + (uint64_t)(OUTPUT_SIZE + 1 + count) * sizeof(uint32_t);
+
+    uint32_t *index = (uint32_t *)calloc(OUTPUT_SIZE + 1 + count, sizeof(uint32_t));
+    if (!index)
+        return -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (labels[i] >= OUTPUT_SIZE)
+        {
+            fprintf(stderr, "Invalid label %d at sample %d\n", labels[i], i);
+            free(index);
+            return -1;
+        }
+        index[labels[i] + 1]++;
+    }
+    for (int c = 0; c < OUTPUT_SIZE; c++)
+    {
+        index[c + 1] += index[c];
+    }
+    uint32_t fill[OUTPUT_SIZE];
+    memcpy(fill, index, sizeof(fill));
+    for (int i = 0; i < count; i++)
+    {
+        index[OUTPUT_SIZE + 1 + fill[labels[i]]++] = (uint32_t)i;
+    }
+
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f)
+    {
+        free(index);
+        return -1;
+    }
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    ok = ok && fseek(f, (long)hdr.images_offset, SEEK_SET) == 0;
+    ok = ok && fwrite(images, INPUT_SIZE, count, f) == (size_t)count;
+    ok = ok && fseek(f, (long)hdr.labels_offset, SEEK_SET) == 0;
+    ok = ok && fwrite(labels, 1, count, f) == (size_t)count;
+    ok = ok && fseek(f, (long)hdr.index_offset, SEEK_SET) == 0;
+    ok = ok && fwrite(index, sizeof(uint32_t), OUTPUT_SIZE + 1 + count, f) == (size_t)(OUTPUT_SIZE + 1 + count);
+    ok = (fclose(f) == 0) && ok;
+    free(index);
+    if (!ok || rename(tmp_path, path) != 0)
+    {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int region_fits(uint64_t offset, uint64_t size, uint64_t file_size)
+{
+    return offset <= file_size && size <= file_size - offset;
+}
+
+/* Checks a mapped cache's layout against the file rather than trusting its header: every region must lie inside
+ * the file, and the class table must partition count samples with in-range indices. */
+static int dataset_check(const DatasetHeader *hdr, const unsigned char *base, uint64_t file_size)
+{
+    uint64_t count = hdr->count, entries = OUTPUT_SIZE + 1 + count;
+    if (!region_fits(hdr->images_offset, count * INPUT_SIZE, file_size) ||
+        !region_fits(hdr->labels_offset, count, file_size) || hdr->index_offset % sizeof(uint32_t) != 0 ||
+        !region_fits(hdr->index_offset, entries * sizeof(uint32_t), file_size))
+        return -1;
+    const uint32_t *class_start = (const uint32_t *)(base + hdr->index_offset);
+    if (class_start[0] != 0 || class_start[OUTPUT_SIZE] != count)
+        return -1;
+    for (int c = 0; c < OUTPUT_SIZE; c++)
+    {
+        if (class_start[c] > class_start[c + 1])
+            return -1;
+    }
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (class_start[OUTPUT_SIZE + 1 + i] >= count)
+            return -1;
+    }
+    return 0;
+}
+
+int dataset_map(const char *path, uint64_t key, Dataset *ds)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DatasetHeader))
+    {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    const DatasetHeader *hdr = (const DatasetHeader *)map;
+    if (hdr->magic != DATASET_MAGIC || hdr->version != DATASET_VERSION || hdr->image_size != INPUT_SIZE ||
+        hdr->num_classes != OUTPUT_SIZE || hdr->key != key || hdr->file_size != (uint64_t)st.st_size ||
+        dataset_check(hdr, (const unsigned char *)map, (uint64_t)st.st_size) != 0)
+    {
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+    madvise(map, (size_t)st.st_size, MADV_WILLNEED);
+    const unsigned char *base = (const unsigned char *)map;
+    ds->images = base + hdr->images_offset;
+    ds->labels = base + hdr->labels_offset;
+    ds->class_start = (const uint32_t *)(base + hdr->index_offset);
+    ds->class_index = ds->class_start + OUTPUT_SIZE + 1;
+    ds->count = (int)hdr->count;
+    ds->map = map;
+    ds->map_size = (size_t)st.st_size;
+    return 0;
+}
+
+void dataset_unmap(Dataset *ds)
+{
+    munmap(ds->map, ds->map_size);
+    memset(ds, 0, sizeof(*ds));
+}
+
+void make_shards(const char *images_path, const char *labels_path, const char *prefix, int shard_size)
+{
+    int image_count, image_size, label_count, label_size;
+    gzFile images = open_idx_file(images_path, &image_count, &image_size);
+    gzFile labels = open_idx_file(labels_path, &label_count, &label_size);
+    if (image_size != INPUT_SIZE || label_size != 1 || image_count != label_count)
+    {
+        fprintf(stderr, "%s and %s do not hold matching %d-pixel images and labels\n", images_path, labels_path,
+                INPUT_SIZE);
+        exit(1);
+    }
+    unsigned char *shard_images = (unsigned char *)malloc((size_t)shard_size * INPUT_SIZE);
+    unsigned char *shard_labels = (unsigned char *)malloc(shard_size);
+    if (!shard_images || !shard_labels)
+    {
+        fprintf(stderr, "Failed to allocate shard buffer\n");
+        exit(1);
+    }
+    int shard = 0;
+    for (int start = 0; start < image_count; start += shard_size, shard++)
+    {
+        int n = image_count - start < shard_size ? image_count - start : shard_size;
+        if (gzread(images, shard_images, (unsigned)n * INPUT_SIZE) != n * INPUT_SIZE ||
+            gzread(labels, shard_labels, (unsigned)n) != n)
+        {
+            fprintf(stderr, "Error reading data\n");
+            exit(1);
+        }
+        char path[512];
+        snprintf(path, sizeof(path), SHARD_PATH_FORMAT, prefix, shard);
+        if (dataset_write(path, shard_images, shard_labels, n, 0) != 0)
+        {
+            fprintf(stderr, "Failed to write shard %s\n", path);
+            exit(1);
+        }
+        printf("Wrote %s (%d samples)\n", path, n);
+    }
+    gzclose(images);
+    gzclose(labels);
+    free(shard_images);
+    free(shard_labels);
+}
+
+static int read_shard_header(const char *path, DatasetHeader *hdr)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int ok = pread(fd, hdr, sizeof(*hdr), 0) == (ssize_t)sizeof(*hdr);
+    close(fd);
+    if (!ok || hdr->magic != DATASET_MAGIC || hdr->version != DATASET_VERSION || hdr->image_size != INPUT_SIZE)
+        return -1;
+    return 0;
+}
+
+void shard_stream_open(ShardStream *ss, const char *prefix, uint64_t seed, int buffer_capacity)
+{
+    memset(ss, 0, sizeof(*ss));
+    ss->prefix = prefix;
+    ss->seed = seed;
+    char path[512];
+    DatasetHeader hdr;
+    for (;;)
+    {
+        snprintf(path, sizeof(path), SHARD_PATH_FORMAT, prefix, ss->num_shards);
+        if (read_shard_header(path, &hdr) != 0)
+            break;
+        int *counts = (int *)realloc(ss->shard_counts, (ss->num_shards + 1) * sizeof(int));
+        if (!counts)
+        {
+            fprintf(stderr, "Failed to allocate shard table\n");
+            exit(1);
+        }
+        ss->shard_counts = counts;
+        ss->shard_counts[ss->num_shards++] = (int)hdr.count;
+        ss->total += hdr.count;
+    }
+    if (ss->num_shards == 0)
+    {
+        fprintf(stderr, "No shards found for prefix %s\n", prefix);
+        exit(1);
+    }
+    ss->shard_order = (int *)malloc(ss->num_shards * sizeof(int));
+    ss->buf_capacity = buffer_capacity;
+    ss->buf_images = (unsigned char *)malloc((size_t)buffer_capacity * INPUT_SIZE);
+    ss->buf_labels = (unsigned char *)malloc(buffer_capacity);
+    if (!ss->shard_order || !ss->buf_images || !ss->buf_labels)
+    {
+        fprintf(stderr, "Failed to allocate shuffle buffer\n");
+        exit(1);
+    }
+    for (int i = 0; i < SHARD_READ_AHEAD; i++)
+    {
+        ss->chunks[i].images = (unsigned char *)malloc((size_t)SHARD_CHUNK_SAMPLES * INPUT_SIZE);
+        ss->chunks[i].labels = (unsigned char *)malloc(SHARD_CHUNK_SAMPLES);
+        if (!ss->chunks[i].images || !ss->chunks[i].labels)
+        {
+            fprintf(stderr, "Failed to allocate read-ahead buffers\n");
+            exit(1);
+        }
+    }
+    pthread_mutex_init(&ss->lock, NULL);
+    pthread_cond_init(&ss->not_empty, NULL);
+    pthread_cond_init(&ss->not_full, NULL);
+    printf("Streaming %lld samples from %d shards (%s-*.shard)\n", ss->total, ss->num_shards, prefix);
+}
+
+static int read_shard_chunks(ShardStream *ss, int shard)
+{
+    char path[512];
+    snprintf(path, sizeof(path), SHARD_PATH_FORMAT, ss->prefix, shard);
+    int fd = open(path, O_RDONLY);
+    DatasetHeader hdr;
+    if (fd < 0 || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+    {
+        fprintf(stderr, "Failed to open shard %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (uint32_t start = 0; start < hdr.count; start += SHARD_CHUNK_SAMPLES)
+    {
+        pthread_mutex_lock(&ss->lock);
+        while (ss->queued == SHARD_READ_AHEAD && !ss->stop)
+            pthread_cond_wait(&ss->not_full, &ss->lock);
+        int stop = ss->stop;
+        pthread_mutex_unlock(&ss->lock);
+        if (stop)
+            break;
+        ShardChunk *chunk = &ss->chunks[ss->tail];
+        uint32_t n = hdr.count - start < SHARD_CHUNK_SAMPLES ? hdr.count - start : SHARD_CHUNK_SAMPLES;
+        size_t image_bytes = (size_t)n * INPUT_SIZE;
+        if (pread(fd, chunk->images, image_bytes, (off_t)(hdr.images_offset + (uint64_t)start * INPUT_SIZE)) !=
+                (ssize_t)image_bytes ||
+            pread(fd, chunk->labels, n, (off_t)(hdr.labels_offset + start)) != (ssize_t)n)
+        {
+            fprintf(stderr, "Short read from shard %s\n", path);
+            close(fd);
+            return -1;
+        }
+        chunk->count = (int)n;
+        pthread_mutex_lock(&ss->lock);
+        ss->tail = (ss->tail + 1) % SHARD_READ_AHEAD;
+        ss->queued++;
+        pthread_cond_signal(&ss->not_empty);
+        pthread_mutex_unlock(&ss->lock);
+    }
+    close(fd);
+    return 0;
+}
+
+static void *shard_reader_main(void *arg)
+{
+    ShardStream *ss = (ShardStream *)arg;
+    int error = 0;
+    for (int i = 0; i < ss->num_shards && !error; i++)
+    {
+        error = read_shard_chunks(ss, ss->shard_order[i]) != 0;
+    }
+    pthread_mutex_lock(&ss->lock);
+    ss->reader_done = 1;
+    ss->reader_error = error;
+    pthread_cond_signal(&ss->not_empty);
+    pthread_mutex_unlock(&ss->lock);
+    return NULL;
+}
+
+void shard_stream_begin_epoch(ShardStream *ss, int epoch)
+{
+    shuffle_indices(ss->shard_order, ss->num_shards, ss->seed, RNG_STREAM_SHARD_ORDER, epoch);
+    ss->epoch = epoch;
+    ss->head = ss->tail = ss->queued = 0;
+    ss->reader_done = ss->reader_error = ss->stop = 0;
+    ss->have_cur = 0;
+    ss->buf_fill = 0;
+    ss->draws = 0;
+    ss->wait_time = 0.0;
+    if (pthread_create(&ss->reader, NULL, shard_reader_main, ss) != 0)
+    {
+        fprintf(stderr, "Failed to start shard reader thread\n");
+        exit(1);
+    }
+}
+
+static int shard_stream_pull(ShardStream *ss, unsigned char *image, unsigned char *label)
+{
+    if (!ss->have_cur)
+    {
+        double start = now_seconds();
+        pthread_mutex_lock(&ss->lock);
+        while (ss->queued == 0 && !ss->reader_done)
+            pthread_cond_wait(&ss->not_empty, &ss->lock);
+        int available = ss->queued > 0;
+        int error = ss->reader_error;
+        pthread_mutex_unlock(&ss->lock);
+        ss->wait_time += now_seconds() - start;
+        if (error)
+            exit(1);
+        if (!available)
+            return 0;
+        ss->have_cur = 1;
+        ss->cur_pos = 0;
+    }
+    ShardChunk *chunk = &ss->chunks[ss->head];
+    memcpy(image, &chunk->images[(size_t)ss->cur_pos * INPUT_SIZE], INPUT_SIZE);
+    *label = chunk->labels[ss->cur_pos];
+    if (++ss->cur_pos == chunk->count)
+    {
+        pthread_mutex_lock(&ss->lock);
+        ss->head = (ss->head + 1) % SHARD_READ_AHEAD;
+        ss->queued--;
+        pthread_cond_signal(&ss->not_full);
+        pthread_mutex_unlock(&ss->lock);
+        ss->have_cur = 0;
+    }
+    return 1;
+}
+
+int shard_stream_next_batch(ShardStream *ss, unsigned char *images, unsigned char *labels, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        while (ss->buf_fill < ss->buf_capacity &&
+               shard_stream_pull(ss, &ss->buf_images[(size_t)ss->buf_fill * INPUT_SIZE], &ss->buf_labels[ss->buf_fill]))
+            ss->buf_fill++;
+        if (ss->buf_fill == 0)
+            return i;
+        RngBlock r = rng_block(ss->seed, RNG_STREAM_SHUFFLE_BUFFER, (uint32_t)ss->epoch, ss->draws++);
+        int j = (int)(((uint64_t)r.v[0] * (uint64_t)ss->buf_fill) >> 32);
+        memcpy(&images[(size_t)i * INPUT_SIZE], &ss->buf_images[(size_t)j * INPUT_SIZE], INPUT_SIZE);
+        labels[i] = ss->buf_labels[j];
+        if (!shard_stream_pull(ss, &ss->buf_images[(size_t)j * INPUT_SIZE], &ss->buf_labels[j]))
+        {
+            ss->buf_fill--;
+            memcpy(&ss->buf_images[(size_t)j * INPUT_SIZE], &ss->buf_images[(size_t)ss->buf_fill * INPUT_SIZE],
+                   INPUT_SIZE);
+            ss->buf_labels[j] = ss->buf_labels[ss->buf_fill];
+        }
+    }
+    return n;
+}
+
+void shard_stream_end_epoch(ShardStream *ss)
+{
+    pthread_mutex_lock(&ss->lock);
+    ss->stop = 1;
+    pthread_cond_signal(&ss->not_full);
+    pthread_mutex_unlock(&ss->lock);
+    pthread_join(ss->reader, NULL);
+}
+
+void shard_stream_close(ShardStream *ss)
+{
+    for (int i = 0; i < SHARD_READ_AHEAD; i++)
+    {
+        free(ss->chunks[i].images);
+        free(ss->chunks[i].labels);
+    }
+    free(ss->buf_images);
+    free(ss->buf_labels);
+    free(ss->shard_order);
+    free(ss->shard_counts);
+    pthread_mutex_destroy(&ss->lock);
+    pthread_cond_destroy(&ss->not_empty);
+    pthread_cond_destroy(&ss->not_full);
+}
+
+unsigned char quantize_pixel(unsigned char value, int bits)
+{
+    if (bits == 1)
+        return value >= BINARIZE_THRESHOLD ? 255 : 0;
+    if (bits == 2)
+        return (unsigned char)((value * 3 + 127) / 255 * 85);
+    return value;
+}
+
+void quantize_images(unsigned char *images, int n, int bits)
+{
+    if (bits >= 8)
+        return;
+    for (int i = 0; i < n * INPUT_SIZE; i++)
+    {
+        images[i] = quantize_pixel(images[i], bits);
+    }
+}
+
+static void init_unpack_tables(void)
+{
+    for (int byte = 0; byte < 256; byte++)
+    {
+        for (int k = 0; k < 8; k++)
+            unpack_lut1[byte][k] = (unsigned char)(((byte >> k) & 1) * 255);
+        for (int k = 0; k < 4; k++)
+            unpack_lut2[byte][k] = (unsigned char)(((byte >> (2 * k)) & 3) * 85);
+    }
+}
+
+void pack_dataset(const Dataset *data, int bits, PackedDataset *pd)
+{
+    init_unpack_tables();
+    pd->count = data->count;
+    pd->input_bits = bits;
+    pd->row_bytes = INPUT_SIZE * bits / 8;
+    pd->bits = (unsigned char *)calloc((size_t)data->count, pd->row_bytes);
+    pd->labels = (unsigned char *)malloc(data->count);
+    if (!pd->bits || !pd->labels)
+    {
+        fprintf(stderr, "Failed to allocate packed dataset\n");
+        exit(1);
+    }
+    memcpy(pd->labels, data->labels, data->count);
+    int per_byte = 8 / bits;
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < data->count; i++)
+    {
+        const unsigned char *image = &data->images[(size_t)i * INPUT_SIZE];
+        unsigned char *row = &pd->bits[(size_t)i * pd->row_bytes];
+        for (int j = 0; j < INPUT_SIZE; j++)
+        {
+            int level = quantize_pixel(image[j], bits) / (255 / ((1 << bits) - 1));
+            row[j / per_byte] |= (unsigned char)(level << (bits * (j % per_byte)));
+        }
+    }
+}
+
+void free_packed_dataset(PackedDataset *pd)
+{
+    free(pd->bits);
+    free(pd->labels);
+    memset(pd, 0, sizeof(*pd));
+}
+
+void shuffle_indices(int *order, int n, uint64_t seed, uint32_t stream, int epoch)
+{
+    for (int i = 0; i < n; i++)
+    {
+        order[i] = i;
+    }
+    for (int i = n - 1; i > 0; i--)
+    {
+        RngBlock r = rng_block(seed, stream, (uint32_t)epoch, (uint64_t)i);
+        int j = (int)(((uint64_t)r.v[0] * (uint64_t)(i + 1)) >> 32);
+        int temp = order[i];
+        order[i] = order[j];
+        order[j] = temp;
+    }
+}
+
+float gaussian(float x, float y, float sigma)
+{
+    float coeff = 1.0f / (2.0f * M_PI * sigma * sigma);
+    float expo = -(x * x + y * y) / (2.0f * sigma * sigma);
+    return coeff * expf(expo);
+}
+
+void gaussian_filter(float *input, float *output, int size, float sigma)
+{
+    int kernel_size = (int)(6.0f * sigma);
+    if (kernel_size % 2 == 0)
+        kernel_size++;
+    int half = kernel_size / 2;
+    float *kernel = (float *)malloc(kernel_size * kernel_size * sizeof(float));
+    float sum = 0.0f;
+    for (int y = -half; y <= half; y++)
+    {
+        for (int x = -half; x <= half; x++)
+        {
+            float g = gaussian((float)x, (float)y, sigma);
+            kernel[(y + half) * kernel_size + (x + half)] = g;
+            sum += g;
+        }
+    }
+    for (int i = 0; i < kernel_size * kernel_size; i++)
+    {
+        kernel[i] /= sum;
+    }
+    for (int y = 0; y < size; y++)
+    {
+        for (int x = 0; x < size; x++)
+        {
+            float val = 0.0f;
+            for (int ky = -half; ky <= half; ky++)
+            {
+                for (int kx = -half; kx <= half; kx++)
+                {
+                    int py = y + ky;
+                    int px = x + kx;
+                    if (px >= 0 && px < size && py >= 0 && py < size)
+                    {
+                        val += input[py * size + px] * kernel[(ky + half) * kernel_size + (kx + half)];
+                    }
+                }
+            }
+            output[y * size + x] = val;
+        }
+    }
+    free(kernel);
+}
+
+void rotate_image(unsigned char *input, unsigned char *output, float angle)
+{
+    float radian = angle * M_PI / 180.0f;
+    float cos_theta = cosf(radian);
+    float sin_theta = sinf(radian);
+    memset(output, 0, IMAGE_DIM * IMAGE_DIM);
+    for (int y = 0; y < IMAGE_DIM; y++)
+    {
+        for (int x = 0; x < IMAGE_DIM; x++)
+        {
+            float xc = x - IMAGE_CENTER;
+            float yc = y - IMAGE_CENTER;
+            float xr = xc * cos_theta - yc * sin_theta + IMAGE_CENTER;
+            float yr = xc * sin_theta + yc * cos_theta + IMAGE_CENTER;
+            if (xr >= 0 && xr < (IMAGE_DIM - 1) && yr >= 0 && yr < (IMAGE_DIM - 1))
+            {
+                int x0 = (int)xr;
+                int y0 = (int)yr;
+                float dx = xr - x0;
+                float dy = yr - y0;
+                float v00 = input[y0 * IMAGE_DIM + x0];
+                float v01 = input[y0 * IMAGE_DIM + (x0 + 1)];
+                float v10 = input[(y0 + 1) * IMAGE_DIM + x0];
+                float v11 = input[(y0 + 1) * IMAGE_DIM + (x0 + 1)];
+                float val = v00 * (1 - dx) * (1 - dy) + v01 * dx * (1 - dy) + v10 * (1 - dx) * dy + v11 * dx * dy;
+                output[y * IMAGE_DIM + x] = (unsigned char)val;
+            }
+        }
+    }
+}
+
+void augment_digit(unsigned char *input, unsigned char *output, uint64_t seed, uint64_t sample_idx)
+{
+    unsigned char *temp1 = (unsigned char *)malloc(IMAGE_DIM * IMAGE_DIM);
+    unsigned char *temp2 = (unsigned char *)malloc(IMAGE_DIM * IMAGE_DIM);
     float *float_buffer1 = (float *)malloc(IMAGE_DIM * IMAGE_DIM * sizeof(float));
     float *float_buffer2 = (float *)malloc(IMAGE_DIM * IMAGE_DIM * sizeof(float));
     if (!temp1 || !temp2 || !float_buffer1 || !float_buffer2)
     {
-        fprintf(stderr, "Failed to allocate memory for augmentation\n");
+        fprintf(stderr, "Failed to allocate memory for augmentation\n");
+        exit(1);
+    }
+    RngBlock r = rng_block(seed, RNG_STREAM_AUGMENT, 0, sample_idx);
+    float angle = rng_uniform(r.v[0]) * (2.0f * ROTATION_MAX_DEG) - ROTATION_MAX_DEG;
+    rotate_image(input, temp1, angle);
+    int shift_x = (int)(r.v[1] % SHIFT_RANGE) - SHIFT_OFFSET;
+    int shift_y = (int)(r.v[2] % SHIFT_RANGE) - SHIFT_OFFSET;
+    memset(temp2, 0, IMAGE_DIM * IMAGE_DIM);
+    for (int y = 0; y < IMAGE_DIM; y++)
+    {
+        for (int x = 0; x < IMAGE_DIM; x++)
+        {
+            int new_x = x + shift_x;
+            int new_y = y + shift_y;
+            if (new_x >= 0 && new_x < IMAGE_DIM && new_y >= 0 && new_y < IMAGE_DIM)
+            {
+                temp2[new_y * IMAGE_DIM + new_x] = temp1[y * IMAGE_DIM + x];
+            }
+        }
+    }
+    for (int i = 0; i < IMAGE_DIM * IMAGE_DIM; i++)
+    {
+        float_buffer1[i] = temp2[i] / 255.0f;
+    }
+    gaussian_filter(float_buffer1, float_buffer2, IMAGE_DIM, GAUSSIAN_SIGMA);
+    for (int i = 0; i < IMAGE_DIM * IMAGE_DIM; i++)
+    {
+        float val = float_buffer2[i] * 255.0f;
+        output[i] = (unsigned char)((val < 0) ? 0 : ((val > 255) ? 255 : val));
+    }
+    free(temp1);
+    free(temp2);
+    free(float_buffer1);
+    free(float_buffer2);
+}
+
+/* Augments SAMPLES_PER_DIGIT originals per digit drawn from the first pool samples of train; the rest are held
+ * out for validation. */
+void create_augmented_dataset(const Dataset *train, int pool, unsigned char *augmented_images,
+                              unsigned char *augmented_labels, uint64_t seed)
+{
+    uint32_t *candidates = (uint32_t *)malloc((size_t)train->count * sizeof(uint32_t));
+    int *source = (int *)malloc(SAMPLES_PER_DIGIT * OUTPUT_SIZE * sizeof(int));
+    if (!candidates || !source)
+    {
+        fprintf(stderr, "Failed to allocate memory for augmentation\n");
+        exit(1);
+    }
+    uint32_t *digit_indices = candidates;
+    for (int digit = 0; digit < OUTPUT_SIZE; digit++)
+    {
+        digit_indices += digit > 0 ? (int)(train->class_start[digit] - train->class_start[digit - 1]) : 0;
+        int digit_count = 0;
+        for (uint32_t k = train->class_start[digit]; k < train->class_start[digit + 1]; k++)
+        {
+            if ((int)train->class_index[k] < pool)
+                digit_indices[digit_count++] = train->class_index[k];
+        }
+        if (digit_count < SAMPLES_PER_DIGIT)
+        {
+            fprintf(stderr, "Not enough samples for digit %d (%d < %d)\n", digit, digit_count, SAMPLES_PER_DIGIT);
+            exit(1);
+        }
+        for (int j = 0; j < SAMPLES_PER_DIGIT; j++)
+        {
+            RngBlock r = rng_block(seed, RNG_STREAM_SELECT, (uint32_t)digit, (uint64_t)j);
+            int remain = digit_count - j;
+            int rand_idx = j + (int)(((uint64_t)r.v[0] * (uint64_t)remain) >> 32);
+            uint32_t tmp_idx = digit_indices[j];
+            digit_indices[j] = digit_indices[rand_idx];
+            digit_indices[rand_idx] = tmp_idx;
+            source[digit * SAMPLES_PER_DIGIT + j] = (int)digit_indices[j];
+        }
+    }
+    free(candidates);
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int s = 0; s < SAMPLES_PER_DIGIT * OUTPUT_SIZE; s++)
+    {
+        int idx = source[s];
+        int sample_idx = 2 * s;
+        memcpy(&augmented_images[(size_t)sample_idx * INPUT_SIZE], &train->images[(size_t)idx * INPUT_SIZE],
+               INPUT_SIZE);
+        augmented_labels[sample_idx] = train->labels[idx];
+        augment_digit((unsigned char *)&train->images[(size_t)idx * INPUT_SIZE],
+                      &augmented_images[(size_t)(sample_idx + 1) * INPUT_SIZE], seed, (uint64_t)(sample_idx + 1));
+        augmented_labels[sample_idx + 1] = train->labels[idx];
+    }
+    free(source);
+}
+
+float relu(float x)
+{
+    return (x > 0) ? x : 0;
+}
+
+float relu_derivative(float x)
+{
+    return (x > 0) ? 1.0f : 0.0f;
+}
+
+void softmax(float *input, float *output, int size)
+{
+    float max_val = input[0];
+    for (int i = 1; i < size; i++)
+    {
+        if (input[i] > max_val)
+            max_val = input[i];
+    }
+    float sum = 0.0f;
+    for (int i = 0; i < size; i++)
+    {
+        output[i] = expf(input[i] - max_val);
+        sum += output[i];
+    }
+    for (int i = 0; i < size; i++)
+    {
+        output[i] /= sum;
+    }
+}
+
+/* bf16 is the upper half of an fp32; rounding is to nearest even. Pixels are integers up to 255 and convert
+ * exactly. NaNs are kept quiet NaNs, since rounding one whose payload is only in the low bits would carry into
+ * the exponent and give Inf. */
+static uint16_t float_to_bf16(float x)
+{
+    uint32_t u;
+    memcpy(&u, &x, sizeof(u));
+    if ((u & 0x7fffffff) > 0x7f800000)
+        return (uint16_t)((u >> 16) | 0x40);
+    u += 0x7fff + ((u >> 16) & 1);
+    return (uint16_t)(u >> 16);
+}
+
+static inline uint32_t pixel_pair_bf16(unsigned char a, unsigned char b)
+{
+    return float_to_bf16(a) | (uint32_t)float_to_bf16(b) << 16;
+}
+
+/* acc[j] += pairs[2j] * lo(x) + pairs[2j + 1] * hi(x) over HIDDEN_SIZE outputs, where x packs two bf16 values:
+ * bf16 operands with fp32 products and accumulation, one VDPBF16PS per 16 outputs when the CPU has AVX512-BF16. */
+static inline void bf16_pair_axpy(float *restrict acc, const uint16_t *restrict pairs, uint32_t x)
+{
+#ifdef __AVX512BF16__
+    __m512bh xv = (__m512bh)_mm512_set1_epi32((int)x);
+    for (int j = 0; j < HIDDEN_SIZE; j += 16)
+    {
+        __m512bh w = (__m512bh)_mm512_loadu_si512(&pairs[2 * j]);
+        _mm512_storeu_ps(&acc[j], _mm512_dpbf16_ps(_mm512_loadu_ps(&acc[j]), w, xv));
+    }
+#else
+    uint32_t u0 = x << 16, u1 = x & 0xffff0000u;
+    float x0, x1;
+    memcpy(&x0, &u0, sizeof(x0));
+    memcpy(&x1, &u1, sizeof(x1));
+    for (int j = 0; j < HIDDEN_SIZE; j++)
+    {
+        uint32_t w0 = (uint32_t)pairs[2 * j] << 16, w1 = (uint32_t)pairs[2 * j + 1] << 16;
+        float f0, f1;
+        memcpy(&f0, &w0, sizeof(f0));
+        memcpy(&f1, &w1, sizeof(f1));
+        acc[j] += f0 * x0 + f1 * x1;
+    }
+#endif
+}
+
+/* Mixed precision keeps the fp32 weights as the master copy and trains the first layer, which dominates the
+ * step, on bf16 operands: a copy of the hidden weights refreshed before every step, and the hidden error. Both
+ * are stored as pairs along the reduction dimension, (k, k + 1) for the weights and samples (i, i + 1) for the
+ * error, to feed the pairwise bf16 dot product. */
+void enable_bf16(Network *net, TrainingResources *res, DataParallel *dp)
+{
+    net->hidden_weights_bf16 = (uint16_t *)malloc(INPUT_SIZE * HIDDEN_SIZE * sizeof(uint16_t));
+    res->hidden_error_bf16 = (uint16_t *)malloc(BATCH_SIZE * HIDDEN_SIZE * sizeof(uint16_t));
+    if (!net->hidden_weights_bf16 || !res->hidden_error_bf16)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int t = 0; dp && t < dp->threads; t++)
+    {
+        dp->res[t].hidden_error_bf16 = (uint16_t *)malloc(BATCH_SIZE * HIDDEN_SIZE * sizeof(uint16_t));
+        if (!dp->res[t].hidden_error_bf16)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+#ifdef __AVX512BF16__
+    printf("Mixed precision: bf16 first-layer GEMMs (AVX512-BF16), fp32 master weights and accumulation\n");
+#else
+    printf("Mixed precision: bf16 first-layer GEMMs (emulated), fp32 master weights and accumulation\n");
+#endif
+}
+
+static void round_weight_pair(Network *net, int k)
+{
+    const float *w0 = &net->hidden_weights[k * HIDDEN_SIZE];
+    const float *w1 = w0 + HIDDEN_SIZE;
+    uint16_t *dst = &net->hidden_weights_bf16[k * HIDDEN_SIZE];
+    for (int j = 0; j < HIDDEN_SIZE; j++)
+    {
+        dst[2 * j] = float_to_bf16(w0[j]);
+        dst[2 * j + 1] = float_to_bf16(w1[j]);
+    }
+}
+
+/* Refreshes the bf16 copy from the master weights; a no-op in fp32. Inside an active team (the task executor)
+ * the rows become tasks, otherwise a parallel loop. */
+void network_round_bf16(Network *net)
+{
+    if (!net->hidden_weights_bf16)
+        return;
+    if (omp_in_parallel())
+    {
+#pragma omp taskloop grainsize(16)
+        for (int k = 0; k < INPUT_SIZE; k += 2)
+            round_weight_pair(net, k);
+    }
+    else
+    {
+#pragma omp parallel for
+        for (int k = 0; k < INPUT_SIZE; k += 2)
+            round_weight_pair(net, k);
+    }
+}
+
+void enable_qat(Network *net)
+{
+    net->qat = (QuantAware *)calloc(1, sizeof(QuantAware));
+    if (!net->qat)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    net->qat->hidden_q = (int8_t *)malloc(INPUT_SIZE * HIDDEN_SIZE);
+    net->qat->output_q = (int8_t *)malloc(HIDDEN_SIZE * OUTPUT_SIZE);
+    if (!net->qat->hidden_q || !net->qat->output_q)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    net->qat->hidden_weights = allocate_array(INPUT_SIZE * HIDDEN_SIZE);
+    net->qat->output_weights = allocate_array(HIDDEN_SIZE * OUTPUT_SIZE);
+}
+
+/* Quantizes and dequantizes QAT_ROWS rows of the hidden weights, or all of the output weights for the last tile. */
+static void fake_quantize_tile(Network *net, int t)
+{
+    QuantAware *qat = net->qat;
+    int hidden = t < INPUT_SIZE / QAT_ROWS;
+    int k0 = hidden ? t * QAT_ROWS : 0;
+    int k1 = hidden ? k0 + QAT_ROWS : HIDDEN_SIZE;
+    int n = hidden ? HIDDEN_SIZE : OUTPUT_SIZE;
+    const float *restrict scales = hidden ? qat->hidden_scales : qat->output_scales;
+    int8_t *restrict q = hidden ? qat->hidden_q : qat->output_q;
+    float *restrict w = hidden ? qat->hidden_weights : qat->output_weights;
+    model_quantize_rows(hidden ? net->hidden_weights : net->output_weights, k0, k1, n, scales, q);
+    for (int k = k0; k < k1; k++)
+    {
+        for (int j = 0; j < n; j++)
+            w[k * n + j] = q[k * n + j] * scales[j];
+    }
+}
+
+/* Refreshes the int8-rounded weights from the master weights; a no-op without QAT. The scales take a pass over
+ * every row, then the rows are rounded in parallel like network_round_bf16. */
+void network_fake_quantize(Network *net)
+{
+    if (!net->qat)
+        return;
+    model_weight_scales(net->hidden_weights, INPUT_SIZE, HIDDEN_SIZE, net->qat->hidden_scales);
+    model_weight_scales(net->output_weights, HIDDEN_SIZE, OUTPUT_SIZE, net->qat->output_scales);
+    if (omp_in_parallel())
+    {
+#pragma omp taskloop grainsize(1)
+        for (int t = 0; t <= INPUT_SIZE / QAT_ROWS; t++)
+            fake_quantize_tile(net, t);
+    }
+    else
+    {
+#pragma omp parallel for
+        for (int t = 0; t <= INPUT_SIZE / QAT_ROWS; t++)
+            fake_quantize_tile(net, t);
+    }
+}
+
+void enable_pruning(Network *net, float target)
+{
+    net->prune = (Pruning *)calloc(1, sizeof(Pruning));
+    if (!net->prune)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    net->prune->target = target;
+    net->prune->end_step = 1;
+    net->prune->mask_step = -1;
+    net->prune->mask = (unsigned char *)malloc(INPUT_SIZE * HIDDEN_SIZE);
+    if (!net->prune->mask)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    net->prune->magnitudes = allocate_array(INPUT_SIZE * HIDDEN_SIZE);
+}
+
+/* The k-th smallest of a[0..n) by quickselect, reordering a. */
+static float select_kth(float *a, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+    while (lo < hi)
+    {
+        float pivot = a[lo + (hi - lo) / 2];
+        int i = lo, j = hi;
+        while (i <= j)
+        {
+            while (a[i] < pivot)
+                i++;
+            while (a[j] > pivot)
+                j--;
+            if (i <= j)
+            {
+                float t = a[i];
+                a[i++] = a[j];
+                a[j--] = t;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+    return a[k];
+}
+
+/* Masks the hidden weights at or below the magnitude threshold for the step's scheduled sparsity. The last step
+ * moved the pruned weights off zero again, so they count as zero here: once pruned, a weight stays pruned. */
+static void update_prune_mask(Network *net, long long step)
+{
+    Pruning *prune = net->prune;
+    float t = step < prune->end_step ? (float)step / prune->end_step : 1.0f;
+    float sparsity = prune->target * (1.0f - (1.0f - t) * (1.0f - t) * (1.0f - t));
+    int n = INPUT_SIZE * HIDDEN_SIZE, count = (int)(sparsity * n), pruned = 0;
+    int masked = prune->mask_step >= 0;
+    for (int i = 0; i < n; i++)
+        prune->magnitudes[i] = masked && !prune->mask[i] ? 0.0f : fabsf(net->hidden_weights[i]);
+    float threshold = count > 0 ? select_kth(prune->magnitudes, n, count - 1) : -1.0f;
+    for (int i = 0; i < n; i++)
+    {
+        prune->mask[i] = (!masked || prune->mask[i]) && fabsf(net->hidden_weights[i]) > threshold;
+        pruned += !prune->mask[i];
+    }
+    prune->sparsity = (float)pruned / n;
+    prune->mask_step = step;
+}
+
+/* Zeroes the pruned hidden weights and their optimizer state (the first and second moments in their OPT_BLOCK
+ * block), recomputing the mask when it is due; a no-op without pruning. Without the state reset, momentum would
+ * keep building on the dead weights. The mask is redone every PRUNE_INTERVAL steps and once more on reaching
+ * the target. */
+void network_prune(Network *net, long long step)
+{
+    Pruning *prune = net->prune;
+    if (!prune)
+        return;
+    if (prune->mask_step < 0 || step - prune->mask_step >= PRUNE_INTERVAL ||
+        (step >= prune->end_step && prune->mask_step < prune->end_step))
+        update_prune_mask(net, step);
+    for (int i = 0; i < INPUT_SIZE * HIDDEN_SIZE; i++)
+    {
+        if (prune->mask[i])
+            continue;
+        float *state = &net->hidden_weights_momentum[OPT_STATE_OFFSET(i - i % OPT_BLOCK) + i % OPT_BLOCK];
+        net->hidden_weights[i] = 0.0f;
+        state[0] = state[OPT_BLOCK] = 0.0f;
+    }
+}
+
+/* Rounds one sample's hidden activations to uint8 steps of max / 255, as gemm_q8 in src/model.c does. */
+static void fake_quantize_activations(float *h)
+{
+    float max_val = 0.0f;
+    for (int j = 0; j < HIDDEN_SIZE; j++)
+        max_val = h[j] > max_val ? h[j] : max_val;
+    if (max_val == 0.0f)
+        return;
+    float scale = max_val / 255.0f, inv = 255.0f / max_val;
+    for (int j = 0; j < HIDDEN_SIZE; j++)
+        h[j] = rintf(h[j] * inv) * scale;
+}
+
+/* First layer straight from uint8 pixels: GEMM_ROWS samples share each streamed weight row, and the 1/255
+ * input scaling is applied once per output instead of once per pixel. Most MNIST pixels are zero, so weight rows
+ * whose pixels are zero in all GEMM_ROWS samples are skipped; adding 0 * w would not change the sums. */
+void hidden_forward_rows(const Network *net, const unsigned char *const *batch_rows, int i0, int i1,
+                         float *hidden_layer)
+{
+    const float *weights = net->qat ? net->qat->hidden_weights : net->hidden_weights;
+    for (int b = i0; b < i1; b += GEMM_ROWS)
+    {
+        float *restrict acc = &hidden_layer[b * HIDDEN_SIZE];
+        memset(acc, 0, GEMM_ROWS * HIDDEN_SIZE * sizeof(float));
+        if (net->hidden_weights_bf16)
+        {
+            for (int k = 0; k < INPUT_SIZE; k += 2)
+            {
+                const uint16_t *w = &net->hidden_weights_bf16[k * HIDDEN_SIZE];
+                for (int r = 0; r < GEMM_ROWS; r++)
+                {
+                    const unsigned char *x = batch_rows[b + r];
+                    if (x[k] | x[k + 1])
+                        bf16_pair_axpy(&acc[r * HIDDEN_SIZE], w, pixel_pair_bf16(x[k], x[k + 1]));
+                }
+            }
+        }
+        else
+        {
+            for (int k = 0; k < INPUT_SIZE; k++)
+            {
+                if (!(batch_rows[b][k] | batch_rows[b + 1][k] | batch_rows[b + 2][k] | batch_rows[b + 3][k]))
+                    continue;
+                const float *restrict w = &weights[k * HIDDEN_SIZE];
+                float x0 = batch_rows[b][k];
+                float x1 = batch_rows[b + 1][k];
+                float x2 = batch_rows[b + 2][k];
+                float x3 = batch_rows[b + 3][k];
+                for (int j = 0; j < HIDDEN_SIZE; j++)
+                {
+                    acc[j] += x0 * w[j];
+                    acc[HIDDEN_SIZE + j] += x1 * w[j];
+                    acc[2 * HIDDEN_SIZE + j] += x2 * w[j];
+                    acc[3 * HIDDEN_SIZE + j] += x3 * w[j];
+                }
+            }
+        }
+        for (int r = 0; r < GEMM_ROWS; r++)
+        {
+            for (int j = 0; j < HIDDEN_SIZE; j++)
+            {
+                acc[r * HIDDEN_SIZE + j] = relu(net->hidden_bias[j] + acc[r * HIDDEN_SIZE + j] * PIXEL_SCALE);
+            }
+            if (net->qat)
+                fake_quantize_activations(&acc[r * HIDDEN_SIZE]);
+        }
+    }
+}
+
+static void output_logits(const Network *net, const float *hidden, float *logits)
+{
+    const float *weights = net->qat ? net->qat->output_weights : net->output_weights;
+    for (int j = 0; j < OUTPUT_SIZE; j++)
+    {
+        float sum = net->output_bias[j];
+        for (int k = 0; k < HIDDEN_SIZE; k++)
+        {
+            sum += hidden[k] * weights[k * OUTPUT_SIZE + j];
+        }
+        logits[j] = sum;
+    }
+}
+
+/* Softmax probabilities, for inference. */
+void output_forward_rows(const Network *net, const float *hidden_layer, int i0, int i1, float *output_layer)
+{
+    for (int i = i0; i < i1; i++)
+    {
+        float tmp[OUTPUT_SIZE];
+        output_logits(net, &hidden_layer[i * HIDDEN_SIZE], tmp);
+        softmax(tmp, &output_layer[i * OUTPUT_SIZE], OUTPUT_SIZE);
+    }
+}
+
+/* From one row's ten logits straight to the cross-entropy (as log-sum-exp minus the label's logit), whether the
+ * arg-max is the label, and the output error softmax - onehot(label). The probabilities and the one-hot target
+ * are never stored. */
+static void loss_row(const float *z, int label, float *err, float *loss, unsigned char *correct)
+{
+    int predicted = 0;
+    for (int j = 1; j < OUTPUT_SIZE; j++)
+    {
+        if (z[j] > z[predicted])
+            predicted = j;
+    }
+    float max_val = z[predicted];
+    float sum = 0.0f;
+    for (int j = 0; j < OUTPUT_SIZE; j++)
+    {
+        err[j] = expf(z[j] - max_val);
+        sum += err[j];
+    }
+    for (int j = 0; j < OUTPUT_SIZE; j++)
+    {
+        err[j] = err[j] / sum - (j == label ? 1.0f : 0.0f);
+    }
+    *loss = logf(sum) - (z[label] - max_val);
+    *correct = predicted == label;
+}
+
+/* The training epilogue of the output GEMM: loss_row over each row's logits. */
+void output_loss_rows(const Network *net, const float *hidden_layer, const unsigned char *labels, int i0, int i1,
+                      float *output_error, float *sample_loss, unsigned char *sample_correct)
+{
+    for (int i = i0; i < i1; i++)
+    {
+        float z[OUTPUT_SIZE];
+        output_logits(net, &hidden_layer[i * HIDDEN_SIZE], z);
+        loss_row(z, labels[i], &output_error[i * OUTPUT_SIZE], &sample_loss[i], &sample_correct[i]);
+    }
+}
+
+void hidden_error_rows(const Network *net, const float *hidden_layer, const float *output_error, int i0, int i1,
+                       float *hidden_error, uint16_t *hidden_error_bf16)
+{
+    const float *weights = net->qat ? net->qat->output_weights : net->output_weights;
+    for (int i = i0; i < i1; i++)
+    {
+        for (int j = 0; j < HIDDEN_SIZE; j++)
+        {
+            float sum_err = 0.0f;
+            for (int k = 0; k < OUTPUT_SIZE; k++)
+            {
+                sum_err += output_error[i * OUTPUT_SIZE + k] * weights[j * OUTPUT_SIZE + k];
+            }
+            float err = sum_err * relu_derivative(hidden_layer[i * HIDDEN_SIZE + j]);
+            hidden_error[i * HIDDEN_SIZE + j] = err;
+            if (hidden_error_bf16)
+                hidden_error_bf16[(i & ~1) * HIDDEN_SIZE + 2 * j + (i & 1)] = float_to_bf16(err);
+        }
+    }
+}
+
+/* dw_hidden rows j0..j1: each pixel's row only sums the samples in which that pixel is non-zero, so a border
+ * pixel that is blank across the batch costs a scan of its column. */
+void hidden_weight_grad_rows(const unsigned char *const *batch_rows, const float *hidden_error,
+                             const uint16_t *hidden_error_bf16, int j0, int j1, float *dw_hidden)
+{
+    if (j1 > INPUT_SIZE)
+        j1 = INPUT_SIZE;
+    for (int j = j0; j < j1; j++)
+    {
+        float *restrict dw = &dw_hidden[j * HIDDEN_SIZE];
+        memset(dw, 0, HIDDEN_SIZE * sizeof(float));
+        if (hidden_error_bf16)
+        {
+            for (int i = 0; i < BATCH_SIZE; i += 2)
+            {
+                if (!(batch_rows[i][j] | batch_rows[i + 1][j]))
+                    continue;
+                uint32_t x = pixel_pair_bf16(batch_rows[i][j], batch_rows[i + 1][j]);
+                bf16_pair_axpy(dw, &hidden_error_bf16[i * HIDDEN_SIZE], x);
+            }
+            for (int k = 0; k < HIDDEN_SIZE; k++)
+                dw[k] *= PIXEL_SCALE / BATCH_SIZE;
+            continue;
+        }
+        for (int i = 0; i < BATCH_SIZE; i++)
+        {
+            if (!batch_rows[i][j])
+                continue;
+            float x = batch_rows[i][j] * (PIXEL_SCALE / BATCH_SIZE);
+            const float *restrict err = &hidden_error[i * HIDDEN_SIZE];
+            for (int k = 0; k < HIDDEN_SIZE; k++)
+            {
+                dw[k] += x * err[k];
+            }
+        }
+    }
+}
+
+void output_grads(const float *hidden_layer, const float *output_error, float *dw_output, float *db_output)
+{
+    for (int j = 0; j < HIDDEN_SIZE; j++)
+    {
+        for (int k = 0; k < OUTPUT_SIZE; k++)
+        {
+            float grad = 0.0f;
+            for (int i = 0; i < BATCH_SIZE; i++)
+            {
+                grad += hidden_layer[i * HIDDEN_SIZE + j] * output_error[i * OUTPUT_SIZE + k];
+            }
+            dw_output[j * OUTPUT_SIZE + k] = grad / BATCH_SIZE;
+        }
+    }
+    for (int j = 0; j < OUTPUT_SIZE; j++)
+    {
+        float grad = 0.0f;
+        for (int i = 0; i < BATCH_SIZE; i++)
+        {
+            grad += output_error[i * OUTPUT_SIZE + j];
+        }
+        db_output[j] = grad / BATCH_SIZE;
+    }
+}
+
+void hidden_bias_grad(const float *hidden_error, float *db_hidden)
+{
+    for (int j = 0; j < HIDDEN_SIZE; j++)
+    {
+        float grad = 0.0f;
+        for (int i = 0; i < BATCH_SIZE; i++)
+        {
+            grad += hidden_error[i * HIDDEN_SIZE + j];
+        }
+        db_hidden[j] = grad / BATCH_SIZE;
+    }
+}
+
+/* Fused single-pass update kernels. Each reads weights, gradient and one interleaved state stream: for every
+ * OPT_BLOCK parameters the state holds OPT_BLOCK first moments (the momentum for SGD and Nesterov) followed
+ * by OPT_BLOCK second moments (Adam only). n may end in a partial block; callers updating a sub-range pass a
+ * block-aligned start and OPT_STATE_OFFSET(start). */
+static void sgd_step(float *restrict weights, float *restrict state, const float *restrict grad, int n,
+                     float learning_rate, float momentum, int nesterov)
+{
+    for (int b = 0; b < n; b += OPT_BLOCK)
+    {
+        int len = n - b < OPT_BLOCK ? n - b : OPT_BLOCK;
+        float *restrict w = &weights[b];
+        float *restrict m = &state[2 * b];
+        const float *restrict g = &grad[b];
+#pragma omp simd
+        for (int i = 0; i < len; i++)
+        {
+            float v = momentum * m[i] - learning_rate * g[i];
+            m[i] = v;
+            w[i] += nesterov ? momentum * v - learning_rate * g[i] : v;
+        }
+    }
+}
+
+static void adam_step(const Optimizer *opt, float *restrict weights, float *restrict state, const float *restrict grad,
+                      int n, float learning_rate)
+{
+    float t = opt->t > 0 ? (float)opt->t : 1.0f;
+    float step_size = learning_rate / (1.0f - powf(opt->beta1, t));
+    float inv_bias2 = 1.0f / (1.0f - powf(opt->beta2, t));
+    float decay = opt->type == OPT_ADAMW ? 1.0f - learning_rate * opt->weight_decay : 1.0f;
+    float beta1 = opt->beta1, beta2 = opt->beta2, eps = opt->eps;
+    for (int b = 0; b < n; b += OPT_BLOCK)
+    {
+        int len = n - b < OPT_BLOCK ? n - b : OPT_BLOCK;
+        float *restrict w = &weights[b];
+        float *restrict m = &state[2 * b];
+        float *restrict v = m + OPT_BLOCK;
+        const float *restrict g = &grad[b];
+#pragma omp simd
+        for (int i = 0; i < len; i++)
+        {
+            float mi = beta1 * m[i] + (1.0f - beta1) * g[i];
+            float vi = beta2 * v[i] + (1.0f - beta2) * g[i] * g[i];
+            m[i] = mi;
+            v[i] = vi;
+            w[i] = w[i] * decay - step_size * mi / (sqrtf(vi * inv_bias2) + eps);
+        }
+    }
+}
+
+void optimizer_step(const Optimizer *opt, float *weights, float *state, const float *grad, int n,
+                    float learning_rate)
+{
+    if (opt->type == OPT_ADAM || opt->type == OPT_ADAMW)
+        adam_step(opt, weights, state, grad, n, learning_rate);
+    else
+        sgd_step(weights, state, grad, n, learning_rate, opt->momentum, opt->type == OPT_NESTEROV);
+}
+
+void forward_pass(const Network *net, const unsigned char *const *batch_rows, const unsigned char *batch_labels,
+                  float *hidden_layer, float *output_error, float *sample_loss, unsigned char *sample_correct)
+{
+#pragma omp parallel for
+    for (int t = 0; t < ROW_TILES; t++)
+    {
+        hidden_forward_rows(net, batch_rows, t * TASK_ROWS, (t + 1) * TASK_ROWS, hidden_layer);
+    }
+
+#pragma omp parallel for
+    for (int t = 0; t < ROW_TILES; t++)
+    {
+        output_loss_rows(net, hidden_layer, batch_labels, t * TASK_ROWS, (t + 1) * TASK_ROWS, output_error,
+                         sample_loss, sample_correct);
+    }
+}
+
+void batch_metrics(const TrainingResources *res, float *batch_loss, float *batch_acc)
+{
+    float loss_val = 0.0f;
+    int correct = 0;
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        loss_val += res->sample_loss[i];
+        correct += res->sample_correct[i];
+    }
+    *batch_loss = loss_val / BATCH_SIZE;
+    *batch_acc = (float)correct / BATCH_SIZE;
+}
+
+void backward_pass(const Network *net, const unsigned char *const *batch_rows, const float *hidden_layer,
+                   const float *output_error, float *hidden_error, uint16_t *hidden_error_bf16, float *dw_hidden,
+                   float *dw_output, float *db_hidden, float *db_output)
+{
+#pragma omp parallel for
+    for (int t = 0; t < ROW_TILES; t++)
+    {
+        hidden_error_rows(net, hidden_layer, output_error, t * TASK_ROWS, (t + 1) * TASK_ROWS, hidden_error,
+                          hidden_error_bf16);
+    }
+
+#pragma omp parallel
+    {
+#pragma omp for nowait
+        for (int t = 0; t < WEIGHT_TILES; t++)
+        {
+            hidden_weight_grad_rows(batch_rows, hidden_error, hidden_error_bf16, t * WEIGHT_TILE_ROWS,
+                                    (t + 1) * WEIGHT_TILE_ROWS, dw_hidden);
+        }
+#pragma omp single nowait
+        output_grads(hidden_layer, output_error, dw_output, db_output);
+#pragma omp single nowait
+        hidden_bias_grad(hidden_error, db_hidden);
+    }
+}
+
+void enable_lazy_updates(Network *net)
+{
+    LazyUpdate *lazy = (LazyUpdate *)calloc(1, sizeof(*lazy));
+    if (!lazy || !(lazy->row_step = (long long *)malloc(INPUT_SIZE * sizeof(long long))) ||
+        !(lazy->active = (unsigned char *)malloc(INPUT_SIZE)))
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    /* Until a batch marks rows inactive every update is dense. */
+    for (int j = 0; j < INPUT_SIZE; j++)
+        lazy->row_step[j] = net->opt.t;
+    memset(lazy->active, 1, INPUT_SIZE);
+    net->lazy = lazy;
+}
+
+/* Applies the `gap` zero-gradient steps row j skipped. Each one decays the momentum by mu and adds it to the
+ * weights (Nesterov adds mu times the decayed momentum), so the total is a geometric series. This needs mu to be
+ * constant over the gap, which is why parse_args keeps --sparse-updates away from one-cycle. */
+static void lazy_catch_up(Network *net, int j, long long gap)
+{
+    float mu = net->opt.momentum;
+    float decay = powf(mu, (float)gap);
+    float gain = mu * (1.0f - decay) / (1.0f - mu);
+    if (net->opt.type == OPT_NESTEROV)
+        gain *= mu;
+    float *restrict w = &net->hidden_weights[j * HIDDEN_SIZE];
+    float *restrict state = &net->hidden_weights_momentum[OPT_STATE_OFFSET(j * HIDDEN_SIZE)];
+    for (int b = 0; b < HIDDEN_SIZE; b += OPT_BLOCK)
+    {
+        float *restrict m = &state[2 * b];
+#pragma omp simd
+        for (int i = 0; i < OPT_BLOCK; i++)
+        {
+            w[b + i] += gain * m[i];
+            m[i] *= decay;
+        }
+    }
+}
+
+/* Marks the pixels that are non-zero anywhere in the batch and brings their weight rows up to date before the
+ * forward pass reads them. net->opt.t must already count this step. */
+void lazy_begin_step(Network *net, const unsigned char *const *batch_rows)
+{
+    LazyUpdate *lazy = net->lazy;
+    if (!lazy)
+        return;
+    unsigned char *restrict active = lazy->active;
+    memset(active, 0, INPUT_SIZE);
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        const unsigned char *restrict x = batch_rows[i];
+        for (int j = 0; j < INPUT_SIZE; j++)
+            active[j] |= x[j];
+    }
+    long long done = net->opt.t - 1;
+    for (int j = 0; j < INPUT_SIZE; j++)
+    {
+        if (!lazy->active[j])
+            continue;
+        lazy->active_rows++;
+        if (lazy->row_step[j] < done)
+        {
+            lazy_catch_up(net, j, done - lazy->row_step[j]);
+            lazy->row_step[j] = done;
+            if (net->hidden_weights_bf16)
+                round_weight_pair(net, j & ~1);
+        }
+    }
+    lazy->steps++;
+}
+
+/* Brings every row up to date, before the weights are copied out or training ends. */
+void lazy_flush(Network *net)
+{
+    LazyUpdate *lazy = net->lazy;
+    if (!lazy)
+        return;
+    for (int j = 0; j < INPUT_SIZE; j++)
+    {
+        if (lazy->row_step[j] < net->opt.t)
+        {
+            lazy_catch_up(net, j, net->opt.t - lazy->row_step[j]);
+            lazy->row_step[j] = net->opt.t;
+        }
+    }
+    if (net->hidden_weights_bf16)
+        network_round_bf16(net);
+}
+
+/* Optimizer step for hidden weight rows j0..j1 (j0 block-aligned): the whole range when dense, otherwise only
+ * the rows whose pixels were active in this batch. */
+void update_hidden_rows(Network *net, const float *dw_hidden, int j0, int j1, float learning_rate)
+{
+    if (!net->lazy)
+    {
+        optimizer_step(&net->opt, &net->hidden_weights[j0 * HIDDEN_SIZE],
+                       &net->hidden_weights_momentum[OPT_STATE_OFFSET(j0 * HIDDEN_SIZE)], &dw_hidden[j0 * HIDDEN_SIZE],
+                       (j1 - j0) * HIDDEN_SIZE, learning_rate);
+        return;
+    }
+    for (int j = j0; j < j1; j++)
+    {
+        if (!net->lazy->active[j])
+            continue;
+        optimizer_step(&net->opt, &net->hidden_weights[j * HIDDEN_SIZE],
+                       &net->hidden_weights_momentum[OPT_STATE_OFFSET(j * HIDDEN_SIZE)], &dw_hidden[j * HIDDEN_SIZE],
+                       HIDDEN_SIZE, learning_rate);
+        net->lazy->row_step[j] = net->opt.t;
+    }
+}
+
+void update_network(Network *net, const float *dw_hidden, const float *dw_output, const float *db_hidden,
+                    const float *db_output, float learning_rate)
+{
+#pragma omp parallel
+    {
+#pragma omp for nowait
+        for (int t = 0; t < WEIGHT_TILES; t++)
+        {
+            int j0 = t * WEIGHT_TILE_ROWS;
+            int j1 = j0 + WEIGHT_TILE_ROWS < INPUT_SIZE ? j0 + WEIGHT_TILE_ROWS : INPUT_SIZE;
+            update_hidden_rows(net, dw_hidden, j0, j1, learning_rate);
+        }
+#pragma omp single nowait
+        {
+            optimizer_step(&net->opt, net->hidden_bias, net->hidden_bias_momentum, db_hidden, HIDDEN_SIZE,
+                           learning_rate);
+            optimizer_step(&net->opt, net->output_weights, net->output_weights_momentum, dw_output,
+                           HIDDEN_SIZE * OUTPUT_SIZE, learning_rate);
+            optimizer_step(&net->opt, net->output_bias, net->output_bias_momentum, db_output, OUTPUT_SIZE,
+                           learning_rate);
+        }
+    }
+}
+
+/* One training step as a dependency graph over row tiles (samples) and weight tiles (input pixels). Each row
+ * tile flows forward -> fused softmax/loss/output error -> hidden error on its own; the output-layer gradient
+ * overlaps the hidden-error tiles, and each hidden weight tile is updated as soon as its gradient tile is done.
+ * Must be called from inside a parallel region; idle team threads pick up ready tasks. */
+void train_step_tasks(Network *net, TrainingResources *res, float learning_rate, float *batch_loss, float *batch_acc)
+{
+    char fwd_done[ROW_TILES], out_done[ROW_TILES], err_done[ROW_TILES], dw_done[WEIGHT_TILES], dwo_done;
+    (void)fwd_done, (void)out_done, (void)err_done, (void)dw_done, (void)dwo_done;
+    const unsigned char *const *rows = res->batch_rows;
+
+    for (int t = 0; t < ROW_TILES; t++)
+    {
+        int i0 = t * TASK_ROWS;
+        int i1 = i0 + TASK_ROWS;
+#pragma omp task depend(out : fwd_done[t])
+        hidden_forward_rows(net, rows, i0, i1, res->hidden_layer);
+#pragma omp task depend(in : fwd_done[t]) depend(out : out_done[t])
+        output_loss_rows(net, res->hidden_layer, res->batch_labels, i0, i1, res->output_error, res->sample_loss,
+                         res->sample_correct);
+#pragma omp task depend(in : out_done[t]) depend(out : err_done[t])
+        hidden_error_rows(net, res->hidden_layer, res->output_error, i0, i1, res->hidden_error, res->hidden_error_bf16);
+    }
+
+#pragma omp task depend(iterator(t = 0 : ROW_TILES), in : out_done[t])
+    batch_metrics(res, batch_loss, batch_acc);
+
+#pragma omp task depend(iterator(t = 0 : ROW_TILES), in : out_done[t]) depend(out : dwo_done)
+    output_grads(res->hidden_layer, res->output_error, res->dw_output, res->db_output);
+
+#pragma omp task depend(iterator(t = 0 : ROW_TILES), in : err_done[t]) depend(in : dwo_done)
+    {
+        optimizer_step(&net->opt, net->output_weights, net->output_weights_momentum, res->dw_output,
+                       HIDDEN_SIZE * OUTPUT_SIZE, learning_rate);
+        optimizer_step(&net->opt, net->output_bias, net->output_bias_momentum, res->db_output, OUTPUT_SIZE,
+                       learning_rate);
+    }
+
+#pragma omp task depend(iterator(t = 0 : ROW_TILES), in : err_done[t])
+    {
+        hidden_bias_grad(res->hidden_error, res->db_hidden);
+        optimizer_step(&net->opt, net->hidden_bias, net->hidden_bias_momentum, res->db_hidden, HIDDEN_SIZE,
+                       learning_rate);
+    }
+
+    for (int w = 0; w < WEIGHT_TILES; w++)
+    {
+        int j0 = w * WEIGHT_TILE_ROWS;
+        int j1 = j0 + WEIGHT_TILE_ROWS < INPUT_SIZE ? j0 + WEIGHT_TILE_ROWS : INPUT_SIZE;
+#pragma omp task depend(iterator(t = 0 : ROW_TILES), in : err_done[t]) depend(out : dw_done[w])
+        hidden_weight_grad_rows(rows, res->hidden_error, res->hidden_error_bf16, j0, j1, res->dw_hidden);
+#pragma omp task depend(in : dw_done[w])
+        update_hidden_rows(net, res->dw_hidden, j0, j1, learning_rate);
+    }
+#pragma omp taskwait
+}
+
+/* Forward and backward for one micro-batch on the calling thread; leaves its mean gradient in res->grad. */
+void micro_batch_grads(const Network *net, TrainingResources *res, float *batch_loss, float *batch_acc)
+{
+    hidden_forward_rows(net, res->batch_rows, 0, BATCH_SIZE, res->hidden_layer);
+    output_loss_rows(net, res->hidden_layer, res->batch_labels, 0, BATCH_SIZE, res->output_error, res->sample_loss,
+                     res->sample_correct);
+    batch_metrics(res, batch_loss, batch_acc);
+    hidden_error_rows(net, res->hidden_layer, res->output_error, 0, BATCH_SIZE, res->hidden_error,
+                      res->hidden_error_bf16);
+    hidden_weight_grad_rows(res->batch_rows, res->hidden_error, res->hidden_error_bf16, 0, INPUT_SIZE, res->dw_hidden);
+    output_grads(res->hidden_layer, res->output_error, res->dw_output, res->db_output);
+    hidden_bias_grad(res->hidden_error, res->db_hidden);
+}
+
+/* Sums n gradient replicas into replicas[0] pairwise (0 += 1, 2 += 3, then 0 += 2, ...). Every level is split
+ * into REDUCE_CHUNK pieces shared by the whole team so each piece is read once while it is in cache. The
+ * summation order depends only on n. Must be called by every thread of the enclosing parallel region. */
+void tree_reduce_grads(float **replicas, int n)
+{
+    int chunks = (GRAD_SIZE + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+    for (int stride = 1; stride < n; stride *= 2)
+    {
+        int pairs = (n - stride + 2 * stride - 1) / (2 * stride);
+#pragma omp for schedule(static)
+        for (int p = 0; p < pairs * chunks; p++)
+        {
+            int i = (p / chunks) * 2 * stride;
+            int c0 = (p % chunks) * REDUCE_CHUNK;
+            int c1 = c0 + REDUCE_CHUNK < GRAD_SIZE ? c0 + REDUCE_CHUNK : GRAD_SIZE;
+            float *restrict dst = replicas[i];
+            const float *restrict src = replicas[i + stride];
+            for (int c = c0; c < c1; c++)
+            {
+                dst[c] += src[c];
+            }
+        }
+    }
+}
+
+/* LARS layer-wise rate multiplier eta * |w| / |g|, clipped to 1 so it only ever slows a layer down. */
+float lars_trust(const float *weights, const float *grad, int n, float eta)
+{
+    double w_norm = 0.0, g_norm = 0.0;
+#pragma omp parallel for reduction(+ : w_norm, g_norm)
+    for (int i = 0; i < n; i++)
+    {
+        w_norm += (double)weights[i] * weights[i];
+        g_norm += (double)grad[i] * grad[i];
+    }
+    if (w_norm == 0.0 || g_norm == 0.0)
+        return 1.0f;
+    float trust = eta * (float)(sqrt(w_norm) / sqrt(g_norm));
+    return trust < 1.0f ? trust : 1.0f;
+}
+
+void train_step_data_parallel(Network *net, BatchSource *src, DataParallel *dp, int step, float learning_rate,
+                              float lars_eta, float *batch_loss, float *batch_acc)
+{
+    int micro = dp->micro_batches;
+    float loss_sum = 0.0f, acc_sum = 0.0f;
+#pragma omp parallel num_threads(dp->threads) reduction(+ : loss_sum, acc_sum)
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        TrainingResources *res = &dp->res[tid];
+        float *accum = dp->accum[tid];
+        int first = 1;
+        for (int m = tid; m < micro; m += nthreads)
+        {
+            /* The shard stream has a single cursor, so streamed micro-batches are handed out in arrival order. */
+            if (src->stream)
+            {
+#pragma omp critical(batch_source)
+                load_batch(src, 0, res);
+            }
+            else
+            {
+                load_batch(src, step * micro + m, res);
+            }
+            float loss, acc;
+            micro_batch_grads(net, res, &loss, &acc);
+            loss_sum += loss;
+            acc_sum += acc;
+            if (first)
+                memcpy(accum, res->grad, GRAD_SIZE * sizeof(float));
+            else
+                for (int c = 0; c < GRAD_SIZE; c++)
+                    accum[c] += res->grad[c];
+            first = 0;
+        }
+        if (first)
+            memset(accum, 0, GRAD_SIZE * sizeof(float));
+#pragma omp barrier
+        tree_reduce_grads(dp->accum, nthreads);
+    }
+    *batch_loss = loss_sum / micro;
+    *batch_acc = acc_sum / micro;
+
+    /* accum[0] holds the sum of micro-batch means. The optimizers other than SGD are not linear in the gradient,
+     * so it is averaged in place rather than folded into the rate; LARS scales each weight matrix's rate. */
+    float *grad = dp->accum[0];
+    float *dw_hidden = grad;
+    float *dw_output = dw_hidden + INPUT_SIZE * HIDDEN_SIZE;
+    float *db_hidden = dw_output + HIDDEN_SIZE * OUTPUT_SIZE;
+    float *db_output = db_hidden + HIDDEN_SIZE;
+    float scale = 1.0f / micro;
+#pragma omp parallel for
+    for (int c = 0; c < GRAD_SIZE; c++)
+    {
+        grad[c] *= scale;
+    }
+    float hidden_rate = learning_rate;
+    float output_rate = learning_rate;
+    if (lars_eta > 0.0f)
+    {
+        hidden_rate *= lars_trust(net->hidden_weights, dw_hidden, INPUT_SIZE * HIDDEN_SIZE, lars_eta);
+        output_rate *= lars_trust(net->output_weights, dw_output, HIDDEN_SIZE * OUTPUT_SIZE, lars_eta);
+    }
+#pragma omp parallel
+    {
+#pragma omp for nowait
+        for (int t = 0; t < WEIGHT_TILES; t++)
+        {
+            int j0 = t * WEIGHT_TILE_ROWS;
+            int j1 = j0 + WEIGHT_TILE_ROWS < INPUT_SIZE ? j0 + WEIGHT_TILE_ROWS : INPUT_SIZE;
+            optimizer_step(&net->opt, &net->hidden_weights[j0 * HIDDEN_SIZE],
+                           &net->hidden_weights_momentum[OPT_STATE_OFFSET(j0 * HIDDEN_SIZE)],
+                           &dw_hidden[j0 * HIDDEN_SIZE], (j1 - j0) * HIDDEN_SIZE, hidden_rate);
+        }
+#pragma omp single nowait
+        {
+            optimizer_step(&net->opt, net->hidden_bias, net->hidden_bias_momentum, db_hidden, HIDDEN_SIZE,
+                           learning_rate);
+            optimizer_step(&net->opt, net->output_weights, net->output_weights_momentum, dw_output,
+                           HIDDEN_SIZE * OUTPUT_SIZE, output_rate);
+            optimizer_step(&net->opt, net->output_bias, net->output_bias_momentum, db_output, OUTPUT_SIZE,
+                           learning_rate);
+        }
+    }
+}
+
+/* Hogwild: every thread runs plain SGD over its own contiguous slice of the epoch's batches and applies its
+ * updates to the shared weights and momentum without locks. Concurrent updates to the same float can be lost;
+ * the method relies on that being rare enough to cost less than synchronizing. Returns loss and accuracy
+ * summed over the batches. */
+void hogwild_epoch(Network *net, BatchSource *src, DataParallel *workers, const LrSchedule *sched, int epoch,
+                   int num_batches, float *loss_sum, float *acc_sum)
+{
+    float loss_total = 0.0f, acc_total = 0.0f;
+#pragma omp parallel num_threads(workers->threads) reduction(+ : loss_total, acc_total)
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        TrainingResources *res = &workers->res[tid];
+        int b0 = (int)((long long)num_batches * tid / nthreads);
+        int b1 = (int)((long long)num_batches * (tid + 1) / nthreads);
+        for (int batch = b0; batch < b1; batch++)
+        {
+            if (src->stream)
+            {
+#pragma omp critical(batch_source)
+                load_batch(src, 0, res);
+            }
+            else
+            {
+                load_batch(src, batch, res);
+            }
+            float batch_loss, batch_acc;
+            micro_batch_grads(net, res, &batch_loss, &batch_acc);
+            /* Threads advance together, so the run's global step is estimated from this thread's progress. The
+             * one-cycle momentum is left fixed as the optimizer is shared. */
+            float learning_rate =
+                schedule_rate(sched, (long long)epoch * num_batches + (long long)(batch - b0) * nthreads + tid);
+#pragma omp atomic
+            net->opt.t++;
+            optimizer_step(&net->opt, net->hidden_weights, net->hidden_weights_momentum, res->dw_hidden,
+                           INPUT_SIZE * HIDDEN_SIZE, learning_rate);
+            optimizer_step(&net->opt, net->hidden_bias, net->hidden_bias_momentum, res->db_hidden, HIDDEN_SIZE,
+                           learning_rate);
+            optimizer_step(&net->opt, net->output_weights, net->output_weights_momentum, res->dw_output,
+                           HIDDEN_SIZE * OUTPUT_SIZE, learning_rate);
+            optimizer_step(&net->opt, net->output_bias, net->output_bias_momentum, res->db_output, OUTPUT_SIZE,
+                           learning_rate);
+            loss_total += batch_loss;
+            acc_total += batch_acc;
+            if (tid == 0 && (batch - b0) % PRINT_INTERVAL == 0)
+            {
+                printf("Batch %d/%d (thread 0 of %d), Loss: %.4f, Accuracy: %.2f%%\n", batch - b0, b1 - b0, nthreads,
+                       batch_loss, batch_acc * 100.0f);
+            }
+        }
+    }
+    *loss_sum = loss_total;
+    *acc_sum = acc_total;
+}
+
+/* Creates one listening loopback socket per rank on an ephemeral port before forking, so every rank can
+ * connect to its right-hand neighbour immediately and accept from its left. Returns in each child with comm
+ * set up; the parent waits for the children and exits with failure if any of them failed. */
+void launch_ranks(const TrainConfig *cfg, Comm *comm)
+{
+    int n = cfg->procs;
+    int *listeners = (int *)malloc(n * sizeof(int));
+    int *ports = (int *)malloc(n * sizeof(int));
+    pid_t *pids = (pid_t *)malloc(n * sizeof(pid_t));
+    if (!listeners || !ports || !pids)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int r = 0; r < n; r++)
+    {
+        struct sockaddr_in addr = {0};
+        socklen_t addr_len = sizeof(addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        listeners[r] = socket(AF_INET, SOCK_STREAM, 0);
+        if (listeners[r] < 0 || bind(listeners[r], (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listeners[r], 1) != 0 || getsockname(listeners[r], (struct sockaddr *)&addr, &addr_len) != 0)
+        {
+            perror("Failed to create rank listener");
+            exit(1);
+        }
+        ports[r] = ntohs(addr.sin_port);
+    }
+    fflush(stdout);
+    for (int r = 0; r < n; r++)
+    {
+        pids[r] = fork();
+        if (pids[r] < 0)
+        {
+            perror("fork");
+            exit(1);
+        }
+        if (pids[r] > 0)
+            continue;
+
+        comm->rank = r;
+        comm->size = n;
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(ports[(r + 1) % n]);
+        comm->send_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (comm->send_fd < 0 || connect(comm->send_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            perror("Failed to connect to next rank");
+            exit(1);
+        }
+        comm->recv_fd = accept(listeners[r], NULL, NULL);
+        if (comm->recv_fd < 0)
+        {
+            perror("Failed to accept previous rank");
+            exit(1);
+        }
+        int one = 1;
+        setsockopt(comm->send_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(comm->recv_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        for (int k = 0; k < n; k++)
+            close(listeners[k]);
+        free(listeners);
+        free(ports);
+        free(pids);
+        return;
+    }
+
+    for (int r = 0; r < n; r++)
+        close(listeners[r]);
+    int failed = 0;
+    for (int exited = 0; exited < n; exited++)
+    {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+            break;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            if (!failed)
+                fprintf(stderr, "A trainer process failed, stopping the others\n");
+            failed = 1;
+            for (int r = 0; r < n; r++)
+                if (pids[r] != pid)
+                    kill(pids[r], SIGTERM);
+        }
+    }
+    free(listeners);
+    free(ports);
+    free(pids);
+    exit(failed ? 1 : 0);
+}
+
+/* Sends to the next rank while receiving from the previous one, so that a full ring never deadlocks with every
+ * rank blocked in send on a full socket buffer. */
+static void ring_exchange(Comm *comm, const void *send_buf, size_t send_bytes, void *recv_buf, size_t recv_bytes)
+{
+    const char *out = (const char *)send_buf;
+    char *in = (char *)recv_buf;
+    while (send_bytes > 0 || recv_bytes > 0)
+    {
+        struct pollfd fds[2] = {{comm->send_fd, send_bytes > 0 ? POLLOUT : 0, 0},
+                                {comm->recv_fd, recv_bytes > 0 ? POLLIN : 0, 0}};
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(1);
+        }
+        if (send_bytes > 0 && fds[0].revents)
+        {
+            ssize_t k = send(comm->send_fd, out, send_bytes, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("Ring send failed");
+                exit(1);
+            }
+            if (k > 0)
+            {
+                out += k;
+                send_bytes -= (size_t)k;
+            }
+        }
+        if (recv_bytes > 0 && fds[1].revents)
+        {
+            ssize_t k = recv(comm->recv_fd, in, recv_bytes, MSG_DONTWAIT);
+            if (k == 0)
+            {
+                fprintf(stderr, "Rank %d: previous rank closed the connection\n", comm->rank);
+                exit(1);
+            }
+            if (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("Ring receive failed");
+                exit(1);
+            }
+            if (k > 0)
+            {
+                in += k;
+                recv_bytes -= (size_t)k;
+            }
+        }
+    }
+}
+
+/* Bandwidth-optimal ring all-reduce (sum): a reduce-scatter followed by an all-gather, each n - 1 steps in which
+ * every rank sends and receives one 1/n chunk, so each rank moves 2 (n - 1) / n of the buffer in total. */
+void ring_allreduce(Comm *comm, float *buf, int len)
+{
+    int n = comm->size;
+    int r = comm->rank;
+#define RING_CHUNK(c) ((int)((long long)len * (c) / n))
+    for (int s = 0; s < n - 1; s++)
+    {
+        int sc = (r - s + n) % n;
+        int rc = (r - s - 1 + n) % n;
+        int rlen = RING_CHUNK(rc + 1) - RING_CHUNK(rc);
+        ring_exchange(comm, &buf[RING_CHUNK(sc)], (RING_CHUNK(sc + 1) - RING_CHUNK(sc)) * sizeof(float), comm->scratch,
+                      rlen * sizeof(float));
+        float *dst = &buf[RING_CHUNK(rc)];
+        for (int i = 0; i < rlen; i++)
+            dst[i] += comm->scratch[i];
+    }
+    for (int s = 0; s < n - 1; s++)
+    {
+        int sc = (r + 1 - s + n) % n;
+        int rc = (r - s + n) % n;
+        ring_exchange(comm, &buf[RING_CHUNK(sc)], (RING_CHUNK(sc + 1) - RING_CHUNK(sc)) * sizeof(float),
+                      &buf[RING_CHUNK(rc)], (RING_CHUNK(rc + 1) - RING_CHUNK(rc)) * sizeof(float));
+    }
+#undef RING_CHUNK
+}
+
+static void comm_bucket(int bucket, int *start, int *len)
+{
+    if (bucket == 0)
+    {
+        *start = INPUT_SIZE * HIDDEN_SIZE;
+        *len = GRAD_SIZE - *start;
+        return;
+    }
+    int j0 = (bucket - 1) * COMM_BUCKET_ROWS;
+    int j1 = j0 + COMM_BUCKET_ROWS < INPUT_SIZE ? j0 + COMM_BUCKET_ROWS : INPUT_SIZE;
+    *start = j0 * HIDDEN_SIZE;
+    *len = (j1 - j0) * HIDDEN_SIZE;
+}
+
+static void *comm_main(void *arg)
+{
+    Comm *comm = (Comm *)arg;
+    pthread_mutex_lock(&comm->lock);
+    for (;;)
+    {
+        while (comm->done == comm->posted && !comm->stop)
+            pthread_cond_wait(&comm->cond, &comm->lock);
+        if (comm->done == comm->posted)
+            break;
+        int start, len;
+        comm_bucket(comm->done, &start, &len);
+        pthread_mutex_unlock(&comm->lock);
+        double t0 = now_seconds();
+        ring_allreduce(comm, &comm->grad[start], len);
+        float inv_size = 1.0f / comm->size;
+        for (int i = start; i < start + len; i++)
+        {
+            comm->grad[i] *= inv_size;
+        }
+        double busy = now_seconds() - t0;
+        pthread_mutex_lock(&comm->lock);
+        comm->busy_time += busy;
+        comm->done++;
+        pthread_cond_broadcast(&comm->cond);
+    }
+    pthread_mutex_unlock(&comm->lock);
+    return NULL;
+}
+
+void comm_start(Comm *comm, float *grad)
+{
+    comm->grad = grad;
+    comm->scratch = allocate_array(GRAD_SIZE / comm->size + 1);
+    comm->posted = comm->done = comm->stop = 0;
+    comm->busy_time = comm->wait_time = 0.0;
+    pthread_mutex_init(&comm->lock, NULL);
+    pthread_cond_init(&comm->cond, NULL);
+    if (pthread_create(&comm->thread, NULL, comm_main, comm) != 0)
+    {
+        fprintf(stderr, "Failed to start communication thread\n");
+        exit(1);
+    }
+}
+
+void comm_post(Comm *comm, int bucket)
+{
+    pthread_mutex_lock(&comm->lock);
+    comm->posted = bucket + 1;
+    pthread_cond_broadcast(&comm->cond);
+    pthread_mutex_unlock(&comm->lock);
+}
+
+void comm_wait(Comm *comm)
+{
+    double t0 = now_seconds();
+    pthread_mutex_lock(&comm->lock);
+    while (comm->done < COMM_BUCKETS + 1)
+        pthread_cond_wait(&comm->cond, &comm->lock);
+    comm->posted = comm->done = 0;
+    comm->wait_time += now_seconds() - t0;
+    pthread_mutex_unlock(&comm->lock);
+}
+
+void comm_stop(Comm *comm)
+{
+    pthread_mutex_lock(&comm->lock);
+    comm->stop = 1;
+    pthread_cond_broadcast(&comm->cond);
+    pthread_mutex_unlock(&comm->lock);
+    pthread_join(comm->thread, NULL);
+    pthread_mutex_destroy(&comm->lock);
+    pthread_cond_destroy(&comm->cond);
+    free(comm->scratch);
+    if (comm->size > 1)
+    {
+        close(comm->send_fd);
+        close(comm->recv_fd);
+    }
+}
+
+/* A fork-join step whose gradient is averaged across ranks bucket by bucket while the backward pass is still
+ * producing the later buckets. */
+void train_step_distributed(Network *net, TrainingResources *res, Comm *comm, float learning_rate, float *batch_loss,
+                            float *batch_acc)
+{
+    forward_pass(net, res->batch_rows, res->batch_labels, res->hidden_layer, res->output_error, res->sample_loss,
+                 res->sample_correct);
+    batch_metrics(res, batch_loss, batch_acc);
+#pragma omp parallel for
+    for (int t = 0; t < ROW_TILES; t++)
+    {
+        hidden_error_rows(net, res->hidden_layer, res->output_error, t * TASK_ROWS, (t + 1) * TASK_ROWS,
+                          res->hidden_error, res->hidden_error_bf16);
+    }
+    output_grads(res->hidden_layer, res->output_error, res->dw_output, res->db_output);
+    hidden_bias_grad(res->hidden_error, res->db_hidden);
+    comm_post(comm, 0);
+    for (int b = 1; b <= COMM_BUCKETS; b++)
+    {
+        int start, len;
+        comm_bucket(b, &start, &len);
+        int j0 = start / HIDDEN_SIZE;
+        int j1 = (start + len) / HIDDEN_SIZE;
+#pragma omp parallel for
+        for (int j = j0; j < j1; j++)
+        {
+            hidden_weight_grad_rows(res->batch_rows, res->hidden_error, res->hidden_error_bf16, j, j + 1,
+                                    res->dw_hidden);
+        }
+        comm_post(comm, b);
+    }
+    comm_wait(comm);
+    update_network(net, res->dw_hidden, res->dw_output, res->db_hidden, res->db_output, learning_rate);
+}
+
+static void write_float_array(FILE *f, const char *decl, const float *values, int n)
+{
+    fprintf(f, "static const float %s = {\n", decl);
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(f, "    %10.6ff%s", values[i], (i + 1 < n) ? "," : "");
+        if ((i + 1) % 8 == 0)
+            fprintf(f, "\n");
+    }
+    fprintf(f, "};\n\n");
+}
+
+static void write_int8_array(FILE *f, const char *decl, const int8_t *values, int n)
+{
+    fprintf(f, "static const signed char %s = {\n", decl);
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(f, "%s%4d%s", i % 16 == 0 ? "   " : "", values[i], (i + 1 < n) ? "," : "");
+        if ((i + 1) % 16 == 0)
+            fprintf(f, "\n");
+    }
+    fprintf(f, "};\n\n");
+}
+
+/* Scales are printed in full precision, since every weight of their unit is a multiple of one. */
+static void write_scales(FILE *f, const char *decl, const float *values, int n)
+{
+    fprintf(f, "static const float %s = {\n", decl);
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(f, "    %.9ef%s", values[i], (i + 1 < n) ? "," : "");
+        if ((i + 1) % 4 == 0)
+            fprintf(f, "\n");
+    }
+    fprintf(f, "};\n\n");
+}
+
+/* With QAT the float arrays hold the int8-rounded weights, and WEIGHTS_INT8 adds the int8 weights and per-unit
+ * scales the recognizer runs on. */
+void save_weights(Network *net)
+{
+    FILE *f = fopen("src/weights.h", "w");
+    if (!f)
+    {
+        fprintf(stderr, "Error opening weights.h for writing\n");
+        return;
+    }
+    const QuantAware *qat = net->qat;
+    fprintf(f, "#ifndef WEIGHTS_H\n#define WEIGHTS_H\n\n");
+    fprintf(f, "#define INPUT_SIZE %d\n", INPUT_SIZE);
+    fprintf(f, "#define HIDDEN_SIZE %d\n", HIDDEN_SIZE);
+    fprintf(f, "#define OUTPUT_SIZE %d\n\n", OUTPUT_SIZE);
+    write_float_array(f, "HIDDEN_WEIGHTS[INPUT_SIZE * HIDDEN_SIZE]", qat ? qat->hidden_weights : net->hidden_weights,
+                      INPUT_SIZE * HIDDEN_SIZE);
+    write_float_array(f, "HIDDEN_BIAS[HIDDEN_SIZE]", net->hidden_bias, HIDDEN_SIZE);
+    write_float_array(f, "OUTPUT_WEIGHTS[HIDDEN_SIZE * OUTPUT_SIZE]", qat ? qat->output_weights : net->output_weights,
+                      HIDDEN_SIZE * OUTPUT_SIZE);
+    write_float_array(f, "OUTPUT_BIAS[OUTPUT_SIZE]", net->output_bias, OUTPUT_SIZE);
+    if (qat)
+    {
+        fprintf(f, "#define WEIGHTS_INT8 1\n\n");
+        write_int8_array(f, "HIDDEN_WEIGHTS_Q[INPUT_SIZE * HIDDEN_SIZE]", qat->hidden_q, INPUT_SIZE * HIDDEN_SIZE);
+        write_scales(f, "HIDDEN_SCALES[HIDDEN_SIZE]", qat->hidden_scales, HIDDEN_SIZE);
+        write_int8_array(f, "OUTPUT_WEIGHTS_Q[HIDDEN_SIZE * OUTPUT_SIZE]", qat->output_q, HIDDEN_SIZE * OUTPUT_SIZE);
+        write_scales(f, "OUTPUT_SCALES[OUTPUT_SIZE]", qat->output_scales, OUTPUT_SIZE);
+    }
+    fprintf(f, "#endif /* WEIGHTS_H */\n");
+    fclose(f);
+    printf("Successfully saved %sweights to src/weights.h\n", qat ? "int8 " : "");
+}
+
+/* Points the parameter and state arrays of view into a SNAPSHOT_SIZE buffer in checkpoint order. */
+void network_view(Network *view, float *buf)
+{
+    view->hidden_weights = buf;
+    view->output_weights = view->hidden_weights + INPUT_SIZE * HIDDEN_SIZE;
+    view->hidden_bias = view->output_weights + HIDDEN_SIZE * OUTPUT_SIZE;
+    view->output_bias = view->hidden_bias + HIDDEN_SIZE;
+    view->hidden_weights_momentum = buf + GRAD_SIZE;
+    view->output_weights_momentum = view->hidden_weights_momentum + OPT_STATE_SIZE(INPUT_SIZE * HIDDEN_SIZE);
+    view->hidden_bias_momentum = view->output_weights_momentum + OPT_STATE_SIZE(HIDDEN_SIZE * OUTPUT_SIZE);
+    view->output_bias_momentum = view->hidden_bias_momentum + OPT_STATE_SIZE(HIDDEN_SIZE);
+    view->hidden_weights_bf16 = NULL;
+    view->lazy = NULL;
+    view->qat = NULL;
+    view->prune = NULL;
+}
+
+static float *network_param(const Network *net, int k, int *n)
+{
+    float *params[8] = {net->hidden_weights,          net->output_weights,          net->hidden_bias,
+                        net->output_bias,             net->hidden_weights_momentum, net->output_weights_momentum,
+                        net->hidden_bias_momentum,    net->output_bias_momentum};
+    int sizes[4] = {INPUT_SIZE * HIDDEN_SIZE, HIDDEN_SIZE * OUTPUT_SIZE, HIDDEN_SIZE, OUTPUT_SIZE};
+    *n = k < 4 ? sizes[k] : OPT_STATE_SIZE(sizes[k - 4]);
+    return params[k];
+}
+
+/* Loads the parameters, and the optimizer state if with_state is set (it is zeroed otherwise), of a checkpoint
+ * written by this build. */
+int checkpoint_load(const char *path, Network *net, CheckpointHeader *hdr, int with_state)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Cannot open checkpoint %s\n", path);
+        return -1;
+    }
+    if (fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != CHECKPOINT_MAGIC || hdr->version != CHECKPOINT_VERSION ||
+        hdr->input_size != INPUT_SIZE || hdr->hidden_size != HIDDEN_SIZE || hdr->output_size != OUTPUT_SIZE)
+    {
+        fprintf(stderr, "%s is not a %dx%dx%d checkpoint of this version\n", path, INPUT_SIZE, HIDDEN_SIZE,
+                OUTPUT_SIZE);
+        fclose(f);
+        return -1;
+    }
+    for (int k = 0; k < 8; k++)
+    {
+        int n;
+        float *dst = network_param(net, k, &n);
+        if (k >= 4 && !with_state)
+        {
+            memset(dst, 0, n * sizeof(float));
+            continue;
+        }
+        if (fread(dst, sizeof(float), n, f) != (size_t)n)
+        {
+            fprintf(stderr, "Checkpoint %s is truncated\n", path);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static void checkpoint_write(const char *path, const CheckpointHeader *hdr, const float *snapshot)
+{
+    char tmp_path[300];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "Cannot create checkpoint %s\n", tmp_path);
+        return;
+    }
+    int ok = fwrite(hdr, sizeof(*hdr), 1, f) == 1 &&
+             fwrite(snapshot, sizeof(float), SNAPSHOT_SIZE, f) == SNAPSHOT_SIZE &&
+             fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0)
+    {
+        fprintf(stderr, "Failed to write checkpoint %s\n", path);
+        remove(tmp_path);
+    }
+}
+
+static void *checkpointer_main(void *arg)
+{
+    Checkpointer *ck = (Checkpointer *)arg;
+    pthread_mutex_lock(&ck->lock);
+    for (;;)
+    {
+        while (!ck->queued && !ck->stop)
+            pthread_cond_wait(&ck->cond, &ck->lock);
+        if (!ck->queued)
+            break;
+        CheckpointSlot *slot = &ck->slots[ck->head];
+        pthread_mutex_unlock(&ck->lock);
+        checkpoint_write(slot->path, &slot->hdr, slot->snapshot);
+        pthread_mutex_lock(&ck->lock);
+        ck->head = (ck->head + 1) % CHECKPOINT_SLOTS;
+        ck->queued--;
+        pthread_cond_broadcast(&ck->cond);
+    }
+    pthread_mutex_unlock(&ck->lock);
+    return NULL;
+}
+
+void checkpointer_start(Checkpointer *ck)
+{
+    for (int i = 0; i < CHECKPOINT_SLOTS; i++)
+        ck->slots[i].snapshot = allocate_array(SNAPSHOT_SIZE);
+    ck->head = ck->queued = ck->stop = 0;
+    pthread_mutex_init(&ck->lock, NULL);
+    pthread_cond_init(&ck->cond, NULL);
+    if (pthread_create(&ck->thread, NULL, checkpointer_main, ck) != 0)
+    {
+        fprintf(stderr, "Failed to start checkpoint writer\n");
+        exit(1);
+    }
+}
+
+void network_copy(const Network *net, float *dst)
+{
+    for (int k = 0; k < 8; k++)
+    {
+        int n;
+        const float *src = network_param(net, k, &n);
+        memcpy(dst, src, n * sizeof(float));
+        dst += n;
+    }
+}
+
+/* Waits only if every slot is still queued, then copies the network and returns. */
+void checkpoint_save(Checkpointer *ck, const Network *net, const CheckpointHeader *hdr, const char *path)
+{
+    pthread_mutex_lock(&ck->lock);
+    while (ck->queued == CHECKPOINT_SLOTS)
+        pthread_cond_wait(&ck->cond, &ck->lock);
+    CheckpointSlot *slot = &ck->slots[(ck->head + ck->queued) % CHECKPOINT_SLOTS];
+    pthread_mutex_unlock(&ck->lock);
+    network_copy(net, slot->snapshot);
+    slot->hdr = *hdr;
+    slot->hdr.magic = CHECKPOINT_MAGIC;
+    slot->hdr.version = CHECKPOINT_VERSION;
+    slot->hdr.input_size = INPUT_SIZE;
+    slot->hdr.hidden_size = HIDDEN_SIZE;
+    slot->hdr.output_size = OUTPUT_SIZE;
+    snprintf(slot->path, sizeof(slot->path), "%s", path);
+    pthread_mutex_lock(&ck->lock);
+    ck->queued++;
+    pthread_cond_broadcast(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+void checkpointer_stop(Checkpointer *ck)
+{
+    pthread_mutex_lock(&ck->lock);
+    ck->stop = 1;
+    pthread_cond_broadcast(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+    pthread_join(ck->thread, NULL);
+    pthread_mutex_destroy(&ck->lock);
+    pthread_cond_destroy(&ck->cond);
+    for (int i = 0; i < CHECKPOINT_SLOTS; i++)
+        free(ck->slots[i].snapshot);
+}
+
+/* Batched inference over a whole dataset with the training forward kernels; the last partial batch is padded
+ * by repeating its first row. */
+void evaluate(const Network *net, const Dataset *data, float *loss, float *accuracy)
+{
+    int num_batches = (data->count + BATCH_SIZE - 1) / BATCH_SIZE;
+    double loss_sum = 0.0;
+    int correct = 0;
+#pragma omp parallel reduction(+ : loss_sum, correct)
+    {
+        const unsigned char *rows[BATCH_SIZE];
+        float *hidden = allocate_array(BATCH_SIZE * HIDDEN_SIZE);
+        float *output = allocate_array(BATCH_SIZE * OUTPUT_SIZE);
+#pragma omp for schedule(dynamic, 4)
+        for (int b = 0; b < num_batches; b++)
+        {
+            int first = b * BATCH_SIZE;
+            int n = data->count - first < BATCH_SIZE ? data->count - first : BATCH_SIZE;
+            for (int i = 0; i < BATCH_SIZE; i++)
+                rows[i] = &data->images[(size_t)(first + (i < n ? i : 0)) * INPUT_SIZE];
+            hidden_forward_rows(net, rows, 0, (n + GEMM_ROWS - 1) / GEMM_ROWS * GEMM_ROWS, hidden);
+            output_forward_rows(net, hidden, 0, n, output);
+            for (int i = 0; i < n; i++)
+            {
+                const float *prob = &output[i * OUTPUT_SIZE];
+                int predicted = 0;
+                for (int j = 1; j < OUTPUT_SIZE; j++)
+                {
+                    if (prob[j] > prob[predicted])
+                        predicted = j;
+                }
+                int label = data->labels[first + i];
+                loss_sum -= logf(prob[label] + EPS);
+                correct += predicted == label;
+            }
+        }
+        free(hidden);
+        free(output);
+    }
+    *loss = (float)(loss_sum / data->count);
+    *accuracy = (float)correct / data->count;
+}
+
+static void *validator_main(void *arg)
+{
+    Validator *val = (Validator *)arg;
+    omp_set_num_threads(val->threads);
+    Network view;
+    network_view(&view, val->snapshot);
+    if (val->quantized)
+        enable_qat(&view);
+    pthread_mutex_lock(&val->lock);
+    for (;;)
+    {
+        while (!(val->pending && !val->done) && !val->stop)
+            pthread_cond_wait(&val->cond, &val->lock);
+        if (!(val->pending && !val->done))
+            break;
+        pthread_mutex_unlock(&val->lock);
+        float loss, accuracy;
+        network_fake_quantize(&view);
+        evaluate(&view, val->data, &loss, &accuracy);
+        pthread_mutex_lock(&val->lock);
+        val->loss = loss;
+        val->accuracy = accuracy;
+        val->done = 1;
+        pthread_cond_broadcast(&val->cond);
+    }
+    pthread_mutex_unlock(&val->lock);
+    free_qat(&view);
+    return NULL;
+}
+
+void validator_start(Validator *val, const Dataset *data, int threads, int quantized)
+{
+    val->data = data;
+    val->threads = threads;
+    val->quantized = quantized;
+    val->snapshot = allocate_array(SNAPSHOT_SIZE);
+    val->pending = val->done = val->stop = 0;
+    pthread_mutex_init(&val->lock, NULL);
+    pthread_cond_init(&val->cond, NULL);
+    if (pthread_create(&val->thread, NULL, validator_main, val) != 0)
+    {
+        fprintf(stderr, "Failed to start validation thread\n");
+        exit(1);
+    }
+}
+
+/* Copies the network for validation; the previous result must have been collected. */
+void validator_submit(Validator *val, const Network *net, const CheckpointHeader *hdr)
+{
+    pthread_mutex_lock(&val->lock);
+    network_copy(net, val->snapshot);
+    val->hdr = *hdr;
+    val->submit_time = now_seconds();
+    val->pending = 1;
+    val->done = 0;
+    pthread_cond_broadcast(&val->cond);
+    pthread_mutex_unlock(&val->lock);
+}
+
+/* Waits for the submitted snapshot's result; returns 0 if nothing was submitted. */
+int validator_collect(Validator *val, float *loss, float *accuracy, CheckpointHeader *hdr)
+{
+    pthread_mutex_lock(&val->lock);
+    if (!val->pending)
+    {
+        pthread_mutex_unlock(&val->lock);
+        return 0;
+    }
+    while (!val->done)
+        pthread_cond_wait(&val->cond, &val->lock);
+    *loss = val->loss;
+    *accuracy = val->accuracy;
+    *hdr = val->hdr;
+    val->pending = 0;
+    pthread_mutex_unlock(&val->lock);
+    return 1;
+}
+
+void validator_stop(Validator *val)
+{
+    pthread_mutex_lock(&val->lock);
+    val->stop = 1;
+    pthread_cond_broadcast(&val->cond);
+    pthread_mutex_unlock(&val->lock);
+    pthread_join(val->thread, NULL);
+    pthread_mutex_destroy(&val->lock);
+    pthread_cond_destroy(&val->cond);
+    free(val->snapshot);
+}
+
+void model_trainer_init(ModelTrainer *mt, const char *spec, const Optimizer *opt, uint64_t seed)
+{
+    memset(mt, 0, sizeof(*mt));
+    if (model_parse(spec, &mt->model) != 0 || model_alloc(&mt->model) != 0)
+    {
+        fprintf(stderr, "Failed to build model %s\n", spec);
+        exit(1);
+    }
+    mt->opt = *opt;
+    mt->acts[0] = allocate_array(BATCH_SIZE * INPUT_SIZE);
+    for (int l = 0; l < mt->model.num_layers; l++)
+    {
+        ModelLayer *layer = &mt->model.layers[l];
+        mt->acts[l + 1] = allocate_array((size_t)BATCH_SIZE * layer->outputs);
+        mt->errors[l] = allocate_array((size_t)BATCH_SIZE * layer->outputs);
+        if (layer->type == LAYER_CONV)
+            mt->cols[l] = allocate_array((size_t)BATCH_SIZE * layer->out_h * layer->out_w * layer->fan_in);
+        if (layer->type == LAYER_POOL)
+            continue;
+        int n = layer->fan_in * layer->out_c;
+        int relu_like = layer->activation != ACT_TANH && layer->activation != ACT_SIGMOID;
+        fill_random_normal(layer->weights, n, sqrtf((relu_like ? 2.0f : 1.0f) / layer->fan_in), seed,
+                           RNG_STREAM_INIT, l);
+        mt->grad[l] = allocate_array(n + layer->out_c);
+        mt->state[l] = allocate_array(OPT_STATE_SIZE(n) + OPT_STATE_SIZE(layer->out_c));
+        memset(mt->state[l], 0, (OPT_STATE_SIZE(n) + OPT_STATE_SIZE(layer->out_c)) * sizeof(float));
+    }
+}
+
+void model_trainer_free(ModelTrainer *mt)
+{
+    free(mt->acts[0]);
+    for (int l = 0; l < mt->model.num_layers; l++)
+    {
+        free(mt->acts[l + 1]);
+        free(mt->errors[l]);
+        free(mt->cols[l]);
+        free(mt->grad[l]);
+        free(mt->state[l]);
+    }
+    free(mt->teacher_logits);
+    free(mt->batch_teacher);
+    free(mt->latent);
+    model_free(&mt->model);
+}
+
+/* Runs the teacher model over the training set once and keeps its logits, so that distillation costs the
+ * student's training only a gather per batch. The samples go through in BATCH_SIZE chunks across threads;
+ * taking the last layer's softmax off a copy of the teacher leaves model_forward returning the logits. */
+void model_trainer_distill(ModelTrainer *mt, const char *teacher_path, const Dataset *data, float temperature)
+{
+    Model teacher;
+    if (model_load(teacher_path, &teacher) != 0)
+    {
+        fprintf(stderr, "Failed to load teacher model %s\n", teacher_path);
+        exit(1);
+    }
+    if (teacher.input_size != INPUT_SIZE)
+    {
+        fprintf(stderr, "Teacher model %s takes %d inputs, expected %d\n", teacher_path, teacher.input_size,
+                INPUT_SIZE);
+        exit(1);
+    }
+    double start = now_seconds();
+    Model logits_model = teacher;
+    logits_model.layers[logits_model.num_layers - 1].activation = ACT_LINEAR;
+    mt->teacher_logits = allocate_array((size_t)data->count * OUTPUT_SIZE);
+    mt->batch_teacher = allocate_array(BATCH_SIZE * OUTPUT_SIZE);
+    mt->temperature = temperature;
+    int correct = 0;
+#pragma omp parallel reduction(+ : correct)
+    {
+        float *input = allocate_array(INPUT_SIZE);
+        float *scratch = allocate_array(model_scratch_size(&logits_model));
+#pragma omp for schedule(dynamic, BATCH_SIZE)
+        for (int s = 0; s < data->count; s++)
+        {
+            float *z = &mt->teacher_logits[(size_t)s * OUTPUT_SIZE];
+            for (int j = 0; j < INPUT_SIZE; j++)
+                input[j] = data->images[(size_t)s * INPUT_SIZE + j] * PIXEL_SCALE;
+            model_forward(&logits_model, input, z, scratch);
+            int predicted = 0;
+            for (int j = 1; j < OUTPUT_SIZE; j++)
+            {
+                if (z[j] > z[predicted])
+                    predicted = j;
+            }
+            correct += predicted == data->labels[s];
+        }
+        free(input);
+        free(scratch);
+    }
+    char desc[256];
+    model_describe(&teacher, desc, sizeof(desc));
+    printf("Distilling from %s (%s): %.2f%% on the training set, logits cached in %.1f ms, temperature %g\n",
+           teacher_path, desc, 100.0f * correct / data->count, (now_seconds() - start) * 1000.0, temperature);
+    model_free(&teacher);
+}
+
+/* --init-from with --model: starts from a model file's weights, which must have the layer list being trained. */
+void model_trainer_load(ModelTrainer *mt, const char *path)
+{
+    Model init;
+    if (model_load(path, &init) != 0)
+    {
+        fprintf(stderr, "Failed to load model %s\n", path);
+        exit(1);
+    }
+    int same = init.input_size == mt->model.input_size && init.num_layers == mt->model.num_layers;
+    for (int l = 0; same && l < init.num_layers; l++)
+    {
+        const ModelLayer *a = &init.layers[l], *b = &mt->model.layers[l];
+        same = a->type == b->type && a->outputs == b->outputs && a->fan_in == b->fan_in && a->kernel == b->kernel &&
+               a->activation == b->activation;
+    }
+    if (!same)
+    {
+        char have[256], want[256];
+        model_describe(&init, have, sizeof(have));
+        model_describe(&mt->model, want, sizeof(want));
+        fprintf(stderr, "%s is %s, not %s\n", path, have, want);
+        exit(1);
+    }
+    for (int l = 0; l < init.num_layers; l++)
+    {
+        const ModelLayer *layer = &init.layers[l];
+        if (layer->type == LAYER_POOL)
+            continue;
+        memcpy(mt->model.layers[l].weights, layer->weights, (size_t)layer->fan_in * layer->out_c * sizeof(float));
+        memcpy(mt->model.layers[l].bias, layer->bias, layer->out_c * sizeof(float));
+    }
+    model_free(&init);
+    printf("Initialized weights from %s\n", path);
+}
+
+/* --binary: trains the first layer with binary weights and inputs, as model_binarize and gemm_binary run it. The
+ * forward pass uses the binarized weights; their gradient passes straight through the sign to latent real-valued
+ * weights, except where those are beyond +-1, and the weights are rebinarized after every step. */
+void model_trainer_binarize(ModelTrainer *mt)
+{
+    ModelLayer *layer = &mt->model.layers[0];
+    size_t n = (size_t)layer->fan_in * layer->out_c;
+    if (layer->type != LAYER_DENSE)
+    {
+        fprintf(stderr, "--binary needs a model starting with a dense layer\n");
+        exit(1);
+    }
+    mt->latent = allocate_array(n);
+    memcpy(mt->latent, layer->weights, n * sizeof(float));
+    if (model_binarize(layer) != 0)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+}
+
+/* Blends the soft-target gradient into the output error from model_loss_rows: with student and teacher
+ * distributions q_s and q_t at temperature T, the loss T^2 * KL(q_t || q_s) has gradient T * (q_s - q_t) at the
+ * logits, weighted by DISTILL_ALPHA against the label cross-entropy. The reported loss stays the label one. */
+static void distill_rows(const float *logits, const float *teacher_logits, float temperature, float *output_error)
+{
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        const float *z = &logits[i * OUTPUT_SIZE];
+        const float *t = &teacher_logits[i * OUTPUT_SIZE];
+        float qs[OUTPUT_SIZE], qt[OUTPUT_SIZE];
+        float zmax = z[0], tmax = t[0], zsum = 0.0f, tsum = 0.0f;
+        for (int j = 1; j < OUTPUT_SIZE; j++)
+        {
+            zmax = z[j] > zmax ? z[j] : zmax;
+            tmax = t[j] > tmax ? t[j] : tmax;
+        }
+        for (int j = 0; j < OUTPUT_SIZE; j++)
+        {
+            qs[j] = expf((z[j] - zmax) / temperature);
+            qt[j] = expf((t[j] - tmax) / temperature);
+            zsum += qs[j];
+            tsum += qt[j];
+        }
+        float *err = &output_error[i * OUTPUT_SIZE];
+        for (int j = 0; j < OUTPUT_SIZE; j++)
+            err[j] = (1.0f - DISTILL_ALPHA) * err[j] + DISTILL_ALPHA * temperature * (qs[j] / zsum - qt[j] / tsum);
+    }
+}
+
+/* One layer over the batch, samples in parallel. A convolution unrolls each sample into cols and runs the same
+ * GEMM as a dense layer over its output positions. The softmax of the last layer is left to model_loss_rows. */
+void model_layer_forward(const ModelLayer *layer, const float *input, float *cols, float *output)
+{
+    size_t positions = (size_t)layer->out_h * layer->out_w;
+#pragma omp parallel for
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        const float *x = &input[(size_t)i * layer->inputs];
+        float *y = &output[(size_t)i * layer->outputs];
+        if (layer->type == LAYER_CONV)
+        {
+            float *c = &cols[i * positions * layer->fan_in];
+            model_im2col(layer, x, c);
+            model_gemm_rows(c, (int)positions, layer->fan_in, layer->weights, layer->bias, layer->out_c, y);
+        }
+        else if (layer->type == LAYER_POOL)
+        {
+            model_pool(layer, x, y);
+        }
+        else
+        {
+            model_gemm_rows(x, 1, layer->fan_in, layer->weights, layer->bias, layer->out_c, y);
+        }
+        if (layer->activation != ACT_SOFTMAX)
+            model_activate(layer->activation, y, layer->outputs);
+    }
+}
+
+/* Softmax, cross-entropy and the output error for the batch's logits, as in output_loss_rows. */
+void model_loss_rows(const float *logits, const unsigned char *labels, float *output_error, float *sample_loss,
+                     unsigned char *sample_correct)
+{
+    for (int i = 0; i < BATCH_SIZE; i++)
+        loss_row(&logits[i * OUTPUT_SIZE], labels[i], &output_error[i * OUTPUT_SIZE], &sample_loss[i],
+                 &sample_correct[i]);
+}
+
+/* Routes each pooling window's error to the input that won the max (the first one on ties). */
+static void pool_backward(const ModelLayer *layer, const float *input, const float *error, float *input_error)
+{
+    int k = layer->kernel, c = layer->in_c;
+    memset(input_error, 0, layer->inputs * sizeof(float));
+    for (int oy = 0; oy < layer->out_h; oy++)
+    {
+        for (int ox = 0; ox < layer->out_w; ox++)
+        {
+            for (int ch = 0; ch < c; ch++)
+            {
+                int best = (oy * k * layer->in_w + ox * k) * c + ch;
+                for (int ky = 0; ky < k; ky++)
+                {
+                    for (int kx = 0; kx < k; kx++)
+                    {
+                        int idx = ((oy * k + ky) * layer->in_w + ox * k + kx) * c + ch;
+                        if (input[idx] > input[best])
+                            best = idx;
+                    }
+                }
+                input_error[best] += error[(oy * layer->out_w + ox) * c + ch];
+            }
+        }
+    }
+}
+
+/* Scatter-adds im2col rows back onto the input positions they were copied from. */
+static void col2im(const ModelLayer *layer, const float *cols, float *input_error)
+{
+    int k = layer->kernel, c = layer->in_c;
+    memset(input_error, 0, layer->inputs * sizeof(float));
+    for (int oy = 0; oy < layer->out_h; oy++)
+    {
+        for (int ox = 0; ox < layer->out_w; ox++)
+        {
+            const float *row = &cols[(size_t)(oy * layer->out_w + ox) * layer->fan_in];
+            for (int ky = 0; ky < k; ky++)
+            {
+                float *dst = &input_error[((oy + ky) * layer->in_w + ox) * c];
+                for (int q = 0; q < k * c; q++)
+                    dst[q] += row[ky * k * c + q];
+            }
+        }
+    }
+}
+
+/* Gradients of one layer from its error: the batch-averaged weight and bias gradients into grad and, unless
+ * input_error is NULL (the first layer), the error at the previous layer's pre-activation. A convolution's
+ * weight gradient is the dense one over the im2col rows of every position, summed in MODEL_GRAD_CHUNKS fixed
+ * row ranges so the result does not depend on the thread count; cols is then overwritten with the rows' error
+ * and folded back with col2im. */
+void model_layer_backward(const ModelLayer *layer, const float *input, float *cols, const float *error,
+                          float *grad, float *input_error, int input_activation)
+{
+    int fan_in = layer->fan_in, out_c = layer->out_c;
+    int positions = layer->out_h * layer->out_w;
+    size_t n = (size_t)fan_in * out_c;
+    if (layer->type == LAYER_CONV)
+    {
+        size_t rows = (size_t)BATCH_SIZE * positions;
+        float *partial = allocate_array(MODEL_GRAD_CHUNKS * (n + out_c));
+#pragma omp parallel for
+        for (int c = 0; c < MODEL_GRAD_CHUNKS; c++)
+        {
+            float *restrict dw = &partial[c * (n + out_c)];
+            memset(dw, 0, (n + out_c) * sizeof(float));
+            for (size_t r = rows * c / MODEL_GRAD_CHUNKS; r < rows * (c + 1) / MODEL_GRAD_CHUNKS; r++)
+            {
+                const float *x = &cols[r * fan_in];
+                const float *err = &error[r * out_c];
+                for (int k = 0; k < fan_in; k++)
+                {
+                    for (int j = 0; j < out_c; j++)
+                        dw[k * out_c + j] += x[k] * err[j];
+                }
+                for (int j = 0; j < out_c; j++)
+                    dw[n + j] += err[j];
+            }
+        }
+        for (size_t q = 0; q < n + out_c; q++)
+        {
+            float sum = 0.0f;
+            for (int c = 0; c < MODEL_GRAD_CHUNKS; c++)
+                sum += partial[c * (n + out_c) + q];
+            grad[q] = sum / BATCH_SIZE;
+        }
+        free(partial);
+    }
+    else if (layer->type == LAYER_DENSE)
+    {
+#pragma omp parallel for
+        for (int k = 0; k < fan_in; k++)
+        {
+            float *restrict dw = &grad[(size_t)k * out_c];
+            memset(dw, 0, out_c * sizeof(float));
+            for (int i = 0; i < BATCH_SIZE; i++)
+            {
+                float x = input[i * fan_in + k];
+                if (x == 0.0f)
+                    continue;
+                const float *restrict err = &error[i * out_c];
+                for (int j = 0; j < out_c; j++)
+                    dw[j] += x * err[j];
+            }
+            for (int j = 0; j < out_c; j++)
+                dw[j] /= BATCH_SIZE;
+        }
+        for (int j = 0; j < out_c; j++)
+        {
+            float sum = 0.0f;
+            for (int i = 0; i < BATCH_SIZE; i++)
+                sum += error[i * out_c + j];
+            grad[n + j] = sum / BATCH_SIZE;
+        }
+    }
+    if (!input_error)
+        return;
+    /* The weights transposed to [out_c][fan_in], so the error of each input row is a sum of contiguous rows. */
+    float *wt = NULL;
+    if (layer->type != LAYER_POOL)
+    {
+        wt = allocate_array(n);
+        for (int k = 0; k < fan_in; k++)
+        {
+            for (int j = 0; j < out_c; j++)
+                wt[(size_t)j * fan_in + k] = layer->weights[(size_t)k * out_c + j];
+        }
+    }
+#pragma omp parallel for
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        const float *in = &input[(size_t)i * layer->inputs];
+        float *dx = &input_error[(size_t)i * layer->inputs];
+        if (layer->type == LAYER_POOL)
+        {
+            pool_backward(layer, in, &error[(size_t)i * layer->outputs], dx);
+        }
+        else
+        {
+            float *dst = layer->type == LAYER_CONV ? &cols[(size_t)i * positions * fan_in] : dx;
+            for (int p = 0; p < positions; p++)
+            {
+                const float *err = &error[((size_t)i * positions + p) * out_c];
+                float *restrict d = &dst[(size_t)p * fan_in];
+                memset(d, 0, fan_in * sizeof(float));
+                for (int j = 0; j < out_c; j++)
+                {
+                    if (err[j] == 0.0f)
+                        continue;
+                    const float *restrict w = &wt[(size_t)j * fan_in];
+                    for (int k = 0; k < fan_in; k++)
+                        d[k] += err[j] * w[k];
+                }
+            }
+            if (layer->type == LAYER_CONV)
+                col2im(layer, dst, dx);
+        }
+        model_activation_backward(input_activation, in, dx, layer->inputs);
+    }
+    free(wt);
+}
+
+void model_train_step(ModelTrainer *mt, TrainingResources *res, float learning_rate, float *batch_loss,
+                      float *batch_acc)
+{
+    Model *model = &mt->model;
+    int last = model->num_layers - 1;
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        float *x = &mt->acts[0][i * INPUT_SIZE];
+        int max_val = 0;
+        for (int j = 0; j < INPUT_SIZE; j++)
+        {
+            x[j] = res->batch_rows[i][j] * PIXEL_SCALE;
+            max_val = res->batch_rows[i][j] > max_val ? res->batch_rows[i][j] : max_val;
+        }
+        /* gemm_binary's input bits: on where the pixel is at least half the brightest one. */
+        for (int j = 0; mt->latent && j < INPUT_SIZE; j++)
+            x[j] = max_val > 0 && 2 * res->batch_rows[i][j] >= max_val ? 1.0f : 0.0f;
+    }
+    for (int l = 0; l <= last; l++)
+        model_layer_forward(&model->layers[l], mt->acts[l], mt->cols[l], mt->acts[l + 1]);
+    model_loss_rows(mt->acts[last + 1], res->batch_labels, mt->errors[last], res->sample_loss, res->sample_correct);
+    if (mt->teacher_logits)
+        distill_rows(mt->acts[last + 1], mt->batch_teacher, mt->temperature, mt->errors[last]);
+    batch_metrics(res, batch_loss, batch_acc);
+    for (int l = last; l >= 0; l--)
+    {
+        float *input_error = l > 0 ? mt->errors[l - 1] : NULL;
+        int input_activation = l > 0 ? model->layers[l - 1].activation : ACT_LINEAR;
+        model_layer_backward(&model->layers[l], mt->acts[l], mt->cols[l], mt->errors[l], mt->grad[l], input_error,
+                             input_activation);
+    }
+    for (int l = 0; l <= last; l++)
+    {
+        ModelLayer *layer = &model->layers[l];
+        int n = layer->fan_in * layer->out_c;
+        if (layer->type == LAYER_POOL)
+            continue;
+        if (l == 0 && mt->latent)
+        {
+            for (int k = 0; k < n; k++)
+                mt->grad[0][k] = fabsf(mt->latent[k]) <= 1.0f ? mt->grad[0][k] : 0.0f;
+            optimizer_step(&mt->opt, mt->latent, mt->state[0], mt->grad[0], n, learning_rate);
+            memcpy(layer->weights, mt->latent, n * sizeof(float));
+            model_binarize(layer);
+        }
+        else
+        {
+            optimizer_step(&mt->opt, layer->weights, mt->state[l], mt->grad[l], n, learning_rate);
+        }
+        optimizer_step(&mt->opt, layer->bias, mt->state[l] + OPT_STATE_SIZE(n), mt->grad[l] + n, layer->out_c,
+                       learning_rate);
+    }
+}
+
+void model_evaluate(const Model *model, const Dataset *data, float *loss, float *accuracy)
+{
+    double loss_sum = 0.0;
+    int correct = 0;
+#pragma omp parallel reduction(+ : loss_sum, correct)
+    {
+        float *input = allocate_array(INPUT_SIZE);
+        float *scratch = allocate_array(model_scratch_size(model));
+        float prob[OUTPUT_SIZE];
+#pragma omp for schedule(dynamic, 64)
+        for (int s = 0; s < data->count; s++)
+        {
+            for (int j = 0; j < INPUT_SIZE; j++)
+                input[j] = data->images[(size_t)s * INPUT_SIZE + j] * PIXEL_SCALE;
+            model_forward(model, input, prob, scratch);
+            int predicted = 0;
+            for (int j = 1; j < OUTPUT_SIZE; j++)
+            {
+                if (prob[j] > prob[predicted])
+                    predicted = j;
+            }
+            loss_sum -= logf(prob[data->labels[s]] + EPS);
+            correct += predicted == data->labels[s];
+        }
+        free(input);
+        free(scratch);
+    }
+    *loss = (float)(loss_sum / data->count);
+    *accuracy = (float)correct / data->count;
+}
+
+/* The --model training loop: the same schedules and early stopping as train_network, with validation run
+ * synchronously at the end of each epoch and the best model written to cfg->model_out. */
+void train_model(ModelTrainer *mt, BatchSource *src, TrainingResources *res, const Dataset *val_data,
+                 const TrainConfig *cfg)
+{
+    int num_batches = (int)(src->count / BATCH_SIZE);
+    LrSchedule sched;
+    schedule_init(&sched, cfg, num_batches);
+    const char *metric = val_data ? "validation" : "training";
+    char desc[256];
+    model_describe(&mt->model, desc, sizeof(desc));
+    printf("Model %s: %zu parameters, %zu multiply-adds per sample\n", desc, model_param_count(&mt->model),
+           model_macs(&mt->model));
+    printf("Starting training...\n");
+    double start = now_seconds();
+    long long step = 0;
+    float best_accuracy = 0.0f;
+    int no_improve = 0, reached_target = 0;
+    for (int epoch = 0; epoch < cfg->epochs; epoch++)
+    {
+        float epoch_loss = 0.0f;
+        float epoch_acc = 0.0f;
+        batch_source_begin_epoch(src, cfg->seed, epoch);
+        for (int batch = 0; batch < num_batches; batch++)
+        {
+            float learning_rate = schedule_rate(&sched, step);
+            mt->opt.momentum = schedule_momentum(&sched, step++);
+            mt->opt.t = step;
+            float batch_loss, batch_acc;
+            load_batch(src, batch, res);
+            for (int i = 0; mt->teacher_logits && i < BATCH_SIZE; i++)
+                memcpy(&mt->batch_teacher[i * OUTPUT_SIZE],
+                       &mt->teacher_logits[(size_t)src->order[batch * BATCH_SIZE + i] * OUTPUT_SIZE],
+                       OUTPUT_SIZE * sizeof(float));
+            model_train_step(mt, res, learning_rate, &batch_loss, &batch_acc);
+            epoch_loss += batch_loss;
+            epoch_acc += batch_acc;
+            if (batch % PRINT_INTERVAL == 0)
+                printf("Batch %d/%d, Loss: %.4f, Accuracy: %.2f%%\n", batch, num_batches, batch_loss,
+                       batch_acc * 100.0f);
+        }
+        batch_source_end_epoch(src);
+        epoch_loss /= num_batches;
+        epoch_acc /= num_batches;
+        printf("Epoch %d/%d, Loss: %.4f, Accuracy: %.2f%%\n", epoch + 1, cfg->epochs, epoch_loss, epoch_acc * 100.0f);
+        float accuracy = epoch_acc;
+        if (val_data)
+        {
+            float loss;
+            double val_start = now_seconds();
+            model_evaluate(&mt->model, val_data, &loss, &accuracy);
+            double per_sample = (now_seconds() - val_start) * 1e6 * omp_get_max_threads() / val_data->count;
+            printf("Validation after epoch %d (%d samples), Loss: %.4f, Accuracy: %.2f%%, %.1f us/sample/thread\n",
+                   epoch + 1, val_data->count, loss, accuracy * 100.0f, per_sample);
+        }
+        check_target(cfg, metric, accuracy, epoch + 1, now_seconds() - start, &reached_target);
+        if (accuracy > best_accuracy)
+        {
+            best_accuracy = accuracy;
+            no_improve = 0;
+            printf("Saving best model to %s\n", cfg->model_out);
+            if (model_save(cfg->model_out, &mt->model) != 0)
+                fprintf(stderr, "Failed to write %s\n", cfg->model_out);
+        }
+        else if (++no_improve >= PATIENCE)
+        {
+            printf("Early stopping triggered. Best %s accuracy: %.2f%%\n", metric, best_accuracy * 100.0f);
+            break;
+        }
+    }
+    printf("Training completed. Best %s accuracy: %.2f%%\n", metric, best_accuracy * 100.0f);
+}
+
+void parse_args(int argc, char **argv, TrainConfig *cfg)
+{
+    cfg->seed = RAND_SEED;
+    cfg->epochs = NUM_EPOCHS;
+    cfg->aug_cache = 1;
+    cfg->shards = NULL;
+    cfg->shuffle_buffer = SHUFFLE_BUFFER;
+    cfg->make_shards[0] = NULL;
+    cfg->shard_size = SHARD_SIZE;
+    cfg->input_bits = 8;
+    cfg->bench_gather = 0;
+    cfg->executor = EXECUTOR_TASKS;
+    cfg->bench_steps = 0;
+    cfg->batch = BATCH_SIZE;
+    cfg->lr_scaling = LR_SCALING_LINEAR;
+    cfg->warmup_steps = -1;
+    cfg->lars_eta = 0.0f;
+    cfg->hogwild = 0;
+    cfg->target_acc = 0.0f;
+    cfg->procs = 0;
+    cfg->checkpoint = CHECKPOINT_PATH;
+    cfg->resume = NULL;
+    cfg->init_from = NULL;
+    cfg->export_header = 0;
+    cfg->export_from = NULL;
+    cfg->factorize_from = NULL;
+    cfg->factorize_rank = 0;
+    cfg->compact_from = NULL;
+    cfg->val = VAL_AUTO;
+    cfg->val_threads = 0;
+    cfg->optimizer = OPT_SGD;
+    cfg->lr = 0.0f;
+    cfg->weight_decay = ADAMW_WEIGHT_DECAY;
+    cfg->schedule = SCHEDULE_STEP;
+    cfg->lr_range_steps = 0;
+    cfg->precision = PRECISION_FP32;
+    cfg->sparse_updates = 0;
+    cfg->qat = 0;
+    cfg->prune = 0.0f;
+    cfg->distill = NULL;
+    cfg->temperature = DISTILL_TEMPERATURE;
+    cfg->binary = 0;
+    cfg->model = NULL;
+    cfg->model_out = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            cfg->seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--epochs") == 0 && i + 1 < argc)
+            cfg->epochs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-aug-cache") == 0)
+            cfg->aug_cache = 0;
+        else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc)
+            cfg->shards = argv[++i];
+        else if (strcmp(argv[i], "--shuffle-buffer") == 0 && i + 1 < argc)
+            cfg->shuffle_buffer = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--make-shards") == 0 && i + 3 < argc)
+        {
+            cfg->make_shards[0] = argv[++i];
+            cfg->make_shards[1] = argv[++i];
+            cfg->make_shards[2] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--factorize") == 0 && i + 2 < argc)
+        {
+            cfg->factorize_from = argv[++i];
+            cfg->factorize_rank = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--compact") == 0 && i + 1 < argc)
+            cfg->compact_from = argv[++i];
+        else if (strcmp(argv[i], "--shard-size") == 0 && i + 1 < argc)
+            cfg->shard_size = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--input-bits") == 0 && i + 1 < argc)
+            cfg->input_bits = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bench-gather") == 0)
+            cfg->bench_gather = 1;
+        else if (strcmp(argv[i], "--executor") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "tasks") == 0)
+                cfg->executor = EXECUTOR_TASKS;
+            else if (strcmp(argv[i], "fork-join") == 0)
+                cfg->executor = EXECUTOR_FORK_JOIN;
+            else
+            {
+                fprintf(stderr, "Unknown executor %s (expected tasks or fork-join)\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--bench-steps") == 0)
+            cfg->bench_steps = i + 1 < argc && argv[i + 1][0] != '-' ? atoi(argv[++i]) : BENCH_STEPS;
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            cfg->batch = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--lr-scaling") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "linear") == 0)
+                cfg->lr_scaling = LR_SCALING_LINEAR;
+            else if (strcmp(argv[i], "sqrt") == 0)
+                cfg->lr_scaling = LR_SCALING_SQRT;
+            else if (strcmp(argv[i], "none") == 0)
+                cfg->lr_scaling = LR_SCALING_NONE;
+            else
+            {
+                fprintf(stderr, "Unknown LR scaling %s (expected linear, sqrt or none)\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--warmup-steps") == 0 && i + 1 < argc)
+            cfg->warmup_steps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--hogwild") == 0)
+            cfg->hogwild = 1;
+        else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+            cfg->checkpoint = argv[++i];
+        else if (strcmp(argv[i], "--resume") == 0)
+            cfg->resume = i + 1 < argc && argv[i + 1][0] != '-' ? argv[++i] : "";
+        else if (strcmp(argv[i], "--init-from") == 0 && i + 1 < argc)
+            cfg->init_from = argv[++i];
+        else if (strcmp(argv[i], "--export-header") == 0)
+        {
+            cfg->export_header = 1;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                cfg->export_from = argv[++i];
+        }
+        else if (strcmp(argv[i], "--val") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "t10k") == 0)
+                cfg->val = VAL_T10K;
+            else if (strcmp(argv[i], "split") == 0)
+                cfg->val = VAL_SPLIT;
+            else if (strcmp(argv[i], "none") == 0)
+                cfg->val = VAL_NONE;
+            else
+            {
+                fprintf(stderr, "Unknown validation set %s (expected t10k, split or none)\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--optimizer") == 0 && i + 1 < argc)
+        {
+            const char *names[] = {"sgd", "nesterov", "adam", "adamw"};
+            i++;
+            cfg->optimizer = -1;
+            for (int k = 0; k < 4; k++)
+            {
+                if (strcmp(argv[i], names[k]) == 0)
+                    cfg->optimizer = k;
+            }
+            if (cfg->optimizer < 0)
+            {
+                fprintf(stderr, "Unknown optimizer %s (expected sgd, nesterov, adam or adamw)\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--schedule") == 0 && i + 1 < argc)
+        {
+            const char *names[] = {"step", "onecycle", "cosine", "linear"};
+            i++;
+            cfg->schedule = -1;
+            for (int k = 0; k < 4; k++)
+            {
+                if (strcmp(argv[i], names[k]) == 0)
+                    cfg->schedule = k;
+            }
+            if (cfg->schedule < 0)
+            {
+                fprintf(stderr, "Unknown schedule %s (expected step, onecycle, cosine or linear)\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--precision") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "fp32") == 0)
+                cfg->precision = PRECISION_FP32;
+            else if (strcmp(argv[i], "bf16") == 0)
+                cfg->precision = PRECISION_BF16;
+            else
+            {
+                fprintf(stderr, "Unknown precision %s (expected fp32 or bf16)\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--sparse-updates") == 0)
+            cfg->sparse_updates = 1;
+        else if (strcmp(argv[i], "--qat") == 0)
+            cfg->qat = 1;
+        else if (strcmp(argv[i], "--binary") == 0)
+            cfg->binary = 1;
+        else if (strcmp(argv[i], "--prune") == 0 && i + 1 < argc)
+            cfg->prune = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "--model") == 0 && i + 1 < argc)
+        {
+            Model shape;
+            cfg->model = argv[++i];
+            if (model_parse(cfg->model, &shape) != 0)
+            {
+                fprintf(stderr, "Invalid model %s (expected up to %d comma-separated WIDTH[:relu|tanh|sigmoid|linear] "
+                        "layers ending in %d:softmax)\n", cfg->model, MODEL_MAX_LAYERS, MODEL_CLASSES);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--distill") == 0 && i + 1 < argc)
+            cfg->distill = argv[++i];
+        else if (strcmp(argv[i], "--temperature") == 0 && i + 1 < argc)
+            cfg->temperature = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "--model-out") == 0 && i + 1 < argc)
+            cfg->model_out = argv[++i];
+        else if (strcmp(argv[i], "--lr-range-test") == 0)
+        {
+            cfg->lr_range_steps = i + 1 < argc && argv[i + 1][0] != '-' ? atoi(argv[++i]) : LR_RANGE_STEPS;
+            if (cfg->lr_range_steps < 2)
+            {
+                fprintf(stderr, "--lr-range-test needs at least 2 steps\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--lr") == 0 && i + 1 < argc)
+            cfg->lr = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "--weight-decay") == 0 && i + 1 < argc)
+            cfg->weight_decay = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "--val-threads") == 0 && i + 1 < argc)
+            cfg->val_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--procs") == 0 && i + 1 < argc)
+            cfg->procs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--target-acc") == 0 && i + 1 < argc)
+            cfg->target_acc = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "--lars") == 0)
+            cfg->lars_eta = i + 1 < argc && argv[i + 1][0] != '-' ? (float)atof(argv[++i]) : LARS_ETA;
+        else
+        {
+            fprintf(stderr,
+                    "Usage: %s [--seed N] [--epochs N] [--no-aug-cache] [--shards PREFIX] [--shuffle-buffer N]\n"
+                    "          [--input-bits 1|2|8] [--bench-gather] [--executor tasks|fork-join] [--bench-steps [N]]\n"
+                    "          [--batch N] [--lr-scaling linear|sqrt|none] [--warmup-steps N] [--lars [ETA]]\n"
+                    "          [--hogwild] [--target-acc PERCENT] [--procs N]\n"
+                    "          [--checkpoint PATH] [--resume [PATH]] [--init-from PATH] [--export-header]\n"
+                    "          [--val t10k|split|none] [--val-threads N] [--optimizer sgd|nesterov|adam|adamw]\n"
+                    "          [--lr X] [--weight-decay X] [--schedule step|onecycle|cosine|linear]\n"
+                    "          [--lr-range-test [STEPS]] [--precision fp32|bf16] [--sparse-updates] [--qat]\n"
+                    "          [--prune SPARSITY] [--model WIDTH[:ACT],...] [--model-out PATH]\n"
+                    "          [--distill TEACHER [--temperature T]] [--binary]\n"
+                    "       %s --export-header CHECKPOINT [--qat]\n"
+                    "       %s --factorize MODEL RANK [--model-out PATH]\n"
+                    "       %s --compact MODEL [--model-out PATH]\n"
+                    "       %s --make-shards IMAGES.gz LABELS.gz PREFIX [--shard-size N]\n",
+                    argv[0], argv[0], argv[0], argv[0], argv[0]);
+            exit(1);
+        }
+    }
+    if (cfg->shuffle_buffer < 1 || cfg->shard_size < 1)
+    {
+        fprintf(stderr, "--shuffle-buffer and --shard-size must be positive\n");
         exit(1);
     }
-    float angle = ((float)rand() / RAND_MAX) * (2.0f * ROTATION_MAX_DEG) - ROTATION_MAX_DEG;
-    rotate_image(input, temp1, angle);
-    int shift_x = rand() % SHIFT_RANGE - SHIFT_OFFSET;
-    int shift_y = rand() % SHIFT_RANGE - SHIFT_OFFSET;
-    memset(temp2, 0, IMAGE_DIM * IMAGE_DIM);
-    for (int y = 0; y < IMAGE_DIM; y++)
+    if (cfg->input_bits != 1 && cfg->input_bits != 2 && cfg->input_bits != 8)
+    {
+        fprintf(stderr, "--input-bits must be 1, 2 or 8\n");
+        exit(1);
+    }
+    if (cfg->batch < BATCH_SIZE || cfg->batch % BATCH_SIZE != 0)
+    {
+        fprintf(stderr, "--batch must be a positive multiple of %d\n", BATCH_SIZE);
+        exit(1);
+    }
+    if (cfg->hogwild && cfg->batch != BATCH_SIZE)
+    {
+        fprintf(stderr, "--hogwild runs one %d-sample batch per thread step and cannot be combined with --batch\n",
+                BATCH_SIZE);
+        exit(1);
+    }
+    if (cfg->procs < 0 || (cfg->procs > 0 && (cfg->hogwild || cfg->batch != BATCH_SIZE || cfg->shards)))
+    {
+        fprintf(stderr, "--procs N needs N >= 1 and cannot be combined with --hogwild, --batch or --shards\n");
+        exit(1);
+    }
+    if (cfg->precision == PRECISION_BF16 && cfg->hogwild)
+    {
+        fprintf(stderr, "--precision bf16 does not support --hogwild\n");
+        exit(1);
+    }
+    if (cfg->sparse_updates && (cfg->optimizer >= OPT_ADAM || cfg->batch > BATCH_SIZE || cfg->hogwild || cfg->procs ||
+                                cfg->schedule == SCHEDULE_ONECYCLE))
+    {
+        fprintf(stderr, "--sparse-updates needs sgd or nesterov on a single process with --batch %d, and a schedule "
+                "other than onecycle\n", BATCH_SIZE);
+        exit(1);
+    }
+    if (cfg->qat && (cfg->precision != PRECISION_FP32 || cfg->hogwild || cfg->sparse_updates))
+    {
+        fprintf(stderr, "--qat trains on fp32 master weights and does not support bf16, --hogwild or "
+                "--sparse-updates\n");
+        exit(1);
+    }
+    if (cfg->prune < 0.0f || cfg->prune >= 1.0f ||
+        (cfg->prune > 0.0f && (cfg->qat || cfg->hogwild || cfg->sparse_updates)))
+    {
+        fprintf(stderr, "--prune takes the fraction of hidden weights to remove, below 1, and does not support --qat, "
+                "--hogwild or --sparse-updates\n");
+        exit(1);
+    }
+    if (cfg->lr_range_steps && (cfg->shards || cfg->model))
+    {
+        fprintf(stderr, "--lr-range-test sweeps the built-in network on the in-memory dataset and does not support "
+                "--shards or --model\n");
+        exit(1);
+    }
+    if (cfg->model && (cfg->qat || cfg->prune > 0.0f || cfg->hogwild || cfg->procs || cfg->batch != BATCH_SIZE ||
+                       cfg->precision != PRECISION_FP32 || cfg->sparse_updates || cfg->resume ||
+                       cfg->export_header || cfg->bench_steps || cfg->bench_gather))
+    {
+        fprintf(stderr, "--model trains in fp32 on a single process with --batch %d and does not support --qat, "
+                "--prune, --hogwild, --sparse-updates, checkpoints (--init-from takes a model file), --export-header "
+                "or the benchmarks\n", BATCH_SIZE);
+        exit(1);
+    }
+    if (cfg->distill && (!cfg->model || cfg->shards || cfg->input_bits != 8 || cfg->temperature <= 0.0f))
+    {
+        fprintf(stderr, "--distill trains a --model student on the in-memory 8-bit dataset (no --shards or "
+                "--input-bits) and needs a positive --temperature\n");
+        exit(1);
+    }
+    /* --export-header leaves model.bin alone unless asked: the recognizer prefers it over the new weights.h. */
+    if (!cfg->model_out && !cfg->export_header)
+        cfg->model_out = MODEL_PATH;
+    if (cfg->binary && !cfg->model)
+    {
+        fprintf(stderr, "--binary trains the first layer of a --model network\n");
+        exit(1);
+    }
+    if (cfg->lr <= 0.0f)
+        cfg->lr = cfg->optimizer >= OPT_ADAM ? ADAM_LR : BASE_LR;
+    if (cfg->resume && !cfg->resume[0])
+        cfg->resume = cfg->checkpoint;
+    if (cfg->resume && cfg->init_from)
+    {
+        fprintf(stderr, "--resume and --init-from are mutually exclusive\n");
+        exit(1);
+    }
+}
+
+/* Views the network as a two-layer model sharing its parameter arrays, int8 ones too under QAT. */
+void network_model(const Network *net, Model *model)
+{
+    memset(model, 0, sizeof(*model));
+    model->input_size = INPUT_SIZE;
+    model_add_layer(model, LAYER_DENSE, HIDDEN_SIZE, 0, ACT_RELU);
+    model_add_layer(model, LAYER_DENSE, OUTPUT_SIZE, 0, ACT_SOFTMAX);
+    model->layers[0].weights = net->hidden_weights;
+    model->layers[0].bias = net->hidden_bias;
+    model->layers[1].weights = net->output_weights;
+    model->layers[1].bias = net->output_bias;
+    if (net->qat)
+    {
+        model->layers[0].qweights = net->qat->hidden_q;
+        model->layers[0].scales = net->qat->hidden_scales;
+        model->layers[1].qweights = net->qat->output_q;
+        model->layers[1].scales = net->qat->output_scales;
+    }
+}
+
+/* Writes src/weights.h, and the model file for the recognizer if model_path is not NULL, from a checkpoint, in
+ * int8 if quantized. Otherwise mostly-zero (pruned) hidden weights are stored in CSR form. */
+int export_header(const char *path, const char *model_path, int quantized)
+{
+    Network net;
+    CheckpointHeader hdr;
+    initialize_network(&net, 0);
+    int rc = checkpoint_load(path, &net, &hdr, 0);
+    if (rc == 0)
     {
-        for (int x = 0; x < IMAGE_DIM; x++)
+        printf("Exporting %s (epoch %d, accuracy %.2f%%) to src/weights.h%s%s\n", path, hdr.epoch,
+               hdr.best_accuracy * 100.0f, model_path ? " and " : "", model_path ? model_path : "");
+        if (quantized)
         {
-            int new_x = x + shift_x;
-            int new_y = y + shift_y;
-            if (new_x >= 0 && new_x < IMAGE_DIM && new_y >= 0 && new_y < IMAGE_DIM)
+            enable_qat(&net);
+            network_fake_quantize(&net);
+        }
+        save_weights(&net);
+        if (!model_path)
+        {
+            free_network(&net);
+            return 0;
+        }
+        Model model;
+        network_model(&net, &model);
+        ModelLayer *hidden = &model.layers[0];
+        double sparsity = model_sparsity(hidden);
+        if (!quantized && sparsity >= MODEL_CSR_MIN_SPARSITY)
+        {
+            if (model_sparsify(hidden) != 0)
             {
-                temp2[new_y * IMAGE_DIM + new_x] = temp1[y * IMAGE_DIM + x];
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
             }
+            printf("Hidden weights %.1f%% zero, stored as CSR\n", sparsity * 100.0);
         }
+        if (model_save(model_path, &model) != 0)
+        {
+            fprintf(stderr, "Failed to write %s\n", model_path);
+            rc = -1;
+        }
+        free(hidden->csr_rows);
+        free(hidden->csr_cols);
+        free(hidden->csr_values);
     }
-    for (int i = 0; i < IMAGE_DIM * IMAGE_DIM; i++)
-    {
-        float_buffer1[i] = temp2[i] / 255.0f;
-    }
-    gaussian_filter(float_buffer1, float_buffer2, IMAGE_DIM, GAUSSIAN_SIGMA);
-    for (int i = 0; i < IMAGE_DIM * IMAGE_DIM; i++)
+    free_network(&net);
+    return rc;
+}
+
+/* Eigen-decomposition of the symmetric n x n matrix a by cyclic Jacobi rotations: a is left with the eigenvalues
+ * on its diagonal and the columns of v are the eigenvectors. */
+static void jacobi_eigen(double *a, int n, double *v)
+{
+    for (int i = 0; i < n * n; i++)
+        v[i] = i % (n + 1) == 0 ? 1.0 : 0.0;
+    for (int sweep = 0; sweep < JACOBI_SWEEPS; sweep++)
     {
-        float val = float_buffer2[i] * 255.0f;
-        output[i] = (unsigned char)((val < 0) ? 0 : ((val > 255) ? 255 : val));
+        double off = 0.0, diag = 0.0;
+        for (int p = 0; p < n; p++)
+        {
+            diag += a[p * n + p] * a[p * n + p];
+            for (int q = p + 1; q < n; q++)
+                off += a[p * n + q] * a[p * n + q];
+        }
+        if (off <= 1e-24 * diag)
+            break;
+        for (int p = 0; p < n; p++)
+        {
+            for (int q = p + 1; q < n; q++)
+            {
+                double apq = a[p * n + q];
+                if (apq == 0.0)
+                    continue;
+                double theta = (a[q * n + q] - a[p * n + p]) / (2.0 * apq);
+                double t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+                double c = 1.0 / sqrt(t * t + 1.0), sn = t * c;
+                for (int k = 0; k < n; k++)
+                {
+                    double akp = a[k * n + p], akq = a[k * n + q];
+                    a[k * n + p] = c * akp - sn * akq;
+                    a[k * n + q] = sn * akp + c * akq;
+                }
+                for (int k = 0; k < n; k++)
+                {
+                    double apk = a[p * n + k], aqk = a[q * n + k];
+                    a[p * n + k] = c * apk - sn * aqk;
+                    a[q * n + k] = sn * apk + c * aqk;
+                }
+                for (int k = 0; k < n; k++)
+                {
+                    double vkp = v[k * n + p], vkq = v[k * n + q];
+                    v[k * n + p] = c * vkp - sn * vkq;
+                    v[k * n + q] = sn * vkp + c * vkq;
+                }
+            }
+        }
     }
-    free(temp1);
-    free(temp2);
-    free(float_buffer1);
-    free(float_buffer2);
 }
 
-void create_augmented_dataset(const unsigned char *train_images, const unsigned char *train_labels,
-                              unsigned char *augmented_images, unsigned char *augmented_labels)
+/* --factorize: replaces a model's first dense layer, W (fan_in x outputs), with its rank-r truncated SVD as two
+ * layers, W V_r (fan_in x r, linear) and V_r^T (r x outputs, with the original bias and activation), where V_r
+ * holds the top r right singular vectors (eigenvectors of W^T W). The recognizer then runs it as two GEMVs of
+ * r * (fan_in + outputs) multiply-adds instead of fan_in * outputs. */
+int factorize_model(const char *path, int rank, const char *model_path)
 {
-    int *digit_counts = (int *)calloc(OUTPUT_SIZE, sizeof(int));
-    int **digit_indices = (int **)malloc(OUTPUT_SIZE * sizeof(int *));
-    for (int i = 0; i < OUTPUT_SIZE; i++)
+    Model src, dst;
+    if (model_load(path, &src) != 0)
     {
-        digit_indices[i] = (int *)malloc(MNIST_TRAIN_SIZE * sizeof(int));
-        digit_counts[i] = 0;
+        fprintf(stderr, "Failed to load model %s\n", path);
+        return -1;
     }
-    for (int i = 0; i < MNIST_TRAIN_SIZE; i++)
+    const ModelLayer *layer = &src.layers[0];
+    int n = layer->out_c, fan_in = layer->fan_in;
+    if (layer->type != LAYER_DENSE || src.num_layers >= MODEL_MAX_LAYERS || rank < 1 || rank >= n || rank >= fan_in)
     {
-        int digit = train_labels[i];
-        digit_indices[digit][digit_counts[digit]++] = i;
+        fprintf(stderr, "--factorize needs a model starting with a dense layer, below %d layers, and a rank from 1 "
+                "to %d\n", MODEL_MAX_LAYERS, (n < fan_in ? n : fan_in) - 1);
+        model_free(&src);
+        return -1;
     }
-    int sample_idx = 0;
-    for (int digit = 0; digit < OUTPUT_SIZE; digit++)
+    if (layer->bits)
     {
-        for (int j = 0; j < SAMPLES_PER_DIGIT; j++)
+        fprintf(stderr, "--factorize cannot factorize the binary first layer of %s; its weights are signs, not a "
+                "low-rank matrix\n", path);
+        model_free(&src);
+        return -1;
+    }
+    double *gram = (double *)calloc((size_t)n * n, sizeof(double));
+    double *v = (double *)malloc((size_t)n * n * sizeof(double));
+    int *order = (int *)malloc(n * sizeof(int));
+    if (!gram || !v || !order)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    double start = now_seconds();
+#pragma omp parallel for schedule(dynamic, 8)
+    for (int i = 0; i < n; i++)
+    {
+        for (int k = 0; k < fan_in; k++)
         {
-            int remain = digit_counts[digit] - j;
-            int rand_idx = j + (rand() % remain);
-            int tmp_idx = digit_indices[digit][j];
-            digit_indices[digit][j] = digit_indices[digit][rand_idx];
-            digit_indices[digit][rand_idx] = tmp_idx;
-            int idx = digit_indices[digit][j];
-            memcpy(&augmented_images[sample_idx * INPUT_SIZE], &train_images[idx * INPUT_SIZE], INPUT_SIZE);
-            augmented_labels[sample_idx] = digit;
-            sample_idx++;
-            augment_digit((unsigned char *)&train_images[idx * INPUT_SIZE], &augmented_images[sample_idx * INPUT_SIZE]);
-            augmented_labels[sample_idx] = digit;
-            sample_idx++;
+            const float *w = &layer->weights[(size_t)k * n];
+            for (int j = i; j < n; j++)
+                gram[i * n + j] += (double)w[i] * w[j];
         }
+        for (int j = i + 1; j < n; j++)
+            gram[j * n + i] = gram[i * n + j];
     }
-    for (int i = 0; i < OUTPUT_SIZE; i++)
+    jacobi_eigen(gram, n, v);
+    /* The eigenvalues (squared singular values) in descending order, by insertion sort. */
+    double total = 0.0, kept = 0.0;
+    for (int i = 0; i < n; i++)
     {
-        free(digit_indices[i]);
+        int j = i;
+        for (; j > 0 && gram[order[j - 1] * (n + 1)] < gram[i * (n + 1)]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+        total += gram[i * (n + 1)];
     }
-    free(digit_indices);
-    free(digit_counts);
-}
+    for (int r = 0; r < rank; r++)
+        kept += gram[order[r] * (n + 1)];
 
-float relu(float x)
-{
-    return (x > 0) ? x : 0;
-}
-
-float relu_derivative(float x)
-{
-    return (x > 0) ? 1.0f : 0.0f;
-}
-
-void softmax(float *input, float *output, int size)
-{
-    float max_val = input[0];
-    for (int i = 1; i < size; i++)
+    memset(&dst, 0, sizeof(dst));
+    dst.input_size = src.input_size;
+    if (src.gather && model_set_gather(&dst, src.gather, src.gather_size) != 0)
     {
-        if (input[i] > max_val)
-            max_val = input[i];
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
     }
-    float sum = 0.0f;
-    for (int i = 0; i < size; i++)
+    model_add_layer(&dst, LAYER_DENSE, rank, 0, ACT_LINEAR);
+    for (int l = 0; l < src.num_layers; l++)
     {
-        output[i] = expf(input[i] - max_val);
-        sum += output[i];
+        const ModelLayer *s = &src.layers[l];
+        model_add_layer(&dst, s->type, s->type == LAYER_POOL ? 0 : s->out_c, s->kernel, s->activation);
     }
-    for (int i = 0; i < size; i++)
+    if (model_alloc(&dst) != 0)
     {
-        output[i] /= sum;
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
     }
-}
-
-void forward_pass(const Network *net, const float *batch_X, float *hidden_layer, float *output_layer)
-{
-#pragma omp parallel for collapse(2)
-    for (int i = 0; i < BATCH_SIZE; i++)
+    ModelLayer *down = &dst.layers[0], *up = &dst.layers[1];
+    for (int k = 0; k < fan_in; k++)
     {
-        for (int j = 0; j < HIDDEN_SIZE; j++)
+        const float *w = &layer->weights[(size_t)k * n];
+        for (int r = 0; r < rank; r++)
         {
-            float sum = net->hidden_bias[j];
-            for (int k = 0; k < INPUT_SIZE; k++)
-            {
-                sum += batch_X[i * INPUT_SIZE + k] * net->hidden_weights[k * HIDDEN_SIZE + j];
-            }
-            hidden_layer[i * HIDDEN_SIZE + j] = relu(sum);
+            double sum = 0.0;
+            for (int j = 0; j < n; j++)
+                sum += w[j] * v[j * n + order[r]];
+            down->weights[(size_t)k * rank + r] = (float)sum;
         }
     }
-
-#pragma omp parallel for
-    for (int i = 0; i < BATCH_SIZE; i++)
+    for (int r = 0; r < rank; r++)
     {
-        float tmp[OUTPUT_SIZE];
-        for (int j = 0; j < OUTPUT_SIZE; j++)
-        {
-            float sum = net->output_bias[j];
-            for (int k = 0; k < HIDDEN_SIZE; k++)
-            {
-                sum += hidden_layer[i * HIDDEN_SIZE + k] * net->output_weights[k * OUTPUT_SIZE + j];
-            }
-            tmp[j] = sum;
-        }
-        softmax(tmp, &output_layer[i * OUTPUT_SIZE], OUTPUT_SIZE);
+        for (int j = 0; j < n; j++)
+            up->weights[(size_t)r * n + j] = (float)v[j * n + order[r]];
+    }
+    memcpy(up->bias, layer->bias, n * sizeof(float));
+    for (int l = 1; l < src.num_layers; l++)
+    {
+        const ModelLayer *s = &src.layers[l];
+        if (s->type == LAYER_POOL)
+            continue;
+        memcpy(dst.layers[l + 1].weights, s->weights, (size_t)s->fan_in * s->out_c * sizeof(float));
+        memcpy(dst.layers[l + 1].bias, s->bias, s->out_c * sizeof(float));
     }
+    char desc[256];
+    model_describe(&dst, desc, sizeof(desc));
+    printf("Factorized %s at rank %d in %.2f s: %s, %.2f%% of the spectral energy kept, %zu -> %zu multiply-adds\n",
+           path, rank, now_seconds() - start, desc, 100.0 * kept / total, model_macs(&src), model_macs(&dst));
+    int rc = model_save(model_path, &dst);
+    if (rc != 0)
+        fprintf(stderr, "Failed to write %s\n", model_path);
+    else
+        printf("Saved %s\n", model_path);
+    free(gram);
+    free(v);
+    free(order);
+    model_free(&src);
+    model_free(&dst);
+    return rc;
 }
 
-void compute_loss_accuracy(const float *output_layer, const float *batch_y_onehot, const unsigned char *labels,
-                           int start_idx, float *batch_loss, float *batch_acc)
+/* Marks the first layer's inputs that are non-zero, and its units whose output is non-zero, in any sample. The
+ * first layer is run alone through model_forward, so the statistics come from the recognizer's own kernel. */
+static void activation_stats(const Model *model, const Dataset *data, unsigned char *lit, unsigned char *active)
 {
-    float loss_val = 0.0f;
-    int correct = 0;
-    for (int i = 0; i < BATCH_SIZE; i++)
+    Model first = *model;
+    first.num_layers = 1;
+    const ModelLayer *layer = &model->layers[0];
+#pragma omp parallel
     {
-        float single_loss = 0.0f;
-        float max_prob = output_layer[i * OUTPUT_SIZE];
-        int predicted = 0;
-        for (int j = 0; j < OUTPUT_SIZE; j++)
+        float *input = allocate_array(INPUT_SIZE);
+        float *output = allocate_array(layer->outputs);
+        float *scratch = allocate_array(model_scratch_size(&first));
+        unsigned char *my_lit = (unsigned char *)calloc(layer->inputs, 1);
+        unsigned char *my_active = (unsigned char *)calloc(layer->outputs, 1);
+        if (!my_lit || !my_active)
         {
-            float prob = output_layer[i * OUTPUT_SIZE + j];
-            if (prob > max_prob)
-            {
-                max_prob = prob;
-                predicted = j;
-            }
-            if (batch_y_onehot[i * OUTPUT_SIZE + j] > 0.5f)
-            {
-                single_loss -= logf(prob + EPS);
-            }
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+#pragma omp for schedule(dynamic, BATCH_SIZE)
+        for (int s = 0; s < data->count; s++)
+        {
+            const unsigned char *image = &data->images[(size_t)s * INPUT_SIZE];
+            for (int j = 0; j < INPUT_SIZE; j++)
+                input[j] = image[j] * PIXEL_SCALE;
+            for (int i = 0; i < layer->inputs; i++)
+                my_lit[i] |= image[model->gather ? model->gather[i] : i] != 0;
+            model_forward(&first, input, output, scratch);
+            for (int j = 0; j < layer->outputs; j++)
+                my_active[j] |= output[j] != 0.0f;
         }
-        if (predicted == labels[start_idx + i])
+#pragma omp critical
         {
-            correct++;
+            for (int i = 0; i < layer->inputs; i++)
+                lit[i] |= my_lit[i];
+            for (int j = 0; j < layer->outputs; j++)
+                active[j] |= my_active[j];
         }
-        loss_val += single_loss;
+        free(input);
+        free(output);
+        free(scratch);
+        free(my_lit);
+        free(my_active);
     }
-    *batch_loss = loss_val / BATCH_SIZE;
-    *batch_acc = (float)correct / BATCH_SIZE;
 }
 
-void backward_pass(const Network *net, const float *batch_X, const float *hidden_layer, const float *output_layer,
-                   const float *batch_y_onehot, float *hidden_error, float *output_error, float *dw_hidden,
-                   float *dw_output, float *db_hidden, float *db_output)
+/* Copies a layer's parameters keeping the weight rows in rows and the outputs in cols (NULL keeps all), in the
+ * layer's storage format: int8 weights are repacked, binary signs repacked and CSR rebuilt from the copied
+ * weights. */
+static int copy_layer(const ModelLayer *src, const int *rows, const int *cols, ModelLayer *dst)
 {
-#pragma omp parallel sections
+    for (int k = 0; k < dst->fan_in; k++)
     {
-#pragma omp section
-        memset(dw_hidden, 0, INPUT_SIZE * HIDDEN_SIZE * sizeof(float));
-#pragma omp section
-        memset(dw_output, 0, HIDDEN_SIZE * OUTPUT_SIZE * sizeof(float));
-#pragma omp section
-        memset(db_hidden, 0, HIDDEN_SIZE * sizeof(float));
-#pragma omp section
-        memset(db_output, 0, OUTPUT_SIZE * sizeof(float));
+        size_t from = (size_t)(rows ? rows[k] : k) * src->out_c, to = (size_t)k * dst->out_c;
+        for (int j = 0; j < dst->out_c; j++)
+            dst->weights[to + j] = src->weights[from + (cols ? cols[j] : j)];
     }
-
-#pragma omp parallel for collapse(2)
-    for (int i = 0; i < BATCH_SIZE; i++)
+    for (int j = 0; j < dst->out_c; j++)
+        dst->bias[j] = src->bias[cols ? cols[j] : j];
+    if (src->qweights)
     {
-        for (int j = 0; j < OUTPUT_SIZE; j++)
+        if (model_alloc_quantized(dst) != 0)
+            return -1;
+        for (int k = 0; k < dst->fan_in; k++)
         {
-            output_error[i * OUTPUT_SIZE + j] = output_layer[i * OUTPUT_SIZE + j] - batch_y_onehot[i * OUTPUT_SIZE + j];
+            size_t from = (size_t)(rows ? rows[k] : k) * src->out_c, to = (size_t)k * dst->out_c;
+            for (int j = 0; j < dst->out_c; j++)
+                dst->qweights[to + j] = src->qweights[from + (cols ? cols[j] : j)];
         }
+        for (int j = 0; j < dst->out_c; j++)
+            dst->scales[j] = src->scales[cols ? cols[j] : j];
+        return model_pack_quantized(dst);
     }
-
-#pragma omp parallel for collapse(2)
-    for (int i = 0; i < BATCH_SIZE; i++)
+    if (src->bits)
     {
-        for (int j = 0; j < HIDDEN_SIZE; j++)
+        if (model_binarize(dst) != 0)
+            return -1;
+        /* model_binarize takes each scale as a mean again, which can round differently; keep the source's. */
+        for (int j = 0; j < dst->out_c; j++)
+            dst->scales[j] = src->scales[cols ? cols[j] : j];
+        for (int k = 0; k < dst->fan_in; k++)
         {
-            float sum_err = 0.0f;
-            for (int k = 0; k < OUTPUT_SIZE; k++)
-            {
-                sum_err += output_error[i * OUTPUT_SIZE + k] * net->output_weights[j * OUTPUT_SIZE + k];
-            }
-            hidden_error[i * HIDDEN_SIZE + j] = sum_err * relu_derivative(hidden_layer[i * HIDDEN_SIZE + j]);
+            float *w = &dst->weights[(size_t)k * dst->out_c];
+            for (int j = 0; j < dst->out_c; j++)
+                w[j] = copysignf(dst->scales[j], w[j]);
         }
+        return 0;
     }
+    return src->csr_rows ? model_sparsify(dst) : 0;
+}
 
-#pragma omp parallel
+/* Probabilities of both models over a dataset: the largest difference and the number of samples whose outputs
+ * differ at all. */
+static void compare_models(const Model *a, const Model *b, const Dataset *data, float *max_diff, int *differing)
+{
+    float worst = 0.0f;
+    int count = 0;
+#pragma omp parallel reduction(max : worst) reduction(+ : count)
     {
-#pragma omp for collapse(2)
-        for (int j = 0; j < INPUT_SIZE; j++)
-        {
-            for (int k = 0; k < HIDDEN_SIZE; k++)
-            {
-                float grad = 0.0f;
-                for (int i = 0; i < BATCH_SIZE; i++)
-                {
-                    grad += batch_X[i * INPUT_SIZE + j] * hidden_error[i * HIDDEN_SIZE + k];
-                }
-                dw_hidden[j * HIDDEN_SIZE + k] = grad / BATCH_SIZE;
-            }
-        }
-
-#pragma omp for collapse(2)
-        for (int j = 0; j < HIDDEN_SIZE; j++)
+        float *input = allocate_array(INPUT_SIZE);
+        float *scratch_a = allocate_array(model_scratch_size(a));
+        float *scratch_b = allocate_array(model_scratch_size(b));
+        float pa[OUTPUT_SIZE], pb[OUTPUT_SIZE];
+#pragma omp for schedule(dynamic, BATCH_SIZE)
+        for (int s = 0; s < data->count; s++)
         {
-            for (int k = 0; k < OUTPUT_SIZE; k++)
+            for (int j = 0; j < INPUT_SIZE; j++)
+                input[j] = data->images[(size_t)s * INPUT_SIZE + j] * PIXEL_SCALE;
+            model_forward(a, input, pa, scratch_a);
+            model_forward(b, input, pb, scratch_b);
+            int differs = 0;
+            for (int j = 0; j < OUTPUT_SIZE; j++)
             {
-                float grad = 0.0f;
-                for (int i = 0; i < BATCH_SIZE; i++)
-                {
-                    grad += hidden_layer[i * HIDDEN_SIZE + j] * output_error[i * OUTPUT_SIZE + k];
-                }
-                dw_output[j * OUTPUT_SIZE + k] = grad / BATCH_SIZE;
+                float d = fabsf(pa[j] - pb[j]);
+                worst = d > worst ? d : worst;
+                differs |= pa[j] != pb[j];
             }
+            count += differs;
         }
+        free(input);
+        free(scratch_a);
+        free(scratch_b);
+    }
+    *max_diff = worst;
+    *differing = count;
+}
 
-#pragma omp for
-        for (int j = 0; j < HIDDEN_SIZE; j++)
+/* --compact: runs the training images (and the MNIST test set when present) through a model, then drops the
+ * pixels that are zero in every image, by gathering the rest, and the first-layer units whose output is zero in
+ * every image, with their rows of the next layer. Both only ever add zero terms to sums, so the compacted model
+ * gives bit-identical outputs on those images. The model file is only written if it does. */
+int compact_model(const char *path, const char *model_path)
+{
+    Model src, dst;
+    if (model_load(path, &src) != 0)
+    {
+        fprintf(stderr, "Failed to load model %s\n", path);
+        return -1;
+    }
+    if (src.layers[0].type != LAYER_DENSE || src.num_layers < 2)
+    {
+        fprintf(stderr, "--compact needs a model starting with a dense hidden layer\n");
+        model_free(&src);
+        return -1;
+    }
+    Dataset data[2] = {{0}};
+    int sets = 1;
+    load_mnist_data(&data[0]);
+    if (access(T10K_IMAGES, R_OK) == 0 && access(T10K_LABELS, R_OK) == 0)
+        load_idx_dataset(T10K_IMAGES, T10K_LABELS, &data[sets++]);
+    const ModelLayer *first = &src.layers[0], *next = &src.layers[1];
+    int inputs = first->inputs, units = first->outputs, samples = 0;
+    unsigned char *lit = (unsigned char *)calloc(inputs, 1);
+    unsigned char *active = (unsigned char *)calloc(units, 1);
+    int *rows = (int *)malloc(inputs * sizeof(int));
+    int *cols = (int *)malloc(units * sizeof(int));
+    uint16_t *pixels = (uint16_t *)malloc(inputs * sizeof(uint16_t));
+    if (!lit || !active || !rows || !cols || !pixels)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    double start = now_seconds();
+    for (int d = 0; d < sets; d++)
+    {
+        activation_stats(&src, &data[d], lit, active);
+        samples += data[d].count;
+    }
+    int kept_inputs = 0, kept_units = 0;
+    for (int i = 0; i < inputs; i++)
+    {
+        if (lit[i])
         {
-            float grad = 0.0f;
-            for (int i = 0; i < BATCH_SIZE; i++)
-            {
-                grad += hidden_error[i * HIDDEN_SIZE + j];
-            }
-            db_hidden[j] = grad / BATCH_SIZE;
+            pixels[kept_inputs] = src.gather ? src.gather[i] : (uint16_t)i;
+            rows[kept_inputs++] = i;
         }
+    }
+    /* A unit can only go if the next layer is dense, so that it owns one weight row there. */
+    for (int j = 0; j < units; j++)
+    {
+        if (active[j] || next->type != LAYER_DENSE)
+            cols[kept_units++] = j;
+    }
+    printf("Analysed %d images in %.2f s: %d of %d inputs ever non-zero, %d of %d first-layer units ever active\n",
+           samples, now_seconds() - start, kept_inputs, inputs, kept_units, units);
 
-#pragma omp for
-        for (int j = 0; j < OUTPUT_SIZE; j++)
+    int rc = -1;
+    memset(&dst, 0, sizeof(dst));
+    dst.input_size = src.input_size;
+    if (kept_inputs == 0 || kept_units == 0 ||
+        ((src.gather || kept_inputs < inputs) && model_set_gather(&dst, pixels, kept_inputs) != 0))
+    {
+        fprintf(stderr, "Nothing left to compact into\n");
+        goto done;
+    }
+    model_add_layer(&dst, LAYER_DENSE, kept_units, 0, first->activation);
+    for (int l = 1; l < src.num_layers; l++)
+    {
+        const ModelLayer *layer = &src.layers[l];
+        model_add_layer(&dst, layer->type, layer->type == LAYER_POOL ? 0 : layer->out_c, layer->kernel,
+                        layer->activation);
+    }
+    if (model_alloc(&dst) != 0 || copy_layer(first, rows, cols, &dst.layers[0]) != 0 ||
+        (next->type == LAYER_DENSE && copy_layer(next, cols, NULL, &dst.layers[1]) != 0))
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int l = next->type == LAYER_DENSE ? 2 : 1; l < src.num_layers; l++)
+    {
+        if (src.layers[l].type != LAYER_POOL && copy_layer(&src.layers[l], NULL, NULL, &dst.layers[l]) != 0)
         {
-            float grad = 0.0f;
-            for (int i = 0; i < BATCH_SIZE; i++)
-            {
-                grad += output_error[i * OUTPUT_SIZE + j];
-            }
-            db_output[j] = grad / BATCH_SIZE;
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
         }
     }
+    float max_diff = 0.0f;
+    int differing = 0;
+    for (int d = 0; d < sets; d++)
+    {
+        float diff;
+        int n;
+        compare_models(&src, &dst, &data[d], &diff, &n);
+        max_diff = diff > max_diff ? diff : max_diff;
+        differing += n;
+    }
+    char desc[256];
+    model_describe(&dst, desc, sizeof(desc));
+    printf("Compacted to %s: %zu -> %zu parameters, %zu -> %zu multiply-adds; outputs differ on %d of %d images "
+           "(max %g)\n",
+           desc, model_param_count(&src), model_param_count(&dst), model_macs(&src), model_macs(&dst), differing,
+           samples, max_diff);
+    if (differing > 0)
+    {
+        fprintf(stderr, "The compacted model does not reproduce %s; not writing %s\n", path, model_path);
+        goto done;
+    }
+    rc = model_save(model_path, &dst);
+    if (rc != 0)
+        fprintf(stderr, "Failed to write %s\n", model_path);
+    else
+        printf("Saved %s\n", model_path);
+done:
+    for (int d = 0; d < sets; d++)
+        free_dataset(&data[d]);
+    free(lit);
+    free(active);
+    free(rows);
+    free(cols);
+    free(pixels);
+    model_free(&src);
+    model_free(&dst);
+    return rc;
 }
 
-void update_network(Network *net, const float *dw_hidden, const float *dw_output, const float *db_hidden,
-                    const float *db_output, float learning_rate)
+int main(int argc, char **argv)
 {
-#pragma omp parallel sections
+    TrainConfig cfg;
+    parse_args(argc, argv, &cfg);
+    if (cfg.make_shards[0])
+    {
+        make_shards(cfg.make_shards[0], cfg.make_shards[1], cfg.make_shards[2], cfg.shard_size);
+        return 0;
+    }
+    if (cfg.export_from)
+        return export_header(cfg.export_from, cfg.model_out, cfg.qat) == 0 ? 0 : 1;
+    if (cfg.factorize_from)
+        return factorize_model(cfg.factorize_from, cfg.factorize_rank, cfg.model_out) == 0 ? 0 : 1;
+    if (cfg.compact_from)
+        return compact_model(cfg.compact_from, cfg.model_out) == 0 ? 0 : 1;
+    Comm comm;
+    Comm *commp = NULL;
+    if (cfg.procs > 0)
     {
-#pragma omp section
+        /* Fork before any OpenMP team exists. Each rank gets an equal share of the cores and only rank 0 talks. */
+        comm.rank = 0;
+        comm.size = 1;
+        if (cfg.procs > 1)
+            launch_ranks(&cfg, &comm);
+        if (!getenv("OMP_NUM_THREADS"))
         {
-            for (int i = 0; i < INPUT_SIZE * HIDDEN_SIZE; i++)
-            {
-                net->hidden_weights_momentum[i] =
-                    MOMENTUM * net->hidden_weights_momentum[i] - learning_rate * dw_hidden[i];
-                net->hidden_weights[i] += net->hidden_weights_momentum[i];
-            }
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            omp_set_num_threads(cpus > cfg.procs ? (int)(cpus / cfg.procs) : 1);
         }
-#pragma omp section
+        if (comm.rank != 0 && !freopen("/dev/null", "w", stdout))
         {
-            for (int i = 0; i < HIDDEN_SIZE; i++)
-            {
-                net->hidden_bias_momentum[i] = MOMENTUM * net->hidden_bias_momentum[i] - learning_rate * db_hidden[i];
-                net->hidden_bias[i] += net->hidden_bias_momentum[i];
-            }
+            fprintf(stderr, "Failed to silence rank %d\n", comm.rank);
+            exit(1);
         }
-#pragma omp section
+        cfg.batch = BATCH_SIZE * cfg.procs;
+        commp = &comm;
+    }
+    double start = now_seconds();
+    Network net;
+    initialize_network(&net, cfg.seed);
+    net.opt.type = cfg.optimizer;
+    net.opt.beta1 = ADAM_BETA1;
+    net.opt.beta2 = ADAM_BETA2;
+    net.opt.eps = ADAM_EPS;
+    net.opt.weight_decay = cfg.weight_decay;
+    net.opt.momentum = MOMENTUM;
+    ModelTrainer mt;
+    if (cfg.model)
+        model_trainer_init(&mt, cfg.model, &net.opt, cfg.seed);
+    CheckpointHeader state = {0};
+    state.optimizer = (uint32_t)cfg.optimizer;
+    state.seed = cfg.seed;
+    state.schedule = (uint32_t)cfg.schedule;
+    state.epochs = cfg.epochs;
+    state.peak_lr = schedule_peak(&cfg);
+    if (cfg.model && cfg.init_from)
+    {
+        model_trainer_load(&mt, cfg.init_from);
+    }
+    else if (cfg.resume || cfg.init_from)
+    {
+        const char *path = cfg.resume ? cfg.resume : cfg.init_from;
+        CheckpointHeader loaded;
+        if (checkpoint_load(path, &net, &loaded, cfg.resume != NULL) != 0)
+            exit(1);
+        if (cfg.resume)
         {
-            for (int i = 0; i < HIDDEN_SIZE * OUTPUT_SIZE; i++)
+            if ((int)loaded.optimizer != cfg.optimizer)
             {
-                net->output_weights_momentum[i] =
-                    MOMENTUM * net->output_weights_momentum[i] - learning_rate * dw_output[i];
-                net->output_weights[i] += net->output_weights_momentum[i];
+                fprintf(stderr, "%s was trained with a different optimizer; use --init-from to switch\n", path);
+                exit(1);
             }
-        }
-#pragma omp section
-        {
-            for (int i = 0; i < OUTPUT_SIZE; i++)
+            /* The annealing schedules spread over the whole run, so only the step schedule can extend --epochs. */
+            if ((int)loaded.schedule != cfg.schedule || loaded.peak_lr != state.peak_lr ||
+                (cfg.schedule != SCHEDULE_STEP && loaded.epochs != cfg.epochs))
             {
-                net->output_bias_momentum[i] = MOMENTUM * net->output_bias_momentum[i] - learning_rate * db_output[i];
-                net->output_bias[i] += net->output_bias_momentum[i];
+                fprintf(stderr, "%s was trained with a different --schedule, --lr (after batch scaling) or --epochs; "
+                        "a resumed run must keep them\n", path);
+                exit(1);
             }
+            /* The seed keys augmentation and every epoch's shuffle, so a resumed run must keep the original. */
+            state = loaded;
+            state.epochs = cfg.epochs;
+            net.opt.t = state.step;
+            cfg.seed = state.seed;
+            printf("Resuming from %s after epoch %d (seed %llu)\n", path, state.epoch,
+                   (unsigned long long)state.seed);
+        }
+        else
+        {
+            printf("Initialized weights from %s\n", path);
         }
     }
-}
-
-void save_weights(Network *net)
-{
-    FILE *f = fopen("src/weights.h", "w");
-    if (!f)
+    if (cfg.binary)
+        model_trainer_binarize(&mt);
+    TrainingResources res;
+    initialize_training_resources(&res);
+    DataParallel dp;
+    DataParallel *dpp = NULL;
+    if (cfg.hogwild)
     {
-        fprintf(stderr, "Error opening weights.h for writing\n");
-        return;
+        data_parallel_init(&dp, 1, omp_get_max_threads());
+        dpp = &dp;
     }
-    fprintf(f, "#ifndef WEIGHTS_H\n#define WEIGHTS_H\n\n");
-    fprintf(f, "#define INPUT_SIZE %d\n", INPUT_SIZE);
-    fprintf(f, "#define HIDDEN_SIZE %d\n", HIDDEN_SIZE);
-    fprintf(f, "#define OUTPUT_SIZE %d\n\n", OUTPUT_SIZE);
-    fprintf(f, "static const float HIDDEN_WEIGHTS[INPUT_SIZE * HIDDEN_SIZE] = {\n");
-    for (int i = 0; i < INPUT_SIZE * HIDDEN_SIZE; i++)
+    else if (cfg.batch > BATCH_SIZE && !commp)
     {
-        fprintf(f, "    %10.6ff%s", net->hidden_weights[i], (i + 1 < INPUT_SIZE * HIDDEN_SIZE) ? "," : "");
-        if ((i + 1) % 8 == 0)
-            fprintf(f, "\n");
+        int micro_batches = cfg.batch / BATCH_SIZE;
+        data_parallel_init(&dp, micro_batches,
+                           omp_get_max_threads() < micro_batches ? omp_get_max_threads() : micro_batches);
+        dpp = &dp;
     }
-    fprintf(f, "};\n\n");
-    fprintf(f, "static const float HIDDEN_BIAS[HIDDEN_SIZE] = {\n");
-    for (int i = 0; i < HIDDEN_SIZE; i++)
+    if (cfg.precision == PRECISION_BF16)
+        enable_bf16(&net, &res, dpp);
+    if (cfg.sparse_updates)
+        enable_lazy_updates(&net);
+    if (cfg.qat)
     {
-        fprintf(f, "    %10.6ff%s", net->hidden_bias[i], (i + 1 < HIDDEN_SIZE) ? "," : "");
-        if ((i + 1) % 8 == 0)
-            fprintf(f, "\n");
+        enable_qat(&net);
+        printf("Quantization-aware training: int8 weights (per-unit scales), uint8 hidden activations\n");
     }
-    fprintf(f, "};\n\n");
-    fprintf(f, "static const float OUTPUT_WEIGHTS[HIDDEN_SIZE * OUTPUT_SIZE] = {\n");
-    for (int i = 0; i < HIDDEN_SIZE * OUTPUT_SIZE; i++)
+    if (cfg.prune > 0.0f)
+        enable_pruning(&net, cfg.prune);
+    if (commp)
+        comm_start(commp, res.grad);
+    BatchSource src;
+    /* Validation defaults to t10k when it is present and otherwise holds out the last VALIDATION_SPLIT training
+     * images, which are then excluded from augmentation; streamed shards can only validate on t10k. */
+    int has_t10k = access(T10K_IMAGES, R_OK) == 0 && access(T10K_LABELS, R_OK) == 0;
+    if (cfg.val == VAL_AUTO)
+        cfg.val = has_t10k ? VAL_T10K : cfg.shards ? VAL_NONE : VAL_SPLIT;
+    if ((cfg.val == VAL_T10K && !has_t10k) || (cfg.val == VAL_SPLIT && cfg.shards))
     {
-        fprintf(f, "    %10.6ff%s", net->output_weights[i], (i + 1 < HIDDEN_SIZE * OUTPUT_SIZE) ? "," : "");
-        if ((i + 1) % 8 == 0)
-            fprintf(f, "\n");
+        fprintf(stderr, "Validation set unavailable: %s\n", cfg.shards ? "shards need " T10K_IMAGES : T10K_IMAGES);
+        exit(1);
     }
-    fprintf(f, "};\n\n");
-    fprintf(f, "static const float OUTPUT_BIAS[OUTPUT_SIZE] = {\n");
-    for (int i = 0; i < OUTPUT_SIZE; i++)
+    /* Only rank 0 validates, so the other ranks neither load t10k nor start a validator. */
+    int validates = cfg.val != VAL_NONE && (!commp || commp->rank == 0);
+    int val_threads = cfg.val_threads > 0 ? cfg.val_threads : omp_get_max_threads() / 4;
+    if (val_threads < 1)
+        val_threads = 1;
+    Dataset val_data = {0};
+    if (cfg.val == VAL_T10K && validates)
+        load_idx_dataset(T10K_IMAGES, T10K_LABELS, &val_data);
+    Validator val;
+    Validator *valp = NULL;
+    if (cfg.shards)
     {
-        fprintf(f, "    %10.6ff%s", net->output_bias[i], (i + 1 < OUTPUT_SIZE) ? "," : "");
-        if ((i + 1) % 8 == 0)
-            fprintf(f, "\n");
+        ShardStream stream;
+        if (validates)
+        {
+            quantize_images((unsigned char *)val_data.images, val_data.count, cfg.input_bits);
+            if (!cfg.model)
+            {
+                validator_start(&val, &val_data, val_threads, cfg.qat);
+                valp = &val;
+            }
+        }
+        shard_stream_open(&stream, cfg.shards, cfg.seed, cfg.shuffle_buffer);
+        batch_source_init(&src, NULL, NULL, &stream, cfg.input_bits);
+        if (cfg.model)
+            train_model(&mt, &src, &res, cfg.val != VAL_NONE ? &val_data : NULL, &cfg);
+        else
+            train_network(&net, &src, &res, dpp, commp, valp, &state, &cfg);
+        shard_stream_close(&stream);
     }
-    fprintf(f, "};\n\n");
-    fprintf(f, "#endif /* WEIGHTS_H */\n");
-    fclose(f);
-    printf("Successfully saved weights to src/weights.h\n");
-}
-
-int main(void)
-{
-    srand(RAND_SEED);
-    Network net;
-    initialize_network(&net);
-    unsigned char *train_images, *train_labels;
-    load_mnist_data(&train_images, &train_labels);
-    unsigned char *aug_images = (unsigned char *)malloc(TOTAL_SAMPLES * INPUT_SIZE);
-    unsigned char *aug_labels = (unsigned char *)malloc(TOTAL_SAMPLES);
-    if (!aug_images || !aug_labels)
+    else
     {
-        fprintf(stderr, "Failed to allocate memory for augmented dataset\n");
-        return 1;
+        Dataset train, aug;
+        load_mnist_data(&train);
+        int pool = train.count;
+        if (cfg.val == VAL_SPLIT)
+        {
+            pool = train.count - VALIDATION_SPLIT;
+            if (validates)
+                copy_dataset_range(&train, pool, VALIDATION_SPLIT, &val_data);
+        }
+        load_augmented_data(&train, pool, &cfg, &aug);
+        free_dataset(&train);
+        if (validates)
+        {
+            quantize_images((unsigned char *)val_data.images, val_data.count, cfg.input_bits);
+            if (!cfg.model)
+            {
+                validator_start(&val, &val_data, val_threads, cfg.qat);
+                valp = &val;
+            }
+        }
+        if (cfg.bench_gather)
+        {
+            bench_gather(&aug, &res, cfg.seed);
+            free_dataset(&aug);
+            if (valp)
+                validator_stop(valp);
+            free_dataset(&val_data);
+            if (dpp)
+                data_parallel_free(dpp);
+            if (commp)
+                comm_stop(commp);
+            free_training_resources(&res);
+            free_network(&net);
+            return 0;
+        }
+        PackedDataset packed = {0};
+        if (cfg.input_bits < 8)
+        {
+            pack_dataset(&aug, cfg.input_bits, &packed);
+            printf("Packed %d images at %d bit(s)/pixel: %.1f MB -> %.1f MB\n", aug.count, cfg.input_bits,
+                   (double)aug.count * INPUT_SIZE / 1e6, (double)aug.count * packed.row_bytes / 1e6);
+            free_dataset(&aug);
+        }
+        printf("Dataset ready in %.1f ms\n", (now_seconds() - start) * 1000.0);
+        batch_source_init(&src, &aug, cfg.input_bits < 8 ? &packed : NULL, NULL, cfg.input_bits);
+        if (cfg.bench_steps > 0)
+            bench_executors(&net, &src, &res, &cfg);
+        else if (cfg.lr_range_steps > 0)
+            lr_range_test(&net, &src, &res, &cfg);
+        else if (cfg.model)
+        {
+            if (cfg.distill)
+                model_trainer_distill(&mt, cfg.distill, &aug, cfg.temperature);
+            train_model(&mt, &src, &res, cfg.val != VAL_NONE ? &val_data : NULL, &cfg);
+        }
+        else
+        {
+            train_network(&net, &src, &res, dpp, commp, valp, &state, &cfg);
+        }
+        free_packed_dataset(&packed);
+        free_dataset(&aug);
     }
-    create_augmented_dataset(train_images, train_labels, aug_images, aug_labels);
-    TrainingResources res;
-    initialize_training_resources(&res);
-    train_network(&net, aug_images, aug_labels, TOTAL_SAMPLES, &res);
+    batch_source_free(&src);
+    if (valp)
+        validator_stop(valp);
+    free_dataset(&val_data);
+    if (dpp)
+        data_parallel_free(dpp);
+    if (commp)
+        comm_stop(commp);
     free_training_resources(&res);
-    free(aug_images);
-    free(aug_labels);
-    free(train_images);
-    free(train_labels);
     free_network(&net);
+    if (cfg.model)
+        model_trainer_free(&mt);
+    if (cfg.export_header && (!commp || commp->rank == 0) && cfg.bench_steps == 0 && cfg.lr_range_steps == 0)
+    {
+        char best_path[256];
+        snprintf(best_path, sizeof(best_path), CHECKPOINT_BEST_FORMAT, cfg.checkpoint);
+        return export_header(best_path, cfg.model_out, cfg.qat) == 0 ? 0 : 1;
+    }
     return 0;
 }